@@ -17,21 +17,148 @@ extern "C" {
 #include "bitmap.h"
 void abort(void) __attribute__((noreturn)); /* keep dependencies down */
 
-union sym_or_reloc_rec;
+/* A metavector record identifies one symbol span by the table it comes
+ * from and its index there. It also holds the span's start, as an offset
+ * from the segment's p_vaddr, so that we can search the metavector
+ * without chasing into the symbol table. librunt only makes dynsym and
+ * symtab records; the other kinds are for extenders (e.g. liballocs). */
+enum sym_or_reloc_kind
+{
+	REC_DYNSYM = 0,
+	REC_SYMTAB = 1,
+	REC_EXTRASYM = 2,
+	REC_RELOC = 3
+};
+union sym_or_reloc_rec
+{
+	struct
+	{
+		unsigned kind:2; /* an enum sym_or_reloc_kind */
+		unsigned idx:30;
+		unsigned vaddr_off; /* offset of the span's start within the segment, clipped past earlier spans */
+	} sym;
+	unsigned long long raw;
+};
+/* tools/embed-meta puts a symbol index into the file itself, in its own
+ * PT_LOAD, and adds a PT_NOTE with one of these notes pointing to it. */
+#define LIBRUNT_NOTE_NAME "librunt"
+#define NT_LIBRUNT_META 0x4d455441 /* "META" */
+struct librunt_meta_note
+{
+	uint64_t symidx_vaddr;
+	uint64_t symidx_size;
+};
+/* One note from a PT_NOTE segment or SHT_NOTE section in memory. */
+struct elf_note
+{
+	ElfW(Word) type;
+	const char *name; /* not necessarily NUL-terminated; namesz says */
+	ElfW(Word) namesz;
+	const void *desc;
+	ElfW(Word) descsz;
+};
+/* Step *pos over the next note before end, or return false if there is
+ * none, or it is truncated. Notes are 4-aligned except in segments and
+ * sections that say 8, such as those holding GNU property notes. */
+static inline _Bool elf_note_next(const char **pos, const char *end,
+	ElfW(Xword) align, struct elf_note *out)
+{
+	size_t a = (align == 8) ? 8 : 4;
+	if (*pos >= end || (size_t)(end - *pos) < sizeof (ElfW(Nhdr))) return 0;
+	const ElfW(Nhdr) *nhdr = (const ElfW(Nhdr) *) *pos;
+	size_t avail = end - *pos;
+	size_t desc_off = (sizeof *nhdr + (size_t) nhdr->n_namesz + a - 1) & ~(a - 1);
+	if (desc_off > avail || nhdr->n_descsz > avail - desc_off) return 0;
+	size_t next_off = (desc_off + (size_t) nhdr->n_descsz + a - 1) & ~(a - 1);
+	*out = (struct elf_note) {
+		.type = nhdr->n_type,
+		.name = *pos + sizeof *nhdr,
+		.namesz = nhdr->n_namesz,
+		.desc = *pos + desc_off,
+		.descsz = nhdr->n_descsz
+	};
+	/* The last note's padding may be missing. */
+	*pos = (next_off > avail) ? end : *pos + next_off;
+	return 1;
+}
+static inline _Bool elf_note_is(const struct elf_note *n, const char *name, ElfW(Word) type)
+{
+	if (n->type != type) return 0;
+	for (ElfW(Word) i = 0; i < n->namesz; ++i)
+	{
+		if (n->name[i] != name[i]) return 0;
+		if (!name[i]) return i + 1 == n->namesz;
+	}
+	return 0;
+}
+/* Find a property in the desc of an NT_GNU_PROPERTY_TYPE_0 note. Each is
+ * a type and a size, then the data, padded to the word size. They are
+ * sorted by type, but there are few, so we just scan. */
+static inline const void *elf_gnu_property_lookup(const void *desc, size_t descsz,
+	ElfW(Word) pr_type, ElfW(Word) *out_datasz)
+{
+	const char *pos = (const char *) desc;
+	const char *end = pos + descsz;
+	while ((size_t)(end - pos) >= 2 * sizeof (ElfW(Word)))
+	{
+		const ElfW(Word) *hdr = (const ElfW(Word) *) pos;
+		size_t datasz = hdr[1];
+		const char *data = pos + 2 * sizeof (ElfW(Word));
+		if (datasz > (size_t)(end - data)) return NULL;
+		if (hdr[0] == pr_type)
+		{
+			if (out_datasz) *out_datasz = datasz;
+			return data;
+		}
+		size_t step = (datasz + sizeof (ElfW(Addr)) - 1) & ~(sizeof (ElfW(Addr)) - 1);
+		if (step > (size_t)(end - data)) return NULL;
+		pos = data + step;
+	}
+	return NULL;
+}
 struct segment_metadata
 {
 	unsigned phdr_idx;
 	union sym_or_reloc_rec *metavector; /* addr-sorted list of relevant dynsym/symtab/extrasym/reloc entries */
 	size_t metavector_size;
+	uintptr_t *metavector_search_keys; /* search layout of the above (see eytzinger.h) */
+	unsigned *metavector_search_ranks;
+	/* One bit per pointer-sized word of the segment, set if some
+	 * metavector span starts in that word. Bit i covers the word at
+	 * ROUND_DOWN(p_vaddr, sizeof (void*)) + i * sizeof (void*). */
 	bitmap_word_t *starts_bitmap; // maybe!
+	size_t starts_bitmap_nbits; /* i.e. STARTS_BITMAP_NWORDS_FOR_PHDR */
+	/* Rank structure: starts_rank[w] is the number of bits set in
+	 * starts_bitmap words before w, and starts_first_rec[k] is the
+	 * metavector index of the first span starting at the k'th set bit. */
+	unsigned *starts_rank;
+	unsigned *starts_first_rec;
 };
 
-/* Hmm -- with -Wl,-q we might get lots of reloc section mappings. Is this enough? */
+/* One allocated section, i.e. one that occupies address space in the
+ * loaded image. Addresses are vaddrs, i.e. relative to the load address.
+ * We keep these in a compact array per file (see sections.c). */
+struct section_metadata
+{
+	uintptr_t start;
+	uintptr_t end;
+	ElfW(Xword) flags; /* sh_flags */
+	ElfW(Word) type;   /* sh_type, so that we can tell .bss (SHT_NOBITS) from .data */
+	ElfW(Half) shndx;
+};
+
+/* A read-only mapping of part of the file, made because ld.so didn't map
+ * that part (e.g. the section headers, symtab or strtab). */
+struct extra_mapping
+{
+	void *mapping_pagealigned;
+	size_t fileoff_pagealigned; // avoid off_t to be glibc/musl-agnostic
+	size_t size;
+};
 /* This is basically our supplement to the stuff we can access
  * from the struct link_map entries in the ld.so. There is some
  * duplication, mainly because we don't want to depend on impl-
  * -specific stuff in there. */
-#define MAPPING_MAX 16
 struct file_metadata
 {
 	const char *filename;
@@ -51,13 +178,18 @@ struct file_metadata
 	ElfW(Half) dynsymndx; // section header idx of dynsym, or 0 if none such
 	ElfW(Half) dynstrndx;
 
-	struct extra_mapping
-	{
-		void *mapping_pagealigned;
-		size_t fileoff_pagealigned; // avoid off_t to be glibc/musl-agnostic
-		size_t size;
-	} extra_mappings[MAPPING_MAX];
+	unsigned long file_dev; /* identity of the file, once we have reopened it */
+	unsigned long file_ino; /* ... or zero if we never could */
 
+	/* Our extra mappings, as a table that grows without limit and merges
+	 * adjacent or overlapping ranges (see files.c). */
+	struct extra_mapping_table *extra_mappings;
+	unsigned extra_mappings_lock;
+
+	/* These are mapped lazily with LIBRUNT_DEFER_SHDRS=1 (see files.c).
+	 * Until then they are NULL or zero, as are dynsymndx and dynstrndx, so
+	 * call __runt_files_ensure_shdrs_mapped() before reading any of them. */
+	unsigned shdrs_state;
 	ElfW(Ehdr) *ehdr;
 	ElfW(Shdr) *shdrs;
 	unsigned char *shstrtab;
@@ -66,7 +198,23 @@ struct file_metadata
 	unsigned char *strtab; // NOTE this is strtab, not dynstr
 	ElfW(Half) strtabndx;
 
-	char build_id[20]; // contents of .note.gnu.build-id section, if any (else zeroed)
+	/* From notes, pointing into memory that stays mapped while the file is
+	 * loaded; NULL (and zero) if the file has no such note. */
+	const unsigned char *build_id; /* NT_GNU_BUILD_ID desc, of any length */
+	ElfW(Word) build_id_len;
+	const ElfW(Word) *abi_tag; /* NT_GNU_ABI_TAG desc: OS, then major, minor, patch */
+	const void *gnu_property; /* NT_GNU_PROPERTY_TYPE_0 desc */
+	ElfW(Word) gnu_property_sz;
+
+	unsigned symbols_index_state; /* has segments.c built the metavectors yet? */
+	void *symbols_index_mapping; /* if the metavectors were mapped from the index cache... */
+	size_t symbols_index_mapping_size; /* ... or 0 if they are embedded in the file */
+	unsigned symtab_name_index_state; /* has symbols.c built the name index yet? */
+	struct symtab_name_index *symtab_name_index;
+	unsigned section_index_state; /* has sections.c sorted the section headers yet? */
+	struct section_index *section_index;
+	struct section_metadata *sections; /* allocated sections, sorted by address */
+	unsigned nsections;
 
 	/* "Starts" are symbols with length (spans).
 	   We don't index symbols that are not spans.
@@ -86,7 +234,7 @@ struct file_metadata
 #define FILE_META_DESCRIBES_EXECUTABLE(meta) \
 	((meta)->l->l_name && (meta)->l->l_name[0] == '\0') /* FIXME: better test? */
 #define STARTS_BITMAP_NWORDS_FOR_PHDR(ph) \
-    (ROUND_UP((ph)->p_vaddr + (ph)->p_memsz, sizeof (void*)) - ROUND_DOWN((ph)->p_vaddr, sizeof (void*)) \
+    ((ROUND_UP((ph)->p_vaddr + (ph)->p_memsz, sizeof (void*)) - ROUND_DOWN((ph)->p_vaddr, sizeof (void*))) \
     / (sizeof (void*)))
 /* Sometimes we will need to get back to containing struct from a
  * file_metadata embedded within. */
@@ -94,10 +242,13 @@ struct file_metadata
 	((outer_type *)(((uintptr_t)(ptr)) - offsetof(outer_type, member)))
 
 void __runt_deinit_file_metadata(void *fm);
+_Bool __runt_files_ensure_shdrs_mapped(struct file_metadata *meta);
 
 inline 
 ElfW(Sym) *__runt_files_get_symtab_by_idx(struct file_metadata *meta, ElfW(Half) i)
 {
+	/* Section indices mean nothing until the section headers are mapped. */
+	__runt_files_ensure_shdrs_mapped(meta);
 	if (meta->symtab && meta->symtabndx == i) return meta->symtab;
 	else if (meta->dynsym && meta->dynsymndx == i) return meta->dynsym;
 	return NULL;
@@ -106,6 +257,32 @@ ElfW(Sym) *__runt_files_get_symtab_by_idx(struct file_metadata *meta, ElfW(Half)
 
 struct file_metadata *__runt_files_notify_load(void *handle, const void *load_site);
 void __runt_files_notify_unload(const char *copied_filename);
+/* The symbol name index points into objects' dynsym and dynstr, so it must
+ * not be in use while an object is unmapped. The preload library's dlclose
+ * does this for you. If you link librunt.a and call the real dlclose
+ * yourself, call this first, then __runt_files_notify_unload if the
+ * object went or __runt_symbols_notify_unload if it stayed, either of which
+ * restores the index. */
+void __runt_symbols_withdraw_name_index(void);
+void __runt_symbols_notify_unload(void);
+/* A fresh read-only fd on the file, without going by its path if we can
+ * help it. The caller closes it. */
+int __runt_files_reopen(struct file_metadata *meta);
+/* Map the section headers, symtab, strtab and shstrtab if they were
+ * deferred, and define the sections. Returns whether there are shdrs. */
+_Bool __runt_files_ensure_shdrs_mapped(struct file_metadata *meta);
+/* Whether they are mapped already and there are shdrs. Never maps them,
+ * so never mallocs. */
+_Bool __runt_files_shdrs_mapped(struct file_metadata *meta);
+/* Iterate over the notes in meta's PT_NOTE segments, in memory. Start
+ * with a zeroed cursor. Segments not inside a LOAD are skipped. */
+struct file_note_cursor
+{
+	unsigned phndx;
+	const char *pos;
+};
+_Bool __runt_files_next_note(struct file_metadata *meta,
+	struct file_note_cursor *cursor, struct elf_note *out);
 
 const void *
 __runt_find_section_boundary(
@@ -120,10 +297,72 @@ void __runt_segments_notify_define_segment(
 	unsigned phndx,
 	unsigned loadndx
 );
+void __runt_segments_notify_symbols_ready(
+	struct file_metadata *meta
+);
+void __runt_segments_notify_shdrs_deferred(
+	struct file_metadata *meta
+);
+void __runt_segments_ensure_symbols_indexed(
+	struct file_metadata *meta
+);
+_Bool __runt_segments_metavector_lookup(
+	struct file_metadata *meta,
+	uintptr_t vaddr,
+	union sym_or_reloc_rec **out_rec
+);
+void *__runt_segments_build_embeddable_index(
+	const void *image,
+	size_t size,
+	size_t *out_size
+);
+ElfW(Sym) *__runt_segments_metavector_rec_sym(
+	struct file_metadata *meta,
+	union sym_or_reloc_rec *rec,
+	unsigned char **out_strtab
+);
+/* Find the first defined symbol called name in the file's symtab (or
+ * dynsym, if it has no symtab), ignoring STB_LOCAL ones unless asked. */
+ElfW(Sym) *__runt_symbols_lookup_by_name(
+	struct file_metadata *meta,
+	const char *name,
+	_Bool include_locals
+);
 void __runt_sections_notify_define_section(
 	struct file_metadata *meta,
 	const ElfW(Shdr) *shdr
 );
+/* Which allocated section contains addr? NULL if none does. If out_fm is
+ * non-null, we also say which file. */
+const struct section_metadata *__runt_sections_lookup_by_addr(
+	const void *addr,
+	struct file_metadata **out_fm
+);
+const struct section_metadata *__runt_sections_lookup_by_vaddr(
+	struct file_metadata *meta,
+	uintptr_t vaddr
+);
+/* The usual coarse classification of a section, from its flags and type. */
+enum section_kind
+{
+	SECTION_KIND_TEXT,   /* executable */
+	SECTION_KIND_RODATA, /* read-only data */
+	SECTION_KIND_DATA,   /* writable, initialized */
+	SECTION_KIND_BSS     /* writable, zero-initialized */
+};
+static inline enum section_kind section_metadata_kind(const struct section_metadata *s)
+{
+	if (s->flags & SHF_EXECINSTR) return SECTION_KIND_TEXT;
+	if (!(s->flags & SHF_WRITE)) return SECTION_KIND_RODATA;
+	return (s->type == SHT_NOBITS) ? SECTION_KIND_BSS : SECTION_KIND_DATA;
+}
+static inline const void *file_metadata_gnu_property(const struct file_metadata *meta,
+	ElfW(Word) pr_type, ElfW(Word) *out_datasz)
+{
+	if (!meta->gnu_property) return NULL;
+	return elf_gnu_property_lookup(meta->gnu_property, meta->gnu_property_sz,
+		pr_type, out_datasz);
+}
 
 #ifdef _GNU_SOURCE /* We use the GNU C "statement expressions" extension */
 /* Macro which open-codes a binary search over a sorted array
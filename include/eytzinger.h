@@ -0,0 +1,83 @@
+#ifndef LIBRUNT_EYTZINGER_H_
+#define LIBRUNT_EYTZINGER_H_
+
+#ifdef __cplusplus
+#include <cstdint>
+#include <cstddef>
+extern "C" {
+#else
+#include <stdint.h>
+#include <stddef.h>
+#endif
+
+/* Cache-friendly search over sorted arrays, as a replacement for
+ * bsearch_leq_generic. Instead of probing the sorted array of T directly
+ * (which drags a whole T into cache at each level, and maybe follows
+ * a pointer to get the key), we keep a packed copy of just the keys, laid
+ * out in Eytzinger (BFS) order. Node k's children are 2k and 2k+1, so
+ * the first few levels share cache lines, and we can prefetch several
+ * levels ahead. The descent has no data-dependent branches.
+ *
+ * Both arrays are indexed from 1, so need space for n + 1 elements.
+ * keys[k] is the key of the element with sorted index ranks[k]. Since the
+ * layout depends only on n, build ranks first and then the keys, e.g. with
+ * eytzinger_fill_keys below.
+ *
+ * These are plain functions, not macros like bsearch_leq_generic, so that
+ * the same code serves any sorted vector whose keys can be projected to
+ * a uintptr_t. */
+
+/* In-order traversal of the implicit tree assigns sorted ranks. */
+static inline unsigned eytzinger_layout_from(unsigned *ranks, unsigned n,
+	unsigned next_rank, unsigned k)
+{
+	if (k > n) return next_rank;
+	next_rank = eytzinger_layout_from(ranks, n, next_rank, 2 * k);
+	ranks[k] = next_rank++;
+	return eytzinger_layout_from(ranks, n, next_rank, 2 * k + 1);
+}
+static inline void eytzinger_layout(unsigned *ranks, unsigned n)
+{
+	eytzinger_layout_from(ranks, n, 0, 1);
+}
+/* Fill keys from a sorted array of T, using proj(T*) to get each key. */
+#define eytzinger_fill_keys(keys, ranks, n, base, proj) \
+	do { \
+		for (unsigned eytz_k_ = 1; eytz_k_ <= (n); ++eytz_k_) \
+		{ \
+			(keys)[eytz_k_] = (uintptr_t) proj(&(base)[(ranks)[eytz_k_]]); \
+		} \
+	} while (0)
+
+#ifndef EYTZINGER_PREFETCH_DISTANCE
+/* Eight uintptr_t keys per 64-byte line, so the descendants of k three
+ * levels down, 8k to 8k+7, are one cache line. */
+#define EYTZINGER_PREFETCH_DISTANCE 8
+#endif
+
+/* Return the sorted index of the greatest key that is <= target,
+ * or -1 if all keys are greater. */
+static inline long eytzinger_search_leq(const uintptr_t *keys, const unsigned *ranks,
+	unsigned n, uintptr_t target)
+{
+	uintptr_t k = 1;
+	while (k <= n)
+	{
+		/* Prefetching past the end is harmless. */
+		__builtin_prefetch(keys + EYTZINGER_PREFETCH_DISTANCE * k);
+		k = 2 * k + (keys[k] <= target);
+	}
+	/* We went right at every level where the key was <= target. Undo the
+	 * trailing run of right-turns, plus one left-turn, to get to the
+	 * first key that is > target. If there is no such key, we only ever
+	 * went right, and we end up at zero. */
+	k >>= __builtin_ffsl(~k);
+	if (k == 0) return (long) n - 1;
+	return (long) ranks[k] - 1;
+}
+
+#ifdef __cplusplus
+} /* end extern "C" */
+#endif
+
+#endif
@@ -33,7 +33,18 @@ typedef struct {
 extern const char __ldso_name[] PROTECTED;
 /* We define a dladdr that caches stuff. */
 Dl_info dladdr_with_cache(const void *addr) PROTECTED;
-Dl_info fake_dladdr_with_cache(const void *addr) PROTECTED; /* does not malloc */
+/* Does not malloc. So with LIBRUNT_INDEX=lazy it never builds a symbol index,
+ * and searches linearly in files that nothing else has yet indexed. With
+ * LIBRUNT_DEFER_SHDRS=1 it never maps section headers either, so in files
+ * whose section headers nothing else has yet mapped, it searches only dynsym. */
+Dl_info fake_dladdr_with_cache(const void *addr) PROTECTED;
+/* Batch version; no cache. May malloc, and builds any lazy index it needs.
+ * With LIBRUNT_DEFER_SHDRS=1, that may mean reopening files to map their
+ * section headers. */
+void fake_dladdrs(const void **addrs, size_t n, Dl_info *out) PROTECTED;
+/* As __runt_fake_dlsym on each name (NULL if not found), passing over the link map
+ * once for all the names that the name index couldn't answer. Does not malloc. */
+void __runt_fake_dlsyms(void *handle, const char **names, size_t n, void **out) PROTECTED;
 struct dl_phdr_info;
 int dl_for_one_object_phdrs(void *handle,
 	int (*callback) (struct dl_phdr_info *info, size_t size, void *data),
@@ -41,9 +52,60 @@ int dl_for_one_object_phdrs(void *handle,
 const char *dynobj_name_from_dlpi_name(const char *dlpi_name,
 	void *dlpi_addr) PROTECTED;
 const char *__runt_get_exe_realpath(void) PROTECTED;
+/* The link_map or file_metadata that these return stays valid only until
+ * its file is unloaded. Nothing pins it against a concurrent dlclose(). */
 struct link_map *__runt_files_lookup_by_addr(void *addr) PROTECTED;
 struct file_metadata;
 struct file_metadata *__runt_files_metadata_by_addr(void *addr) PROTECTED;
+void __runt_files_metadata_by_addrs(const void **addrs, size_t n,
+	struct file_metadata **out) PROTECTED;
+struct __runt_files_lookup_stats
+{
+	unsigned long cache_hits;   /* lookups answered by the per-thread last-hit cache */
+	unsigned long cache_misses; /* lookups that searched the index or table */
+	unsigned long generation;   /* bumped on every file insertion or deletion */
+};
+void __runt_files_get_lookup_stats(struct __runt_files_lookup_stats *out) PROTECTED;
+struct __runt_files_mapping_stats
+{
+	unsigned long mappings;  /* extra mappings of the file that we search */
+	unsigned long subsumed;  /* older ones, merged into those but still mapped */
+	unsigned long bytes;     /* the total size of both kinds */
+	unsigned long extended;  /* times we grew a mapping in place */
+	unsigned long mmaps;     /* mmap calls made for all of the above */
+};
+void __runt_files_get_mapping_stats(struct file_metadata *fm,
+	struct __runt_files_mapping_stats *out) PROTECTED;
+struct __runt_files_reopen_stats
+{
+	unsigned long by_map_files; /* opened via /proc/self/map_files */
+	unsigned long by_path;      /* opened via the filename, as a fallback */
+	unsigned long cache_hits;   /* dup'd from the fd cache (LIBRUNT_FD_CACHE) */
+	unsigned long failed;       /* none of the above worked */
+};
+void __runt_files_get_reopen_stats(struct __runt_files_reopen_stats *out) PROTECTED;
+struct __runt_segments_index_stats
+{
+	unsigned long files_loaded;  /* files whose symbol tables we have seen */
+	unsigned long files_indexed; /* files whose metavectors we have built or mapped */
+	unsigned long files_index_mapped; /* ... of which mapped from the index cache */
+	unsigned long files_index_embedded; /* ... or used in place from the file itself */
+};
+void __runt_segments_get_index_stats(struct __runt_segments_index_stats *out) PROTECTED;
+struct __runt_symbols_dladdr_cache_stats
+{
+	unsigned long hits;   /* [fake_]dladdr_with_cache calls answered from the cache */
+	unsigned long misses; /* ... and those that weren't */
+};
+void __runt_symbols_get_dladdr_cache_stats(struct __runt_symbols_dladdr_cache_stats *out) PROTECTED;
+struct __runt_symbols_name_index_stats
+{
+	unsigned long objects;  /* objects whose dynamic symbols are in the name index */
+	unsigned long names;    /* ... and how many symbols that is */
+	unsigned long answered; /* fake_dlsym lookups answered from the index */
+	unsigned long declined; /* ... and those left to walk the link map */
+};
+void __runt_symbols_get_name_index_stats(struct __runt_symbols_name_index_stats *out) PROTECTED;
 
 extern rlim_t __stack_lim_cur PROTECTED;
 
@@ -0,0 +1,354 @@
+#ifndef LIBRUNT_NAMEHASH_H_
+#define LIBRUNT_NAMEHASH_H_
+
+#ifdef __cplusplus
+#include <cstdint>
+#include <cstddef>
+extern "C" {
+typedef bool _Bool;
+#else
+#include <stdint.h>
+#include <stddef.h>
+#endif
+
+/* Kernels for the byte-at-a-time work in symbol lookup: finding a name's
+ * length, hashing it (with dl_new_hash, as in DT_GNU_HASH, or the SysV ELF
+ * hash, as in DT_HASH), and comparing it with a string table entry. Long
+ * (e.g. C++ mangled) names make these dominate lookup time.
+ *
+ * Each kernel has a scalar version, which is the reference and the
+ * fallback. On x86-64 we also have SSE2 versions (SSE2 is baseline there)
+ * and AVX2 versions, chosen at run time by cpuid. (AT_HWCAP doesn't
+ * describe AVX2 on x86.) Like relf.h, this avoids libc, so we don't use
+ * the intrinsics headers (which pull in stdlib.h); GCC's vector extensions
+ * and a few builtins do the same job.
+ *
+ * dl_new_hash is a polynomial, h = 5381 * 33^n + sum of c[i] * 33^(n-1-i),
+ * modulo 2^32. So a block of k bytes updates h to h * 33^k plus a dot
+ * product of the bytes with powers of 33, which is vectorizable. The SysV
+ * hash folds its high bits back in at every step, so is not; instead, the
+ * multi-lane hasher computes both hashes for eight names at once. */
+
+/* Scalar versions. These are the definitions. */
+static inline size_t namehash_strlen_scalar(const char *s)
+{
+	const char *p = s;
+	while (*p) ++p;
+	return p - s;
+}
+static inline uint32_t namehash_gnu_scalar(const char *s, size_t len)
+{
+	uint32_t h = 5381;
+	for (size_t i = 0; i < len; ++i) h = h * 33 + (unsigned char) s[i];
+	return h;
+}
+static inline uint32_t namehash_sysv_scalar(const char *s)
+{
+	uint32_t h = 0, g;
+	for (const unsigned char *p = (const unsigned char *) s; *p; ++p)
+	{
+		h = (h << 4) + *p;
+		if (0 != (g = (h & 0xf0000000))) h ^= g >> 24;
+		h &= 0x0fffffff;
+	}
+	return h;
+}
+/* Is the NUL-terminated string entry equal to name, whose length is len? */
+static inline _Bool namehash_streq_len_scalar(const char *entry, const char *name, size_t len)
+{
+	for (size_t i = 0; i < len; ++i) if (entry[i] != name[i]) return 0;
+	return entry[len] == '\0';
+}
+static inline void namehash_many_scalar(const char *const *names, size_t n,
+	uint32_t *gnu_out, uint32_t *sysv_out, size_t *len_out)
+{
+	for (size_t i = 0; i < n; ++i)
+	{
+		size_t len = namehash_strlen_scalar(names[i]);
+		if (gnu_out) gnu_out[i] = namehash_gnu_scalar(names[i], len);
+		if (sysv_out) sysv_out[i] = namehash_sysv_scalar(names[i]);
+		if (len_out) len_out[i] = len;
+	}
+}
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define NAMEHASH_HAVE_SIMD 1
+#include <cpuid.h>
+
+typedef char namehash_v16qi __attribute__((vector_size(16), may_alias, aligned(1)));
+typedef char namehash_v32qi __attribute__((vector_size(32), may_alias, aligned(1)));
+typedef unsigned char namehash_v8qu __attribute__((vector_size(8), may_alias, aligned(1)));
+typedef uint32_t namehash_v8su __attribute__((vector_size(32)));
+
+/* The vector loads deliberately go past the end of short objects, in ways
+ * we've checked are safe; GCC can't see that, once a constant name is
+ * inlined in. */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Warray-bounds"
+
+#define NAMEHASH_PAGE_SIZE 4096
+/* Can we load n bytes from p without crossing into the next page? */
+#define NAMEHASH_SAFE_LOAD(p, n) \
+	((((uintptr_t) (p)) & (NAMEHASH_PAGE_SIZE - 1)) <= NAMEHASH_PAGE_SIZE - (n))
+
+/* Aligned loads never cross a page, so may read past the NUL. */
+static inline size_t namehash_strlen_sse2(const char *s)
+{
+	const char *p = (const char *) ((uintptr_t) s & ~(uintptr_t) 15);
+	const namehash_v16qi zero = { 0 };
+	unsigned mask = __builtin_ia32_pmovmskb128(*(const namehash_v16qi *) p == zero)
+		>> (s - p);
+	while (!mask)
+	{
+		p += 16;
+		mask = __builtin_ia32_pmovmskb128(*(const namehash_v16qi *) p == zero);
+		if (mask) return p - s + __builtin_ctz(mask);
+	}
+	return __builtin_ctz(mask);
+}
+__attribute__((target("avx2")))
+static inline size_t namehash_strlen_avx2(const char *s)
+{
+	const char *p = (const char *) ((uintptr_t) s & ~(uintptr_t) 31);
+	const namehash_v32qi zero = { 0 };
+	unsigned mask = (unsigned) __builtin_ia32_pmovmskb256(*(const namehash_v32qi *) p == zero)
+		>> (s - p);
+	while (!mask)
+	{
+		p += 32;
+		mask = __builtin_ia32_pmovmskb256(*(const namehash_v32qi *) p == zero);
+		if (mask) return p - s + __builtin_ctz(mask);
+	}
+	return __builtin_ctz(mask);
+}
+
+/* Compare 16 bytes at a time, dropping to bytes only where a load would
+ * cross a page (the entry may end, and its mapping with it, before len).
+ * We compare the terminator too, so an entry that's a prefix of name, or
+ * vice versa, differs somewhere. */
+static inline _Bool namehash_streq_len_sse2(const char *entry, const char *name, size_t len)
+{
+	size_t i = 0;
+	for (; i + 16 <= len + 1; i += 16)
+	{
+		if (!NAMEHASH_SAFE_LOAD(entry + i, 16) || !NAMEHASH_SAFE_LOAD(name + i, 16))
+		{
+			for (size_t j = i; j < i + 16; ++j) if (entry[j] != name[j]) return 0;
+			continue;
+		}
+		if (0xffff != __builtin_ia32_pmovmskb128(
+				*(const namehash_v16qi *) (entry + i) == *(const namehash_v16qi *) (name + i)))
+		{
+			return 0;
+		}
+	}
+	for (; i <= len; ++i) if (entry[i] != name[i]) return 0;
+	return 1;
+}
+__attribute__((target("avx2")))
+static inline _Bool namehash_streq_len_avx2(const char *entry, const char *name, size_t len)
+{
+	size_t i = 0;
+	for (; i + 32 <= len + 1; i += 32)
+	{
+		if (!NAMEHASH_SAFE_LOAD(entry + i, 32) || !NAMEHASH_SAFE_LOAD(name + i, 32))
+		{
+			for (size_t j = i; j < i + 32; ++j) if (entry[j] != name[j]) return 0;
+			continue;
+		}
+		if (0xffffffffu != (unsigned) __builtin_ia32_pmovmskb256(
+				*(const namehash_v32qi *) (entry + i) == *(const namehash_v32qi *) (name + i)))
+		{
+			return 0;
+		}
+	}
+	/* We may have compared the terminator already. */
+	return i > len || namehash_streq_len_sse2(entry + i, name + i, len - i);
+}
+
+/* 33^k mod 2^32, for k = 31 down to 0, and 33^32. */
+#define NAMEHASH_POW33_32 0x1137c401u
+static const uint32_t namehash_pow33[32] __attribute__((aligned(32), unused)) = {
+	0x655ec7e1u, 0xccc4cfc1u, 0x99995ba1u, 0xd61beb81u, 0x829bff61u, 0x13791741u, 0x2f22b321u, 0xac185301u,
+	0xcee976e1u, 0xc8359ec1u, 0x72ac4aa1u, 0x510cfa81u, 0xcc272e61u, 0xb0da6641u, 0xee162221u, 0x92d9e201u,
+	0x0c3525e1u, 0xa3476dc1u, 0x3b4039a1u, 0x4f5f0981u, 0x30f35d61u, 0x855cb541u, 0x040a9121u, 0x747c7101u,
+	0xec41d4e1u, 0x4cfa3cc1u, 0x025528a1u, 0x00121881u, 0x00008c61u, 0x00000441u, 0x00000021u, 0x00000001u
+};
+__attribute__((target("avx2")))
+static inline uint32_t namehash_gnu_avx2(const char *s, size_t len)
+{
+	uint32_t h = 5381;
+	size_t i = 0;
+	const namehash_v8su *pows = (const namehash_v8su *) namehash_pow33;
+	for (; i + 32 <= len; i += 32)
+	{
+		namehash_v8su acc = { 0 };
+		for (unsigned k = 0; k < 4; ++k)
+		{
+			namehash_v8qu bytes = *(const namehash_v8qu *) (s + i + 8 * k);
+			acc += __builtin_convertvector(bytes, namehash_v8su) * pows[k];
+		}
+		uint32_t sum = 0;
+		for (unsigned k = 0; k < 8; ++k) sum += acc[k];
+		h = h * NAMEHASH_POW33_32 + sum;
+	}
+	for (; i < len; ++i) h = h * 33 + (unsigned char) s[i];
+	return h;
+}
+
+/* Eight names per vector, one per lane. Lanes that have hit their NUL
+ * stop advancing, and their hashes stop changing. */
+__attribute__((target("avx2")))
+static inline void namehash_many_avx2(const char *const *names, size_t n,
+	uint32_t *gnu_out, uint32_t *sysv_out, size_t *len_out)
+{
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8)
+	{
+		const unsigned char *p[8];
+		for (unsigned k = 0; k < 8; ++k) p[k] = (const unsigned char *) names[i + k];
+		namehash_v8su gnu = { 5381, 5381, 5381, 5381, 5381, 5381, 5381, 5381 };
+		namehash_v8su sysv = { 0 };
+		namehash_v8su len = { 0 };
+		for (;;)
+		{
+			namehash_v8su c = { *p[0], *p[1], *p[2], *p[3], *p[4], *p[5], *p[6], *p[7] };
+			namehash_v8su live = (namehash_v8su) (c != 0);
+			if (__builtin_ia32_pmovmskb256((namehash_v32qi) live) == 0) break;
+			for (unsigned k = 0; k < 8; ++k) p[k] += (*p[k] != 0);
+			gnu = (((gnu << 5) + gnu + c) & live) | (gnu & ~live);
+			namehash_v8su s = (sysv << 4) + c;
+			s ^= (s & 0xf0000000u) >> 24;
+			s &= 0x0fffffffu;
+			sysv = (s & live) | (sysv & ~live);
+			len -= live; /* live lanes are all ones, i.e. -1 */
+		}
+		for (unsigned k = 0; k < 8; ++k)
+		{
+			if (gnu_out) gnu_out[i + k] = gnu[k];
+			if (sysv_out) sysv_out[i + k] = sysv[k];
+			if (len_out) len_out[i + k] = len[k];
+		}
+	}
+	namehash_many_scalar(names + i, n - i, gnu_out ? gnu_out + i : NULL,
+		sysv_out ? sysv_out + i : NULL, len_out ? len_out + i : NULL);
+}
+
+enum { NAMEHASH_CPU_AVX2 = 1, NAMEHASH_CPU_KNOWN = 0x80 };
+/* AVX2 needs the CPU to support it, and the OS to save the ymm registers. */
+static inline unsigned namehash_cpu_features(void)
+{
+	static unsigned features;
+	unsigned f = __atomic_load_n(&features, __ATOMIC_RELAXED);
+	if (__builtin_expect(f != 0, 1)) return f;
+	f = NAMEHASH_CPU_KNOWN;
+	unsigned a, b, c, d;
+	if (__get_cpuid(1, &a, &b, &c, &d) && (c & bit_OSXSAVE) && (c & bit_AVX))
+	{
+		unsigned xcr0_lo, xcr0_hi;
+		__asm__ ("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+		if ((xcr0_lo & 6) == 6 && __get_cpuid_count(7, 0, &a, &b, &c, &d) && (b & bit_AVX2))
+		{
+			f |= NAMEHASH_CPU_AVX2;
+		}
+	}
+	__atomic_store_n(&features, f, __ATOMIC_RELAXED);
+	return f;
+}
+#define NAMEHASH_USE_AVX2 (namehash_cpu_features() & NAMEHASH_CPU_AVX2)
+#pragma GCC diagnostic pop
+#endif
+
+/* The dispatching versions. */
+static inline size_t namehash_strlen(const char *s)
+{
+#ifdef NAMEHASH_HAVE_SIMD
+	if (NAMEHASH_USE_AVX2) return namehash_strlen_avx2(s);
+	return namehash_strlen_sse2(s);
+#else
+	return namehash_strlen_scalar(s);
+#endif
+}
+/* dl_new_hash of s, which has length len. */
+static inline uint32_t namehash_gnu(const char *s, size_t len)
+{
+#ifdef NAMEHASH_HAVE_SIMD
+	/* Below a block, the vector code is all overhead. */
+	if (len >= 32 && NAMEHASH_USE_AVX2) return namehash_gnu_avx2(s, len);
+#endif
+	return namehash_gnu_scalar(s, len);
+}
+static inline _Bool namehash_streq_len(const char *entry, const char *name, size_t len)
+{
+#ifdef NAMEHASH_HAVE_SIMD
+	if (NAMEHASH_USE_AVX2) return namehash_streq_len_avx2(entry, name, len);
+	return namehash_streq_len_sse2(entry, name, len);
+#else
+	return namehash_streq_len_scalar(entry, name, len);
+#endif
+}
+/* Both hashes, and the length, of each of n names. Any output may be NULL. */
+static inline void namehash_many(const char *const *names, size_t n,
+	uint32_t *gnu_out, uint32_t *sysv_out, size_t *len_out)
+{
+#ifdef NAMEHASH_HAVE_SIMD
+	if (n >= 8 && NAMEHASH_USE_AVX2)
+	{
+		namehash_many_avx2(names, n, gnu_out, sysv_out, len_out);
+		return;
+	}
+#endif
+	namehash_many_scalar(names, n, gnu_out, sysv_out, len_out);
+}
+
+/* Hashing names known at compile time. Most lookups are of string
+ * literals, so there's no need to hash them at run time. The loops above
+ * don't fold even when s is a literal, but straight-line code does: once
+ * inlined, each s[k] is a constant, and so is the result. So we unroll up
+ * to NAMEHASH_LITERAL_MAX bytes, and the _STR macros use that when s is
+ * a compile-time constant short enough; otherwise they hash at run time.
+ * This needs optimization on; at -O0 it's correct but slow. From C++,
+ * namehash.hpp does the same with constexpr. */
+#define NAMEHASH_LITERAL_MAX 64
+#define NAMEHASH_UNROLL8_(m, b) m((b)+0) m((b)+1) m((b)+2) m((b)+3) \
+	m((b)+4) m((b)+5) m((b)+6) m((b)+7)
+#define NAMEHASH_UNROLL64_(m) NAMEHASH_UNROLL8_(m, 0) NAMEHASH_UNROLL8_(m, 8) \
+	NAMEHASH_UNROLL8_(m, 16) NAMEHASH_UNROLL8_(m, 24) NAMEHASH_UNROLL8_(m, 32) \
+	NAMEHASH_UNROLL8_(m, 40) NAMEHASH_UNROLL8_(m, 48) NAMEHASH_UNROLL8_(m, 56)
+static inline __attribute__((always_inline))
+uint32_t namehash_gnu_unrolled(const char *s, size_t len)
+{
+	uint32_t h = 5381;
+#define NAMEHASH_GNU_STEP_(k) if ((k) < len) h = h * 33 + (unsigned char) s[k];
+	NAMEHASH_UNROLL64_(NAMEHASH_GNU_STEP_)
+#undef NAMEHASH_GNU_STEP_
+	return h;
+}
+static inline __attribute__((always_inline))
+uint32_t namehash_sysv_unrolled(const char *s, size_t len)
+{
+	uint32_t h = 0, g;
+#define NAMEHASH_SYSV_STEP_(k) if ((k) < len) { \
+	h = (h << 4) + (unsigned char) s[k]; \
+	if (0 != (g = (h & 0xf0000000))) h ^= g >> 24; \
+	h &= 0x0fffffff; }
+	NAMEHASH_UNROLL64_(NAMEHASH_SYSV_STEP_)
+#undef NAMEHASH_SYSV_STEP_
+	return h;
+}
+#define NAMEHASH_IS_LITERAL_(s) \
+	(__builtin_constant_p(s) && __builtin_strlen(s) <= NAMEHASH_LITERAL_MAX)
+#define NAMEHASH_LEN_STR(s) \
+	(NAMEHASH_IS_LITERAL_(s) ? __builtin_strlen(s) : namehash_strlen(s))
+#define NAMEHASH_GNU_STR(s) \
+	(NAMEHASH_IS_LITERAL_(s) ? namehash_gnu_unrolled((s), __builtin_strlen(s)) \
+		: namehash_gnu((s), namehash_strlen(s)))
+#define NAMEHASH_SYSV_STR(s) \
+	(NAMEHASH_IS_LITERAL_(s) ? namehash_sysv_unrolled((s), __builtin_strlen(s)) \
+		: namehash_sysv_scalar(s))
+
+#ifdef __cplusplus
+} /* end extern "C" */
+#endif
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef LIBRUNT_NAMEHASH_HPP_
+#define LIBRUNT_NAMEHASH_HPP_
+
+#include "namehash.h"
+
+/* Compile-time symbol name hashes for C++ callers, e.g.
+ *
+ *   constexpr librunt::prehashed_name dlopen_name("dlopen");
+ *   fake_dlsym_hashed(RTLD_NEXT, dlopen_name.name, dlopen_name.len,
+ *       dlopen_name.gnu_hash, dlopen_name.sysv_hash);
+ *
+ * Unlike the _STR macros in namehash.h, this works at any optimization
+ * level and for names of any length. The functions are C++11 constexpr,
+ * hence recursive, but agree with the scalar kernels in namehash.h. */
+
+namespace librunt
+{
+	constexpr std::size_t name_length(const char *s, std::size_t n = 0)
+	{
+		return *s ? name_length(s + 1, n + 1) : n;
+	}
+	constexpr std::uint32_t gnu_hash(const char *s, std::uint32_t h = 5381)
+	{
+		return *s ? gnu_hash(s + 1, h * 33u + (unsigned char) *s) : h;
+	}
+	/* One step of the SysV hash: shift in a byte, then fold back the top four bits. */
+	constexpr std::uint32_t sysv_hash_fold(std::uint32_t h)
+	{
+		return (h ^ ((h & 0xf0000000u) >> 24)) & 0x0fffffffu;
+	}
+	constexpr std::uint32_t sysv_hash(const char *s, std::uint32_t h = 0)
+	{
+		return *s ? sysv_hash(s + 1, sysv_hash_fold((h << 4) + (unsigned char) *s)) : h;
+	}
+
+	struct prehashed_name
+	{
+		const char *name;
+		std::size_t len;
+		std::uint32_t gnu_hash;
+		std::uint32_t sysv_hash;
+		constexpr prehashed_name(const char *s)
+		 : name(s), len(name_length(s)), gnu_hash(librunt::gnu_hash(s)),
+		   sysv_hash(librunt::sysv_hash(s)) {}
+	};
+}
+
+#endif
@@ -11,6 +11,7 @@ typedef bool _Bool;
 size_t strlen(const char *s); /* avoid string.h */
 #include <elf.h>
 #include "elfw.h"
+#include "namehash.h"
 #include "vas.h" /* hmm -- may pollute namespace, but see how we go */
 #ifdef __FreeBSD__
 /* FreeBSD is POSIXly-correct by avoiding the typename "auxv_t". 
@@ -785,8 +786,11 @@ unsigned long dynamic_symbol_count(ElfW(Dyn) *dyn /* unused */, struct LINK_MAP_
 	return dynamic_symbol_count_from_dyn(l->l_ld, l->l_addr);
 }
 
+/* The _hashed variants take the name's hash precomputed, for callers
+ * looking up the same name in many objects. */
 static inline
-ElfW(Sym) *hash_lookup(ElfW(Word) *hash, ElfW(Sym) *symtab, const unsigned char *strtab, const char *sym)
+ElfW(Sym) *hash_lookup_hashed(ElfW(Word) *hash, ElfW(Sym) *symtab, const unsigned char *strtab,
+	const char *sym, size_t len, unsigned long h)
 {
 	ElfW(Sym) *found_sym = NULL;
 	ElfW(Word) nbucket = hash[0];
@@ -795,13 +799,12 @@ ElfW(Sym) *hash_lookup(ElfW(Word) *hash, ElfW(Sym) *symtab, const unsigned char
 	ElfW(Word) (*buckets)[/*nbucket*/] = (ElfW(Word)(*)[]) &hash[2];
 	ElfW(Word) (*chains)[/*nchain*/] = (ElfW(Word)(*)[]) &hash[2 + nbucket];
 
-	unsigned long h = elfw(hash)((const unsigned char *) sym);
 	ElfW(Word) first_symind = (*buckets)[h % nbucket];
 	ElfW(Word) symind = first_symind;
 	for (; symind != STN_UNDEF; symind = (*chains)[symind])
 	{
 		ElfW(Sym) *p_sym = &symtab[symind];
-		if (0 == strcmp((const char *) &strtab[p_sym->st_name], sym))
+		if (namehash_streq_len((const char *) &strtab[p_sym->st_name], sym, len))
 		{
 			/* match! FIXME: symbol type filter, FIXME: versioning */
 			found_sym = p_sym;
@@ -811,6 +814,12 @@ ElfW(Sym) *hash_lookup(ElfW(Word) *hash, ElfW(Sym) *symtab, const unsigned char
 	
 	return found_sym;
 }
+static inline
+ElfW(Sym) *hash_lookup(ElfW(Word) *hash, ElfW(Sym) *symtab, const unsigned char *strtab, const char *sym)
+{
+	return hash_lookup_hashed(hash, symtab, strtab, sym, namehash_strlen(sym),
+		namehash_sysv_scalar(sym));
+}
 
 static inline
 int hash_walk_syms(ElfW(Word) *hash, int (*cb)(ElfW(Sym) *, void *), ElfW(Sym) *symtab, void *arg)
@@ -846,10 +855,10 @@ dl_new_hash(const char *s)
 }
 
 static inline
-ElfW(Sym) *gnu_hash_lookup(ElfW(Word) *gnu_hash, ElfW(Sym) *symtab, const unsigned char *strtab, const char *sym)
+ElfW(Sym) *gnu_hash_lookup_hashed(ElfW(Word) *gnu_hash, ElfW(Sym) *symtab, const unsigned char *strtab,
+	const char *sym, size_t len, uint32_t hashval)
 {
 	ElfW(Sym) *found_sym = NULL;
-	uint32_t hashval = dl_new_hash(sym);
 	/* see: https://sourceware.org/ml/binutils/2006-10/msg00377.html */
 	uint32_t *gnu_hash_words = (uint32_t *) gnu_hash;
 	uint32_t nbuckets = gnu_hash_words[0];
@@ -944,7 +953,7 @@ ElfW(Sym) *gnu_hash_lookup(ElfW(Word) *gnu_hash, ElfW(Sym) *symtab, const unsign
 			 * able to test the lowest bit. */
 			if (((hasharr[symidx - symbias] ^ hashval) >> 1) == 0)
 			{
-				if (0 == strcmp((const char *) &strtab[symtab[symidx].st_name], sym))
+				if (namehash_streq_len((const char *) &strtab[symtab[symidx].st_name], sym, len))
 				{
 					found_sym = &symtab[symidx];
 					break;
@@ -955,6 +964,31 @@ ElfW(Sym) *gnu_hash_lookup(ElfW(Word) *gnu_hash, ElfW(Sym) *symtab, const unsign
 	
 	return found_sym;
 }
+static inline
+ElfW(Sym) *gnu_hash_lookup(ElfW(Word) *gnu_hash, ElfW(Sym) *symtab, const unsigned char *strtab, const char *sym)
+{
+	size_t len = namehash_strlen(sym);
+	return gnu_hash_lookup_hashed(gnu_hash, symtab, strtab, sym, len, namehash_gnu(sym, len));
+}
+
+/* How many dynsym entries are there? The GNU hash table doesn't say, but
+ * the last one ends the chain of the highest-starting bucket. */
+static inline
+unsigned long gnu_hash_symbol_count(ElfW(Word) *gnu_hash)
+{
+	uint32_t *gnu_hash_words = (uint32_t *) gnu_hash;
+	uint32_t nbuckets = gnu_hash_words[0];
+	uint32_t symbias = gnu_hash_words[1];
+	uint32_t maskwords = gnu_hash_words[2];
+	uint32_t *buckets = (uint32_t*) ((ElfW(Off) *) &gnu_hash_words[4] + maskwords);
+	uint32_t *hasharr = buckets + nbuckets;
+	uint32_t max_start = 0;
+	for (uint32_t i = 0; i < nbuckets; ++i) if (buckets[i] > max_start) max_start = buckets[i];
+	if (max_start < symbias) return symbias;
+	uint32_t symidx = max_start;
+	while (!(hasharr[symidx - symbias] & 1)) ++symidx;
+	return symidx + 1;
+}
 
 static inline
 int gnu_hash_walk_syms(ElfW(Word) *gnu_hash, int (*cb)(ElfW(Sym) *, void *), ElfW(Sym) *symtab, unsigned char *strtab, void *arg)
@@ -1124,6 +1158,23 @@ ElfW(Sym) *symbol_lookup_in_dyn(ElfW(Dyn) *d, uintptr_t load_addr, const char *s
 	return found;
 }
 
+/* As above, but with the name's length and both its hashes precomputed. */
+static inline
+ElfW(Sym) *symbol_lookup_in_dyn_hashed(ElfW(Dyn) *d, uintptr_t load_addr, const char *sym,
+	size_t len, uint32_t gnu_hashval, uint32_t sysv_hashval)
+{
+	ElfW(Word) *hash = get_sysv_hash_from_dyn(d, load_addr);
+	ElfW(Word) *gnu_hash = get_gnu_hash_from_dyn(d, load_addr);
+	ElfW(Sym) *symtab = get_dynsym_from_dyn(d, load_addr);
+	if (!symtab) return 0;
+	unsigned char *strtab = get_dynstr_from_dyn(d, load_addr);
+	if (gnu_hash) return gnu_hash_lookup_hashed(gnu_hash, symtab, strtab, sym, len, gnu_hashval);
+	if (hash) return hash_lookup_hashed(hash, symtab, strtab, sym, len, sysv_hashval);
+	ElfW(Sym) *symtab_end = symtab + dynamic_symbol_count_from_dyn(d, load_addr);
+	unsigned char *strtab_end = strtab + dynamic_xlookup(d, DT_STRSZ)->d_un.d_val;
+	return symbol_lookup_linear(symtab, symtab_end, strtab, strtab_end, sym);
+}
+
 static inline
 ElfW(Sym) *symbol_lookup_in_object(struct LINK_MAP_STRUCT_TAG *l, const char *sym)
 {
@@ -1165,8 +1216,38 @@ void *sym_to_addr_given_base(uintptr_t base, ElfW(Sym) *sym)
 	return LOAD_ADDR_FIXUP_GIVEN_BASE(base, sym->st_value);
 }
 
+/* librunt keeps a process-wide index of dynamic symbols by name, which
+ * answers RTLD_DEFAULT and RTLD_NEXT lookups without walking the link map.
+ * It returns 0 if it can't answer (e.g. librunt hasn't built it yet), in
+ * which case we do the walk. Define RELF_HAVE_NAME_INDEX to 0 to always walk. */
+#ifdef IN_LIBRUNT_DSO
+_Bool __runt_symbols_lookup_global(void *handle, const char *symname,
+	const void *caller_dynamic, void **out) __attribute__((visibility("protected")));
+_Bool __runt_symbols_lookup_global_hashed(void *handle, const char *symname,
+	size_t len, uint32_t gnu_hash, const void *caller_dynamic, void **out)
+	__attribute__((visibility("protected")));
+#ifndef RELF_HAVE_NAME_INDEX
+#define RELF_HAVE_NAME_INDEX 1
+#endif
+#define RELF_HAVE_HASHED_NAME_INDEX RELF_HAVE_NAME_INDEX
+#else
+_Bool __runt_symbols_lookup_global(void *handle, const char *symname,
+	const void *caller_dynamic, void **out) __attribute__((weak));
+_Bool __runt_symbols_lookup_global_hashed(void *handle, const char *symname,
+	size_t len, uint32_t gnu_hash, const void *caller_dynamic, void **out)
+	__attribute__((weak));
+#ifndef RELF_HAVE_NAME_INDEX
+#define RELF_HAVE_NAME_INDEX (__runt_symbols_lookup_global != NULL)
+#endif
+#define RELF_HAVE_HASHED_NAME_INDEX \
+	(RELF_HAVE_NAME_INDEX && __runt_symbols_lookup_global_hashed != NULL)
+#endif
+
+/* fake_dlsym with the name's length and hashes supplied by the caller,
+ * never using the name index. */
 static inline
-void *fake_dlsym(void *handle, const char *symname)
+void *fake_dlsym_walk_hashed(void *handle, const char *symname, size_t len,
+	uint32_t gnu_hashval, uint32_t sysv_hashval)
 {
 	/* Which object do we want? It's either
 	 * "the first" (RTLD_DEFAULT);
@@ -1196,7 +1277,8 @@ void *fake_dlsym(void *handle, const char *symname)
 				|| (handle == RTLD_NEXT && had_seen_ourselves))
 		{
 			/* Does this object have the symbol? */
-			ElfW(Sym) *found = symbol_lookup_in_object(l, symname);
+			ElfW(Sym) *found = symbol_lookup_in_dyn_hashed(l->l_ld, l->l_addr, symname,
+				len, gnu_hashval, sysv_hashval);
 			if (found && found->st_shndx != SHN_UNDEF)
 			{
 				return sym_to_addr(found);
@@ -1218,6 +1300,140 @@ not_found:
 	return (void*) -1;
 	
 }
+/* fake_dlsym with the name's length and hashes supplied by the caller. */
+static inline
+void *fake_dlsym_hashed(void *handle, const char *symname, size_t len,
+	uint32_t gnu_hashval, uint32_t sysv_hashval)
+{
+	if ((handle == RTLD_DEFAULT || handle == RTLD_NEXT) && RELF_HAVE_NAME_INDEX)
+	{
+		void *found;
+		if (RELF_HAVE_HASHED_NAME_INDEX
+				? __runt_symbols_lookup_global_hashed(handle, symname, len, gnu_hashval,
+					_DYNAMIC, &found)
+				: __runt_symbols_lookup_global(handle, symname, _DYNAMIC, &found))
+		{
+			return found;
+		}
+	}
+	return fake_dlsym_walk_hashed(handle, symname, len, gnu_hashval, sysv_hashval);
+}
+static inline
+void *fake_dlsym(void *handle, const char *symname)
+{
+	size_t len = namehash_strlen(symname);
+	return fake_dlsym_hashed(handle, symname, len, namehash_gnu(symname, len),
+		namehash_sysv_scalar(symname));
+}
+/* For string literals, this computes the length and hashes at compile time.
+ * It is meant for bootstrapping, e.g. finding the real dlsym from inside a
+ * wrapper, so it only walks the link map, which needs no allocation or
+ * locking, and never consults the name index. */
+#define FAKE_DLSYM(handle, symname) \
+	fake_dlsym_walk_hashed((handle), (symname), NAMEHASH_LEN_STR(symname), \
+		NAMEHASH_GNU_STR(symname), NAMEHASH_SYSV_STR(symname))
+
+/* Look up many names at once, as if by fake_dlsym on each. We hash them
+ * all first, several at a time, and ask the name index about each. For
+ * any it can't answer, we walk the link map once, checking each object's
+ * Bloom filter and buckets for every name that is still unresolved. The
+ * caller fills in each name, and we fill in the rest. */
+struct fake_dlsym_query
+{
+	const char *name;
+	uint32_t gnu_hash;
+	uint32_t sysv_hash;
+	size_t len;
+	_Bool resolved;
+	void *addr; /* as fake_dlsym would return it, so (void*) -1 if not found */
+};
+/* Walk the link map for the nleft queries in qs[0..n) not yet resolved. */
+static inline
+void fake_dlsyms_walk(void *handle, struct fake_dlsym_query *qs, size_t n, size_t nleft)
+{
+	if (handle == RTLD_NEXT)
+	{
+		if (!(_DYNAMIC)) __assert_fail("_DYNAMIC found", __FILE__, __LINE__, __func__);
+	}
+	_Bool seen_ourselves = 0;
+	for (struct LINK_MAP_STRUCT_TAG *l = find_r_debug()->r_map;
+			l && nleft > 0;
+			l = l->l_next)
+	{
+		_Bool had_seen_ourselves = seen_ourselves;
+		if (l->l_ld == _DYNAMIC) seen_ourselves = 1;
+		if (!(handle == l
+				|| handle == RTLD_DEFAULT
+				|| (handle == RTLD_NEXT && had_seen_ourselves))) continue;
+		ElfW(Dyn) *d = l->l_ld;
+		ElfW(Sym) *symtab = get_dynsym_from_dyn(d, l->l_addr);
+		if (symtab)
+		{
+			ElfW(Word) *hash = get_sysv_hash_from_dyn(d, l->l_addr);
+			ElfW(Word) *gnu_hash = get_gnu_hash_from_dyn(d, l->l_addr);
+			unsigned char *strtab = get_dynstr_from_dyn(d, l->l_addr);
+			unsigned char *strtab_end = strtab + dynamic_xlookup(d, DT_STRSZ)->d_un.d_val;
+			ElfW(Sym) *symtab_end = (gnu_hash || hash) ? NULL
+				: symtab + dynamic_symbol_count_from_dyn(d, l->l_addr);
+			for (size_t i = 0; i < n && nleft > 0; ++i)
+			{
+				struct fake_dlsym_query *q = &qs[i];
+				if (q->resolved) continue;
+				ElfW(Sym) *found;
+				if (gnu_hash) found = gnu_hash_lookup_hashed(gnu_hash, symtab, strtab,
+					q->name, q->len, q->gnu_hash);
+				else if (hash) found = hash_lookup_hashed(hash, symtab, strtab,
+					q->name, q->len, q->sysv_hash);
+				else found = symbol_lookup_linear(symtab, symtab_end, strtab, strtab_end,
+					q->name);
+				if (found && found->st_shndx != SHN_UNDEF)
+				{
+					q->addr = sym_to_addr_given_base(l->l_addr, found);
+					if (ELFW_ST_TYPE(found->st_info) == STT_GNU_IFUNC)
+					{
+						q->addr = ((void *(*)(void)) q->addr)();
+					}
+					q->resolved = 1;
+					--nleft;
+				}
+			}
+		}
+		if (handle == l) break;
+	}
+}
+static inline
+void fake_dlsyms(void *handle, struct fake_dlsym_query *qs, size_t n)
+{
+	/* Hash the names several at a time. */
+	for (size_t i = 0; i < n; i += 8)
+	{
+		unsigned nbatch = (n - i < 8) ? n - i : 8;
+		const char *batch[8];
+		uint32_t gnu_hashes[8], sysv_hashes[8];
+		size_t lens[8];
+		for (unsigned k = 0; k < nbatch; ++k) batch[k] = qs[i + k].name;
+		namehash_many(batch, nbatch, gnu_hashes, sysv_hashes, lens);
+		for (unsigned k = 0; k < nbatch; ++k)
+		{
+			qs[i + k].gnu_hash = gnu_hashes[k];
+			qs[i + k].sysv_hash = sysv_hashes[k];
+			qs[i + k].len = lens[k];
+		}
+	}
+	size_t nleft = 0;
+	for (size_t i = 0; i < n; ++i)
+	{
+		struct fake_dlsym_query *q = &qs[i];
+		q->addr = (void*) -1;
+		q->resolved = ((handle == RTLD_DEFAULT || handle == RTLD_NEXT) && RELF_HAVE_NAME_INDEX
+			&& (RELF_HAVE_HASHED_NAME_INDEX
+				? __runt_symbols_lookup_global_hashed(handle, q->name, q->len,
+					q->gnu_hash, _DYNAMIC, &q->addr)
+				: __runt_symbols_lookup_global(handle, q->name, _DYNAMIC, &q->addr)));
+		if (!q->resolved) ++nleft;
+	}
+	if (nleft > 0) fake_dlsyms_walk(handle, qs, n, nleft);
+}
 
 static inline
 int walk_symbols_in_object(struct LINK_MAP_STRUCT_TAG *l,
@@ -21,13 +21,16 @@ struct file_metadata *(__attribute__((warning("do not call __runt_files_metadata
 #include <unistd.h>
 #include <stdint.h>
 #include <string.h>
+#include <errno.h>
 #include <dlfcn.h>
 #include <limits.h>
 #include <link.h>
 #include <sys/mman.h>
+#include <sched.h>
 #include "relf.h"
 #include "dso-meta.h"
 #include "vas.h"
+#include "eytzinger.h"
 
 #include "librunt_private.h"
 int fstat(int fd, struct stat *buf);
@@ -43,16 +46,6 @@ int fstat(int fd, struct stat *buf);
 static _Bool trying_to_initialize;
 static _Bool initialized;
 
-struct lm_pair
-{
-	struct link_map *lm;
-	struct file_metadata *fm;
-};
-/* NOTE: in liballocs, this lm_pairs structure should never be used,
- * as it is . */
-static struct lm_pair (__attribute__((aligned(COMMON_PAGE_SIZE))) lm_pairs)[COMMON_PAGE_SIZE / sizeof (struct lm_pair)];
-static unsigned npairs;
-static 
 #ifndef NO_PTHREADS
 #include <pthread.h>
 #define BIG_LOCK \
@@ -66,40 +59,435 @@ static pthread_mutex_t mutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
 #define BIG_LOCK
 #define BIG_UNLOCK
 #endif
+
+/* The file table maps load addresses to file metadata. Readers (address
+ * lookups) may run on any thread at any time, including while another
+ * thread is loading or unloading a file. So we never modify the table in
+ * place. Instead, every update builds a fresh, sorted, immutable copy and
+ * publishes it through an atomic pointer. Readers never block: they just
+ * announce themselves in a per-thread reader slot, load the pointer and
+ * search. The old table is retired and only freed once a grace period
+ * has elapsed, i.e. once every reader that might have seen it has left.
+ * Reclaiming happens on a later update, not eagerly.
+ *
+ * The grace period covers the table, not what lookups return. A
+ * file_metadata or link_map that a lookup hands back is valid only until
+ * its file is unloaded, exactly as before we had grace periods. Callers
+ * that may race with a dlclose() of the same file must serialize with it
+ * themselves.
+ *
+ * NOTE: in liballocs, this structure should never be used. */
+struct lm_pair
+{
+	uintptr_t load_addr; /* copy of lm->l_addr; the link map may be gone
+	                      * (freed by the ld.so) before we hear of an unload */
+	struct link_map *lm;
+	struct file_metadata *fm;
+};
+struct file_table
+{
+	unsigned npairs;
+	/* A search layout of the load addresses (see eytzinger.h), built
+	 * when the table is published. Both point into the same allocation. */
+	uintptr_t *search_keys;
+	unsigned *search_ranks;
+	struct lm_pair pairs[];
+};
+static struct file_table *file_table; /* only ever accessed atomically */
+
+/* Grace periods are tracked SRCU-style. Each reader slot has two counters,
+ * and readers increment the one selected by the low bit of grace_period_seq.
+ * A writer may advance the sequence number only when nobody is counted
+ * against the *other* parity. Something retired at sequence number s can
+ * be freed once we reach s + 2, because by then both parities have drained
+ * at least once since the retirement. Threads are spread across a fixed
+ * number of cache-line-sized slots; sharing a slot is harmless (just slower). */
+#ifndef FILE_TABLE_READER_SLOTS
+#define FILE_TABLE_READER_SLOTS 64
+#endif
+struct reader_slot
+{
+	unsigned long nreaders[2];
+	/* Statistics for the last-hit cache (below). These are bumped without
+	 * atomic read-modify-write, so may undercount when threads share a slot. */
+	unsigned long cache_hits;
+	unsigned long cache_misses;
+} __attribute__((aligned(64)));
+static struct reader_slot reader_slots[FILE_TABLE_READER_SLOTS];
+static unsigned long grace_period_seq;
+static unsigned next_reader_slot;
+static __thread struct reader_slot *my_reader_slot __attribute__((tls_model("initial-exec")));
+
+static inline unsigned long *file_table_read_lock(void)
+{
+	struct reader_slot *s = my_reader_slot;
+	if (__builtin_expect(!s, 0))
+	{
+		s = &reader_slots[__atomic_fetch_add(&next_reader_slot, 1, __ATOMIC_RELAXED)
+				% FILE_TABLE_READER_SLOTS];
+		my_reader_slot = s;
+	}
+	unsigned long *ctr = &s->nreaders[__atomic_load_n(&grace_period_seq, __ATOMIC_SEQ_CST) & 1];
+	__atomic_fetch_add(ctr, 1, __ATOMIC_SEQ_CST);
+	return ctr;
+}
+static inline void file_table_read_unlock(unsigned long *ctr)
+{
+	__atomic_fetch_sub(ctr, 1, __ATOMIC_RELEASE);
+}
+
+/* Lookups tend to come in runs within the same file, so each thread
+ * remembers the last file it found. The cached entry is valid only while
+ * file_table_generation is unchanged, i.e. no file has been added or
+ * removed since. The generation starts at 1 so that a zeroed cache is
+ * never valid. */
+/* static */ unsigned long __runt_files_generation __attribute__((visibility("hidden"))) = 1;
+#define file_table_generation __runt_files_generation
+struct last_hit
+{
+	unsigned long generation;
+	uintptr_t begin;
+	uintptr_t end;
+	struct lm_pair pair;
+};
+static __thread struct last_hit last_hit __attribute__((tls_model("initial-exec")));
+#define BUMP_SLOT_STAT(s, field) \
+	__atomic_store_n(&(s)->field, __atomic_load_n(&(s)->field, __ATOMIC_RELAXED) + 1, \
+		__ATOMIC_RELAXED)
+
+/* Optionally (LIBRUNT_PAGE_INDEX=1), we also keep a two-level radix index
+ * from page number to file, so that lookups don't need to search the table
+ * at all. Each indexed file gets one immutable entry, which every page in
+ * its [vaddr_begin, vaddr_end) range points to. Leaves are mmap'd as
+ * demand-zero memory, so we only pay for the index pages covering
+ * ranges that actually hold files. Leaves are never freed; entries
+ * are retired just like tables. */
+struct page_index_entry
+{
+	uintptr_t begin;
+	uintptr_t end;
+	struct lm_pair pair;
+};
+
+/* Writer-side state. All of this is protected by BIG_LOCK. */
+struct retired
+{
+	struct retired *next;
+	unsigned long seq;
+	struct file_table *table;
+	struct file_metadata *fm; /* if non-null, also free this */
+	struct page_index_entry *page_index_entry; /* ditto */
+};
+static struct retired *retired_list;
+
+static _Bool readers_drained(unsigned parity)
+{
+	for (unsigned i = 0; i < FILE_TABLE_READER_SLOTS; ++i)
+	{
+		if (__atomic_load_n(&reader_slots[i].nreaders[parity], __ATOMIC_SEQ_CST)) return 0;
+	}
+	return 1;
+}
+static void reclaim_retired(void)
+{
+	/* Advance the grace period as far as we can (at most twice) without
+	 * waiting, then free whatever is now unreachable. */
+	for (unsigned i = 0; i < 2; ++i)
+	{
+		unsigned long seq = __atomic_load_n(&grace_period_seq, __ATOMIC_RELAXED);
+		if (!readers_drained((seq & 1) ^ 1)) break;
+		__atomic_store_n(&grace_period_seq, seq + 1, __ATOMIC_SEQ_CST);
+	}
+	unsigned long now = __atomic_load_n(&grace_period_seq, __ATOMIC_RELAXED);
+	struct retired **p_r = &retired_list;
+	while (*p_r)
+	{
+		struct retired *r = *p_r;
+		if (r->seq + 2 <= now)
+		{
+			*p_r = r->next;
+			if (r->fm)
+			{
+				__runt_deinit_file_metadata(r->fm);
+				__private_free(r->fm);
+			}
+			__private_free(r->table);
+			__private_free(r->page_index_entry);
+			__private_free(r);
+		}
+		else p_r = &r->next;
+	}
+}
+static void retire(struct file_table *old, struct file_metadata *dead_fm,
+	struct page_index_entry *dead_entry)
+{
+	if (old || dead_fm || dead_entry)
+	{
+		struct retired *r = __private_malloc(sizeof (struct retired));
+		if (!r) abort();
+		*r = (struct retired) {
+			.next = retired_list,
+			.seq = __atomic_load_n(&grace_period_seq, __ATOMIC_SEQ_CST),
+			.table = old,
+			.fm = dead_fm,
+			.page_index_entry = dead_entry
+		};
+		retired_list = r;
+	}
+	reclaim_retired();
+}
+static void publish_file_table(struct file_table *new_table, struct file_metadata *dead_fm,
+	struct page_index_entry *dead_entry)
+{
+	if (new_table)
+	{
+#define proj_pair_load_addr(p) (p)->load_addr
+		eytzinger_layout(new_table->search_ranks, new_table->npairs);
+		eytzinger_fill_keys(new_table->search_keys, new_table->search_ranks,
+			new_table->npairs, new_table->pairs, proj_pair_load_addr);
+#undef proj_pair_load_addr
+	}
+	retire(__atomic_exchange_n(&file_table, new_table, __ATOMIC_SEQ_CST), dead_fm, dead_entry);
+}
+static struct file_table *alloc_file_table(unsigned npairs)
+{
+	struct file_table *t = __private_malloc(offsetof(struct file_table, pairs)
+		+ npairs * sizeof (struct lm_pair)
+		+ (npairs + 1) * (sizeof (uintptr_t) + sizeof (unsigned)));
+	if (!t) abort();
+	t->npairs = npairs;
+	t->search_keys = (uintptr_t *) &t->pairs[npairs];
+	t->search_ranks = (unsigned *) &t->search_keys[npairs + 1];
+	return t;
+}
+
+/* When many files are added at once (e.g. all the startup libraries), we
+ * don't want to pay for a copy of the table per file. Between
+ * begin_insert_batch() and end_insert_batch(), inserts are just appended
+ * to an unpublished 'pending' array, which we sort once at the end and
+ * merge into the published table. Lookups in the meantime fall back to
+ * scanning the pending array under the lock. */
+static struct file_table *pending;
+static unsigned pending_capacity;
+static _Bool batch_open;
+static void begin_insert_batch(void)
+{
+	BIG_LOCK
+	assert(!batch_open);
+	__atomic_store_n(&batch_open, 1, __ATOMIC_RELAXED);
+	BIG_UNLOCK
+}
+static int compare_lm_pair_by_load_addr(const void *v1, const void *v2);
+static void end_insert_batch(void)
+{
+	BIG_LOCK
+	assert(batch_open);
+	if (pending && pending->npairs > 0)
+	{
+		qsort(pending->pairs, pending->npairs, sizeof pending->pairs[0],
+			compare_lm_pair_by_load_addr);
+		struct file_table *old = __atomic_load_n(&file_table, __ATOMIC_RELAXED);
+		unsigned nold = old ? old->npairs : 0;
+		struct file_table *t = alloc_file_table(nold + pending->npairs);
+		/* Merge the two sorted runs. */
+		unsigned i = 0, j = 0, k = 0;
+		while (i < nold || j < pending->npairs)
+		{
+			if (j == pending->npairs
+					|| (i < nold && old->pairs[i].load_addr <= pending->pairs[j].load_addr))
+			{
+				t->pairs[k++] = old->pairs[i++];
+			}
+			else t->pairs[k++] = pending->pairs[j++];
+		}
+		publish_file_table(t, NULL, NULL);
+	}
+	__private_free(pending);
+	pending = NULL;
+	pending_capacity = 0;
+	__atomic_store_n(&batch_open, 0, __ATOMIC_RELAXED);
+	BIG_UNLOCK
+}
+static void append_pending(struct lm_pair pair)
+{
+	unsigned npending = pending ? pending->npairs : 0;
+	if (npending == pending_capacity)
+	{
+		unsigned new_capacity = pending_capacity ? 2 * pending_capacity : 64;
+		struct file_table *t = alloc_file_table(new_capacity);
+		t->npairs = npending;
+		if (npending) memcpy(t->pairs, pending->pairs, npending * sizeof (struct lm_pair));
+		__private_free(pending);
+		pending = t;
+		pending_capacity = new_capacity;
+	}
+	pending->pairs[pending->npairs++] = pair;
+}
+
+#if ADDR_BITSIZE > 48
+#define PAGE_INDEX_ADDR_BITS 48 /* higher addresses just don't get indexed */
+#else
+#define PAGE_INDEX_ADDR_BITS ADDR_BITSIZE
+#endif
+#define PAGE_INDEX_LEAF_BITS 18
+#define PAGE_INDEX_TOP_BITS (PAGE_INDEX_ADDR_BITS - LOG_MIN_PAGE_SIZE - PAGE_INDEX_LEAF_BITS)
+#define PAGE_INDEX_TOP(pagenum) ((pagenum) >> PAGE_INDEX_LEAF_BITS)
+#define PAGE_INDEX_LEAF(pagenum) ((pagenum) & ((1ul << PAGE_INDEX_LEAF_BITS) - 1))
+typedef struct page_index_entry *page_index_leaf[1ul << PAGE_INDEX_LEAF_BITS];
+static page_index_leaf **page_index; /* null if the index is disabled */
+static _Bool page_index_decided;
+static void *map_demand_zero(size_t sz)
+{
+	void *ret = mmap(NULL, sz, PROT_READ|PROT_WRITE,
+		MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (ret == MAP_FAILED) abort();
+	return ret;
+}
+static void decide_page_index(void)
+{
+	if (page_index_decided) return;
+	page_index_decided = 1;
+	const char *str = getenv("LIBRUNT_PAGE_INDEX");
+	if (str && atoi(str))
+	{
+		__atomic_store_n(&page_index, map_demand_zero(
+			(1ul << PAGE_INDEX_TOP_BITS) * sizeof (page_index_leaf *)), __ATOMIC_RELEASE);
+	}
+}
+/* Call this only between file_table_read_lock() and _unlock(). */
+static inline struct page_index_entry *page_index_lookup(page_index_leaf **index, uintptr_t addr)
+{
+	uintptr_t pagenum = PAGENUM(addr);
+	if (__builtin_expect(PAGE_INDEX_TOP(pagenum) >> PAGE_INDEX_TOP_BITS, 0)) return NULL;
+	page_index_leaf *leaf = __atomic_load_n(&index[PAGE_INDEX_TOP(pagenum)], __ATOMIC_ACQUIRE);
+	if (!leaf) return NULL;
+	struct page_index_entry *e = __atomic_load_n(&(*leaf)[PAGE_INDEX_LEAF(pagenum)], __ATOMIC_ACQUIRE);
+	/* Files needn't start or end on a page boundary, and two may share
+	 * a page, in which case the page points at the last one added. */
+	if (e && addr >= e->begin && addr < e->end) return e;
+	return NULL;
+}
+static void page_index_add(struct lm_pair pair)
+{
+	/* Files with no LOADs (vaddr_begin > vaddr_end) aren't indexed. */
+	if (!page_index || pair.fm->vaddr_begin >= pair.fm->vaddr_end) return;
+	uintptr_t begin = pair.load_addr + pair.fm->vaddr_begin;
+	uintptr_t end = pair.load_addr + pair.fm->vaddr_end;
+	if (PAGE_INDEX_TOP(PAGENUM(end - 1)) >> PAGE_INDEX_TOP_BITS) return;
+	struct page_index_entry *e = __private_malloc(sizeof (struct page_index_entry));
+	if (!e) abort();
+	*e = (struct page_index_entry) { .begin = begin, .end = end, .pair = pair };
+	for (uintptr_t pagenum = PAGENUM(begin); pagenum <= PAGENUM(end - 1); ++pagenum)
+	{
+		page_index_leaf *leaf = page_index[PAGE_INDEX_TOP(pagenum)];
+		if (!leaf)
+		{
+			leaf = map_demand_zero(sizeof (page_index_leaf));
+			__atomic_store_n(&page_index[PAGE_INDEX_TOP(pagenum)], leaf, __ATOMIC_RELEASE);
+		}
+		__atomic_store_n(&(*leaf)[PAGE_INDEX_LEAF(pagenum)], e, __ATOMIC_RELEASE);
+	}
+}
+/* Returns the file's entry (if any), which the caller must retire. */
+static struct page_index_entry *page_index_remove(struct lm_pair pair)
+{
+	if (!page_index || pair.fm->vaddr_begin >= pair.fm->vaddr_end) return NULL;
+	uintptr_t begin = pair.load_addr + pair.fm->vaddr_begin;
+	uintptr_t end = pair.load_addr + pair.fm->vaddr_end;
+	if (PAGE_INDEX_TOP(PAGENUM(end - 1)) >> PAGE_INDEX_TOP_BITS) return NULL;
+	struct page_index_entry *found = NULL;
+	for (uintptr_t pagenum = PAGENUM(begin); pagenum <= PAGENUM(end - 1); ++pagenum)
+	{
+		page_index_leaf *leaf = page_index[PAGE_INDEX_TOP(pagenum)];
+		if (!leaf) continue;
+		/* Don't clear pages that a later-added file has taken over. */
+		struct page_index_entry *e = (*leaf)[PAGE_INDEX_LEAF(pagenum)];
+		if (e && e->pair.fm == pair.fm)
+		{
+			found = e;
+			__atomic_store_n(&(*leaf)[PAGE_INDEX_LEAF(pagenum)], NULL, __ATOMIC_RELEASE);
+		}
+	}
+	return found;
+}
+
 static int compare_lm_pair_by_load_addr(const void *v1, const void *v2)
 {
-	/* Trick: null pointers always compare *higher*. This is so that if we
-	 * null out an entry and re-sort, we compact to the beginning.
-	 * (But that doesn't mean that a load address of zero compares higher...
-	 * it doesn't.) */
 	const struct lm_pair *p1 = v1;
 	const struct lm_pair *p2 = v2;
-	if (p1 == p2) return 0;
-	if (!p1->lm) /* p2 compares higher */ return -1;
-	if (!p2->lm) /* p1 compares higher */ return 1;
-	uintptr_t addr1 = (uintptr_t) p1->lm->l_addr;
-	uintptr_t addr2 = (uintptr_t) p2->lm->l_addr;
 	/* avoid integer truncation issues by just returning -1 or 1 */
-	return (addr1 == addr2) ? 0 : (addr1 < addr2) ? -1 : 1;
+	return (p1->load_addr == p2->load_addr) ? 0 : (p1->load_addr < p2->load_addr) ? -1 : 1;
 }
 void __insert_file_metadata(struct link_map *lm, struct file_metadata *fm) __attribute__((weak,visibility("protected")));
 void __insert_file_metadata(struct link_map *lm, struct file_metadata *fm)
 {
 	BIG_LOCK
-	lm_pairs[npairs++] = (struct lm_pair) { .lm = lm, .fm = fm };
-	qsort(lm_pairs, npairs, sizeof lm_pairs[0], compare_lm_pair_by_load_addr);
+	struct lm_pair new_pair = (struct lm_pair) { .load_addr = lm->l_addr, .lm = lm, .fm = fm };
+	__atomic_fetch_add(&file_table_generation, 1, __ATOMIC_SEQ_CST);
+	decide_page_index();
+	page_index_add(new_pair);
+	if (batch_open)
+	{
+		append_pending(new_pair);
+		goto out;
+	}
+	struct file_table *old = __atomic_load_n(&file_table, __ATOMIC_RELAXED);
+	unsigned old_npairs = old ? old->npairs : 0;
+	/* Binary-search for the insertion point, i.e. the first entry
+	 * with a higher load address, then copy around it. */
+	unsigned lower = 0, upper = old_npairs;
+	while (lower != upper)
+	{
+		unsigned mid = lower + (upper - lower) / 2;
+		if (old->pairs[mid].load_addr <= new_pair.load_addr) lower = mid + 1;
+		else upper = mid;
+	}
+	struct file_table *t = alloc_file_table(old_npairs + 1);
+	if (lower) memcpy(&t->pairs[0], &old->pairs[0], lower * sizeof (struct lm_pair));
+	t->pairs[lower] = new_pair;
+	if (old_npairs - lower) memcpy(&t->pairs[lower + 1], &old->pairs[lower],
+		(old_npairs - lower) * sizeof (struct lm_pair));
+	publish_file_table(t, NULL, NULL);
+out:
 	BIG_UNLOCK
 }
 void __delete_file_metadata(struct file_metadata **p) __attribute__((weak,visibility("protected")));
 void __delete_file_metadata(struct file_metadata **p)
 {
-	__runt_deinit_file_metadata(*p);
-	__private_free(*p);
 	BIG_LOCK
-	/* Clear both pointers in the pair */
-	bzero((char *)((uintptr_t) p - offsetof(struct lm_pair, fm)), sizeof (struct lm_pair));
-	qsort(lm_pairs, npairs, sizeof lm_pairs[0], compare_lm_pair_by_load_addr);
-	--npairs;
+	struct file_metadata *fm = *p;
+	/* Invalidate all last-hit caches before fm can go away. */
+	__atomic_fetch_add(&file_table_generation, 1, __ATOMIC_SEQ_CST);
+	for (unsigned i = 0; pending && i < pending->npairs; ++i)
+	{
+		if (pending->pairs[i].fm == fm)
+		{
+			struct page_index_entry *e = page_index_remove(pending->pairs[i]);
+			pending->pairs[i] = pending->pairs[--pending->npairs];
+			retire(NULL, fm, e);
+			goto out;
+		}
+	}
+	struct file_table *old = __atomic_load_n(&file_table, __ATOMIC_RELAXED);
+	assert(old && old->npairs > 0);
+	struct file_table *t = alloc_file_table(old->npairs - 1);
+	struct page_index_entry *e = NULL;
+	unsigned j = 0;
+	for (unsigned i = 0; i < old->npairs; ++i)
+	{
+		if (old->pairs[i].fm == fm)
+		{
+			e = page_index_remove(old->pairs[i]);
+			continue;
+		}
+		assert(j < t->npairs);
+		t->pairs[j++] = old->pairs[i];
+	}
+	assert(j == t->npairs);
+	/* The metadata itself is freed with the old table, since a concurrent
+	 * reader may still be looking at it. */
+	publish_file_table(t, fm, e);
+out:
 	BIG_UNLOCK
 }
 struct file_metadata *__alloc_file_metadata(unsigned nsegs) __attribute__((weak,visibility("protected")));
@@ -119,34 +507,243 @@ int __reopen_file(const char *filename)
 	return open(filename, O_RDONLY);
 }
 
-struct lm_pair *lookup_by_addr(void *addr)
+/* Reopening a file by its name is racy: by the time we do it, the name may
+ * refer to a different file, or to none. Instead we open the mapping of
+ * the first LOAD through /proc/self/map_files, which always gives us the
+ * file that is actually mapped. Opening those needs CAP_SYS_ADMIN or
+ * CAP_CHECKPOINT_RESTORE, so if we get EPERM we stop trying and go by
+ * name, via __reopen_file, which clients may override. */
+static _Bool map_files_unusable;
+static struct __runt_files_reopen_stats reopen_stats;
+static int open_by_map_files(struct file_metadata *meta)
+{
+	if (__atomic_load_n(&map_files_unusable, __ATOMIC_RELAXED)) return -1;
+	ElfW(Phdr) *first_load = NULL;
+	for (unsigned i = 0; i < meta->phnum; ++i)
+	{
+		if (meta->phdrs[i].p_type == PT_LOAD) { first_load = &meta->phdrs[i]; break; }
+	}
+	if (!first_load || first_load->p_filesz == 0) return -1;
+	uintptr_t begin = ROUND_DOWN(meta->l->l_addr + first_load->p_vaddr, MIN_PAGE_SIZE);
+	uintptr_t end = ROUND_UP(meta->l->l_addr + first_load->p_vaddr + first_load->p_filesz,
+		MIN_PAGE_SIZE);
+	char path[sizeof "/proc/self/map_files/-" + 4 * sizeof (uintptr_t)];
+	snprintf(path, sizeof path, "/proc/self/map_files/%lx-%lx",
+		(unsigned long) begin, (unsigned long) end);
+	int fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd == -1 && (errno == EPERM || errno == EACCES))
+	{
+		debug_printf(1, "cannot open %s (%s); reopening files by name\n", path, strerror(errno));
+		__atomic_store_n(&map_files_unusable, 1, __ATOMIC_RELAXED);
+	}
+	return fd;
+}
+/* Lazily built indexes may need the file again long after it was loaded.
+ * With LIBRUNT_FD_CACHE=n we keep up to n of the fds open, keyed by device
+ * and inode, and hand out dups of them. A cached fd outlives the unload of
+ * its file, which is harmless: it pins the inode, so the key stays unique.
+ * When full, we evict round-robin. */
+struct fd_cache_entry
+{
+	unsigned long dev;
+	unsigned long ino;
+	int fd;
+};
+static struct fd_cache_entry *fd_cache;
+static unsigned fd_cache_size;
+static unsigned fd_cache_next;
+static unsigned fd_cache_lock;
+static void decide_fd_cache(void)
 {
-#define proj_npair_load_addr(p) (p)->lm->l_addr
-	if (npairs == 0) return NULL;
-	struct lm_pair *found = bsearch_leq_generic(struct lm_pair, (uintptr_t) addr,
-		&lm_pairs[0], npairs, proj_npair_load_addr);
-	if (!found) return NULL;
+	const char *str = getenv("LIBRUNT_FD_CACHE");
+	int n = str ? atoi(str) : 0;
+	if (n <= 0) return;
+	fd_cache = __private_malloc(n * sizeof (struct fd_cache_entry));
+	if (!fd_cache) abort();
+	for (int i = 0; i < n; ++i) fd_cache[i] = (struct fd_cache_entry) { .fd = -1 };
+	fd_cache_size = n;
+}
+static void fd_cache_acquire(void)
+{
+	__runt_spin_lock(&fd_cache_lock);
+}
+static void fd_cache_release(void)
+{
+	__runt_spin_unlock(&fd_cache_lock);
+}
+static int fd_cache_dup(unsigned long dev, unsigned long ino)
+{
+	int ret = -1;
+	fd_cache_acquire();
+	for (unsigned i = 0; i < fd_cache_size; ++i)
+	{
+		if (fd_cache[i].fd != -1 && fd_cache[i].dev == dev && fd_cache[i].ino == ino)
+		{
+			ret = fcntl(fd_cache[i].fd, F_DUPFD_CLOEXEC, 0);
+			break;
+		}
+	}
+	fd_cache_release();
+	return ret;
+}
+static void fd_cache_insert(unsigned long dev, unsigned long ino, int fd)
+{
+	int cached_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (cached_fd == -1) return;
+	int evicted_fd = -1;
+	fd_cache_acquire();
+	for (unsigned i = 0; i < fd_cache_size; ++i)
+	{
+		if (fd_cache[i].fd != -1 && fd_cache[i].dev == dev && fd_cache[i].ino == ino)
+		{
+			/* Someone beat us to it. */
+			evicted_fd = cached_fd;
+			goto out;
+		}
+	}
+	struct fd_cache_entry *e = &fd_cache[fd_cache_next];
+	fd_cache_next = (fd_cache_next + 1) % fd_cache_size;
+	evicted_fd = e->fd;
+	*e = (struct fd_cache_entry) { dev, ino, cached_fd };
+out:
+	fd_cache_release();
+	if (evicted_fd != -1) close(evicted_fd);
+}
+int __runt_files_reopen(struct file_metadata *meta)
+{
+	int fd;
+	if (fd_cache_size && meta->file_ino)
+	{
+		fd = fd_cache_dup(meta->file_dev, meta->file_ino);
+		if (fd != -1)
+		{
+			__atomic_fetch_add(&reopen_stats.cache_hits, 1, __ATOMIC_RELAXED);
+			return fd;
+		}
+	}
+	fd = open_by_map_files(meta);
+	if (fd != -1) __atomic_fetch_add(&reopen_stats.by_map_files, 1, __ATOMIC_RELAXED);
+	else
+	{
+		fd = __reopen_file(meta->filename);
+		if (fd == -1)
+		{
+			__atomic_fetch_add(&reopen_stats.failed, 1, __ATOMIC_RELAXED);
+			return -1;
+		}
+		__atomic_fetch_add(&reopen_stats.by_path, 1, __ATOMIC_RELAXED);
+	}
+	struct stat st;
+	if (0 == fstat(fd, &st))
+	{
+		meta->file_dev = st.st_dev;
+		meta->file_ino = st.st_ino;
+		if (fd_cache_size) fd_cache_insert(st.st_dev, st.st_ino, fd);
+	}
+	return fd;
+}
+void __runt_files_get_reopen_stats(struct __runt_files_reopen_stats *out)
+{
+	out->by_map_files = __atomic_load_n(&reopen_stats.by_map_files, __ATOMIC_RELAXED);
+	out->by_path = __atomic_load_n(&reopen_stats.by_path, __ATOMIC_RELAXED);
+	out->cache_hits = __atomic_load_n(&reopen_stats.cache_hits, __ATOMIC_RELAXED);
+	out->failed = __atomic_load_n(&reopen_stats.failed, __ATOMIC_RELAXED);
+}
+
+/* Call this only between file_table_read_lock() and _unlock(). */
+static struct lm_pair *lookup_by_addr(struct file_table *t, void *addr)
+{
+	if (!t || t->npairs == 0) return NULL;
+	long idx = eytzinger_search_leq(t->search_keys, t->search_ranks, t->npairs,
+		(uintptr_t) addr);
+	if (idx < 0) return NULL;
+	struct lm_pair *found = &t->pairs[idx];
 	/* Sanity check: we know addr is >= the load address of this file,
 	 * but it within the file's dynamic extent? */
-	uintptr_t query_vaddr = (uintptr_t) addr - found->lm->l_addr;
+	uintptr_t query_vaddr = (uintptr_t) addr - found->load_addr;
 	if (query_vaddr < found->fm->vaddr_end) return found;
 	return NULL;
-#undef proj_npair_load_addr
+}
+static _Bool lookup_pair(void *addr, struct lm_pair *out)
+{
+	unsigned long generation = __atomic_load_n(&file_table_generation, __ATOMIC_SEQ_CST);
+	if (last_hit.generation == generation
+			&& (uintptr_t) addr - last_hit.begin < last_hit.end - last_hit.begin)
+	{
+		BUMP_SLOT_STAT(my_reader_slot, cache_hits);
+		*out = last_hit.pair;
+		return 1;
+	}
+	unsigned long *ctr = file_table_read_lock();
+	BUMP_SLOT_STAT(my_reader_slot, cache_misses);
+	struct lm_pair *p = NULL;
+	page_index_leaf **index = __atomic_load_n(&page_index, __ATOMIC_ACQUIRE);
+	if (index)
+	{
+		struct page_index_entry *e = page_index_lookup(index, (uintptr_t) addr);
+		if (e) p = &e->pair;
+	}
+	/* The index only covers [vaddr_begin, vaddr_end) of each file, so on
+	 * a miss we still search the table, which is what defines the answer. */
+	if (!p) p = lookup_by_addr(__atomic_load_n(&file_table, __ATOMIC_SEQ_CST), addr);
+	if (p)
+	{
+		*out = *p;
+		/* If the generation has moved on since we read it, this entry
+		 * will simply never hit. */
+		last_hit = (struct last_hit) {
+			.generation = generation,
+			.begin = p->load_addr + p->fm->vaddr_begin,
+			.end = p->load_addr + p->fm->vaddr_end,
+			.pair = *p
+		};
+	}
+	file_table_read_unlock(ctr);
+	if (!p && __builtin_expect(__atomic_load_n(&batch_open, __ATOMIC_RELAXED), 0))
+	{
+		/* Slow path: the file may be in the not-yet-published batch. */
+		BIG_LOCK
+		for (unsigned i = 0; pending && i < pending->npairs; ++i)
+		{
+			if ((uintptr_t) addr >= pending->pairs[i].load_addr
+				&& (uintptr_t) addr - pending->pairs[i].load_addr < pending->pairs[i].fm->vaddr_end)
+			{
+				*out = pending->pairs[i];
+				p = out;
+				break;
+			}
+		}
+		BIG_UNLOCK
+	}
+	return p != NULL;
+}
+void __runt_files_get_lookup_stats(struct __runt_files_lookup_stats *out)
+{
+	*out = (struct __runt_files_lookup_stats) {
+		.generation = __atomic_load_n(&file_table_generation, __ATOMIC_RELAXED)
+	};
+	for (unsigned i = 0; i < FILE_TABLE_READER_SLOTS; ++i)
+	{
+		out->cache_hits += __atomic_load_n(&reader_slots[i].cache_hits, __ATOMIC_RELAXED);
+		out->cache_misses += __atomic_load_n(&reader_slots[i].cache_misses, __ATOMIC_RELAXED);
+	}
 }
 struct link_map *__runt_files_lookup_by_addr(void *addr)
 {
 	if (!initialized) __runt_files_init();
-	struct lm_pair *p = lookup_by_addr(addr);
-	return p ? p->lm : NULL;
+	struct lm_pair found;
+	return lookup_pair(addr, &found) ? found.lm : NULL;
 }
 
 static struct file_metadata *metadata_for_addr(void *addr)
 {
-	struct lm_pair *p = lookup_by_addr(addr);
-	return p ? p->fm : NULL;
+	struct lm_pair found;
+	return lookup_pair(addr, &found) ? found.fm : NULL;
 }
 /* See note above! Don't call this; call its __wrap_ wrapper. If
- * there's no wrapper we'll --defsym it as an alias. */
+ * there's no wrapper we'll --defsym it as an alias. The result outlives
+ * our read-side section only until the file is unloaded (see the file
+ * table comment). */
 struct file_metadata *__wrap___runt_files_metadata_by_addr(void *addr);
 struct file_metadata *__runt_files_metadata_by_addr(void *addr)
 {
@@ -154,6 +751,114 @@ struct file_metadata *__runt_files_metadata_by_addr(void *addr)
 	return metadata_for_addr(addr);
 }
 
+
+/* Batch lookup. Rather than a search per address, we sort the addresses
+ * and walk them and the table together in a single merge pass. If the
+ * addresses are already sorted (e.g. our batch symbol lookup sorts them
+ * itself), we skip the sort. */
+static int compare_addr_and_idx(const void *v1, const void *v2)
+{
+	const struct addr_and_idx *a1 = v1;
+	const struct addr_and_idx *a2 = v2;
+	return (a1->addr == a2->addr) ? 0 : (a1->addr < a2->addr) ? -1 : 1;
+}
+/* Batches can have many thousands of addresses, mostly sharing their high
+ * bits, so we radix-sort them a byte at a time (least significant first),
+ * skipping any byte that is the same in every address. */
+void __runt_sort_addrs_and_idxs(struct addr_and_idx *a, size_t n)
+{
+	if (n < 64)
+	{
+		qsort(a, n, sizeof (struct addr_and_idx), compare_addr_and_idx);
+		return;
+	}
+	uintptr_t all_or = 0, all_and = (uintptr_t) -1;
+	for (size_t i = 0; i < n; ++i)
+	{
+		all_or |= a[i].addr;
+		all_and &= a[i].addr;
+	}
+	uintptr_t varying = all_or ^ all_and;
+	struct addr_and_idx *tmp = __private_malloc(n * sizeof (struct addr_and_idx));
+	if (!tmp) abort();
+	struct addr_and_idx *src = a, *dst = tmp;
+	for (unsigned shift = 0; shift < 8 * sizeof (uintptr_t); shift += 8)
+	{
+		if (!((varying >> shift) & 0xff)) continue;
+		size_t offsets[256] = { 0 };
+		for (size_t i = 0; i < n; ++i) ++offsets[(src[i].addr >> shift) & 0xff];
+		size_t total = 0;
+		for (unsigned d = 0; d < 256; ++d)
+		{
+			size_t count = offsets[d];
+			offsets[d] = total;
+			total += count;
+		}
+		for (size_t i = 0; i < n; ++i) dst[offsets[(src[i].addr >> shift) & 0xff]++] = src[i];
+		struct addr_and_idx *swap = src;
+		src = dst;
+		dst = swap;
+	}
+	if (src != a) memcpy(a, src, n * sizeof (struct addr_and_idx));
+	__private_free(tmp);
+}
+void __runt_files_metadata_by_addrs(const void **addrs, size_t n, struct file_metadata **out)
+{
+	if (!initialized) __runt_files_init();
+	/* If somebody has wrapped the single-address lookup, we have to
+	 * respect that, so do one address at a time through the wrapper. */
+	if ((void*) __wrap___runt_files_metadata_by_addr != (void*) __runt_files_metadata_by_addr)
+	{
+		for (size_t i = 0; i < n; ++i) out[i] = __wrap___runt_files_metadata_by_addr((void*) addrs[i]);
+		return;
+	}
+	_Bool already_sorted = 1;
+	for (size_t i = 1; i < n && already_sorted; ++i)
+	{
+		if ((uintptr_t) addrs[i] < (uintptr_t) addrs[i-1]) already_sorted = 0;
+	}
+	struct addr_and_idx *sorted = NULL;
+	if (!already_sorted)
+	{
+		sorted = __private_malloc(n * sizeof (struct addr_and_idx));
+		if (!sorted) abort();
+		for (size_t i = 0; i < n; ++i) sorted[i] = (struct addr_and_idx) { (uintptr_t) addrs[i], i };
+		__runt_sort_addrs_and_idxs(sorted, n);
+	}
+#define SORTED_ADDR(k) (sorted ? sorted[(k)].addr : (uintptr_t) addrs[(k)])
+#define SORTED_IDX(k)  (sorted ? sorted[(k)].idx : (k))
+	unsigned long *ctr = file_table_read_lock();
+	struct file_table *t = __atomic_load_n(&file_table, __ATOMIC_SEQ_CST);
+	unsigned j = 0; /* the last pair whose load address is <= the current address */
+	for (size_t k = 0; k < n; ++k)
+	{
+		uintptr_t addr = SORTED_ADDR(k);
+		struct file_metadata *found = NULL;
+		if (t && t->npairs > 0)
+		{
+			while (j + 1 < t->npairs && t->pairs[j + 1].load_addr <= addr) ++j;
+			if (t->pairs[j].load_addr <= addr
+					&& addr - t->pairs[j].load_addr < t->pairs[j].fm->vaddr_end)
+			{
+				found = t->pairs[j].fm;
+			}
+		}
+		out[SORTED_IDX(k)] = found;
+	}
+	file_table_read_unlock(ctr);
+#undef SORTED_ADDR
+#undef SORTED_IDX
+	__private_free(sorted);
+	/* Files in a not-yet-published batch are only found the slow way. */
+	if (__builtin_expect(__atomic_load_n(&batch_open, __ATOMIC_RELAXED), 0))
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			if (!out[i]) out[i] = metadata_for_addr((void*) addrs[i]);
+		}
+	}
+}
+
 static int add_all_loaded_segments_for_one_file_only_cb(struct dl_phdr_info *info, size_t size, void *file_metadata);
 struct segments
 {
@@ -162,9 +867,85 @@ struct segments
 	unsigned nload;
 };
 static int discover_segments_cb(struct dl_phdr_info *info, size_t size, void *segments_as_void);
+static void decide_map_whole_file(void);
+static void decide_defer_shdrs(void);
 
 struct file_metadata *__wrap___runt_files_notify_load(void *handle, const void *load_site);
 
+/* Optionally (LIBRUNT_STARTUP_THREADS=n), we build the metadata for the
+ * startup libraries on a pool of n threads (counting this one), since
+ * with hundreds of libraries the per-file work (reopening, mapping the
+ * section headers, indexing symbols) adds up. Threads claim files by
+ * atomically bumping an index. Once all are done, this thread inserts
+ * the results in link map order, so the outcome doesn't depend on
+ * scheduling. */
+static struct file_metadata *load_file_metadata(struct link_map *l, const void *load_site,
+	const char *dynobj_name, _Bool insert);
+#ifndef MAX_STARTUP_THREADS
+#define MAX_STARTUP_THREADS 64
+#endif
+static unsigned startup_threads(void)
+{
+#ifdef NO_PTHREADS
+	return 1;
+#else
+	const char *str = getenv("LIBRUNT_STARTUP_THREADS");
+	int n = str ? atoi(str) : 1;
+	return (n < 1) ? 1 : (n > MAX_STARTUP_THREADS) ? MAX_STARTUP_THREADS : n;
+#endif
+}
+struct parallel_load
+{
+	const void *load_site;
+	unsigned nhandles;
+	struct file_metadata **metas;
+	unsigned next;
+};
+static void *parallel_load_worker(void *arg)
+{
+	struct parallel_load *p = arg;
+	unsigned i;
+	while ((i = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED)) < p->nhandles)
+	{
+		struct link_map *l = early_lib_handles[i];
+		char buf[PATH_MAX];
+		const char *name = __private_strdup(
+			dynobj_name_from_dlpi_name_r(l->l_name, (void*) l->l_addr, buf));
+		p->metas[i] = load_file_metadata(l, p->load_site, name, 0);
+	}
+	return NULL;
+}
+static void load_early_libs_in_parallel(const void *load_site, unsigned nthreads)
+{
+#ifndef NO_PTHREADS
+	unsigned nhandles = 0;
+	while (early_lib_handles[nhandles]) ++nhandles;
+	struct parallel_load p = {
+		.load_site = load_site,
+		.nhandles = nhandles,
+		.metas = __private_malloc(nhandles * sizeof (struct file_metadata *))
+	};
+	if (!p.metas) abort();
+	/* Workers name the executable, and may debug_printf, so fill those
+	 * static buffers now; after that, they are only read. */
+	(void) get_exe_dynobj_fullname();
+	(void) get_exe_command_basename();
+	if (nthreads > nhandles) nthreads = nhandles;
+	pthread_t threads[nthreads];
+	unsigned nstarted = 0;
+	for (unsigned i = 1; i < nthreads; ++i)
+	{
+		/* If we can't start a thread, we just do more of the work ourselves. */
+		if (0 == pthread_create(&threads[nstarted], NULL, parallel_load_worker, &p)) ++nstarted;
+	}
+	parallel_load_worker(&p);
+	for (unsigned i = 0; i < nstarted; ++i) pthread_join(threads[i], NULL);
+	debug_printf(1, "loaded metadata for %u startup files on %u threads\n", nhandles, nstarted + 1);
+	for (unsigned i = 0; i < nhandles; ++i) __insert_file_metadata(early_lib_handles[i], p.metas[i]);
+	__private_free(p.metas);
+#endif
+}
+
 void __runt_files_init(void) __attribute__((constructor(102)));
 void __runt_files_init(void)
 {
@@ -175,6 +956,9 @@ void __runt_files_init(void)
 		/* Snapshot the early libs. This is basically whatever was
 		 * loaded by the dynamic linker at start-up. */
 		init_early_libs();
+		decide_map_whole_file();
+		decide_fd_cache();
+		decide_defer_shdrs();
 
 		/* FIXME: arguably, for dynamically linked programs, the allocation
 		 * site of files is somewhere inside the dynamic linker. E.g.
@@ -191,17 +975,283 @@ void __runt_files_init(void)
 		 * over those we snapshotted. But if we *haven't* run dlopen
 		 * at all yet, just iterate over everything. */
 		assert(early_lib_handles[0]);
-		for (unsigned i = 0; i < MAX_EARLY_LIBS; ++i)
+		begin_insert_batch();
+		unsigned nthreads = startup_threads();
+		/* If somebody wraps notify_load, we have to call them, in order. */
+		if (nthreads > 1 && (void*) __wrap___runt_files_notify_load == (void*) __runt_files_notify_load)
+		{
+			load_early_libs_in_parallel(program_entry_point, nthreads);
+		}
+		else for (unsigned i = 0; early_lib_handles[i]; ++i)
 		{
-			if (!early_lib_handles[i]) break;
 			__wrap___runt_files_notify_load(early_lib_handles[i],
 				program_entry_point);
 		}
+		end_insert_batch();
+		__runt_symbols_build_name_index();
 		initialized = 1;
 		trying_to_initialize = 0;
 	}
 }
 
+/* Extra mappings. We used to keep a fixed array of these and give up when
+ * it filled, but files with many sections we want (e.g. linked with -q) can
+ * need more. Now we keep a table of disjoint ranges of the file, sorted by
+ * offset, so lookups are a binary search. When a new range touches existing
+ * ones, we map their union instead. Usually we can do that by mapping just
+ * the missing part right next to an existing mapping, which the kernel
+ * merges into the same VMA. Otherwise we map the union afresh, and the
+ * mappings it subsumes leave the table. We can't unmap those, since we may
+ * have handed out pointers into them, so they stay until the file goes.
+ *
+ * Readers don't lock: writers (serialized by a per-file spinlock) publish
+ * a new copy of the table, and old copies also stay until the file goes. */
+struct extra_mapping_node
+{
+	struct extra_mapping m;
+	struct extra_mapping_node *next;
+};
+struct extra_mapping_table
+{
+	struct extra_mapping_table *superseded;
+	struct extra_mapping_node *subsumed;
+	unsigned long nsubsumed;
+	unsigned long bytes;
+	unsigned long extended;
+	unsigned long mmaps;
+	unsigned n;
+	struct extra_mapping m[];
+};
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+static void *lookup_extra_mapping(struct file_metadata *file, off_t offset, size_t length)
+{
+	struct extra_mapping_table *t = __atomic_load_n(&file->extra_mappings, __ATOMIC_ACQUIRE);
+	if (!t || t->n == 0) return NULL;
+#define proj_fileoff(p) (p)->fileoff_pagealigned
+	struct extra_mapping *m = bsearch_leq_generic(struct extra_mapping, (size_t) offset,
+		t->m, t->n, proj_fileoff);
+#undef proj_fileoff
+	if (m && m->fileoff_pagealigned + m->size >= (size_t) offset + length)
+	{
+		return (char*) m->mapping_pagealigned + (offset - m->fileoff_pagealigned);
+	}
+	return NULL;
+}
+/* Map [begin, end) of the file just below or just above an existing mapping,
+ * so that the two are contiguous. */
+static _Bool map_adjacent(int fd, size_t begin, size_t end, char *at, unsigned long *nmmaps)
+{
+	if (begin == end) return 1;
+	++*nmmaps;
+	void *ret = mmap(at, end - begin, PROT_READ, MAP_PRIVATE|MAP_FIXED_NOREPLACE, fd, begin);
+	if (MMAP_RETURN_IS_ERROR(ret)) return 0;
+	/* Kernels before 4.17 take MAP_FIXED_NOREPLACE as a mere hint. */
+	if (ret != at) { munmap(ret, end - begin); return 0; }
+	return 1;
+}
+static void *map_extra_range(struct file_metadata *file, int fd, off_t offset, size_t length)
+{
+	size_t begin = ROUND_DOWN(offset, MIN_PAGE_SIZE);
+	size_t end = ROUND_UP(offset + length, MIN_PAGE_SIZE);
+	__runt_spin_lock(&file->extra_mappings_lock);
+	void *ret = lookup_extra_mapping(file, offset, length); /* someone may have beaten us */
+	struct extra_mapping_table *old = file->extra_mappings;
+	if (ret) goto out;
+	/* Which existing mappings does [begin, end) touch? A contiguous run. */
+	unsigned n = old ? old->n : 0, first = 0, last;
+	while (first < n && old->m[first].fileoff_pagealigned + old->m[first].size < begin) ++first;
+	for (last = first; last < n && old->m[last].fileoff_pagealigned <= end; ++last);
+	struct extra_mapping merged = { NULL, begin, end - begin };
+	if (last > first)
+	{
+		size_t run_begin = old->m[first].fileoff_pagealigned;
+		size_t run_end = old->m[last - 1].fileoff_pagealigned + old->m[last - 1].size;
+		if (run_begin < begin) begin = run_begin;
+		if (run_end > end) end = run_end;
+		merged = (struct extra_mapping) { NULL, begin, end - begin };
+	}
+	_Bool extended = 0;
+	unsigned long nmmaps = 0;
+	if (last == first + 1)
+	{
+		/* Try to grow the one mapping we touch, at either end. If only
+		 * one end works, we can undo it, since nobody has seen it yet. */
+		struct extra_mapping *m = &old->m[first];
+		size_t m_end_off = m->fileoff_pagealigned + m->size;
+		char *m_end = (char*) m->mapping_pagealigned + m->size;
+		char *new_begin = (char*) m->mapping_pagealigned - (m->fileoff_pagealigned - begin);
+		if (map_adjacent(fd, m_end_off, end, m_end, &nmmaps))
+		{
+			if (map_adjacent(fd, begin, m->fileoff_pagealigned, new_begin, &nmmaps))
+			{
+				merged.mapping_pagealigned = new_begin;
+				extended = 1;
+			}
+			else if (end > m_end_off) munmap(m_end, end - m_end_off);
+		}
+	}
+	if (!extended)
+	{
+		++nmmaps;
+		void *mapping = mmap(NULL, merged.size, PROT_READ, MAP_PRIVATE, fd, begin);
+		if (MMAP_RETURN_IS_ERROR(mapping)) goto out;
+		merged.mapping_pagealigned = mapping;
+	}
+	/* Publish a new table with the run replaced by the merged mapping. */
+	unsigned new_n = n - (last - first) + 1;
+	struct extra_mapping_table *t = __private_malloc(sizeof (struct extra_mapping_table)
+		+ new_n * sizeof (struct extra_mapping));
+	if (!t) abort();
+	*t = (struct extra_mapping_table) {
+		.superseded = old,
+		.subsumed = old ? old->subsumed : NULL,
+		.nsubsumed = old ? old->nsubsumed : 0,
+		.bytes = old ? old->bytes : 0,
+		.extended = old ? old->extended : 0,
+		.mmaps = (old ? old->mmaps : 0) + nmmaps,
+		.n = new_n
+	};
+	if (n) memcpy(t->m, old->m, first * sizeof (struct extra_mapping));
+	t->m[first] = merged;
+	if (n) memcpy(t->m + first + 1, old->m + last, (n - last) * sizeof (struct extra_mapping));
+	if (extended)
+	{
+		++t->extended;
+		t->bytes += merged.size - old->m[first].size;
+	}
+	else
+	{
+		t->bytes += merged.size;
+		for (unsigned i = first; i < last; ++i)
+		{
+			struct extra_mapping_node *node = __private_malloc(sizeof *node);
+			if (!node) abort();
+			*node = (struct extra_mapping_node) { old->m[i], t->subsumed };
+			t->subsumed = node;
+			++t->nsubsumed;
+		}
+	}
+	__atomic_store_n(&file->extra_mappings, t, __ATOMIC_RELEASE);
+	ret = (char*) merged.mapping_pagealigned + (offset - merged.fileoff_pagealigned);
+out:
+	__runt_spin_unlock(&file->extra_mappings_lock);
+	return ret;
+}
+/* Alternatively, LIBRUNT_MAP_WHOLE_FILE=1 makes us map each file whole, once,
+ * so that every range not in a LOAD comes from that one mapping. That
+ * costs address space but saves mmap calls and VMAs, and the latter slow
+ * down everything that reads /proc/self/maps. Setting it to "random" or
+ * "willneed" instead also applies that madvise() advice. */
+static _Bool map_whole_file;
+static int map_whole_file_advice = -1;
+static void decide_map_whole_file(void)
+{
+	const char *str = getenv("LIBRUNT_MAP_WHOLE_FILE");
+	if (!str) return;
+	if (0 == strcmp(str, "random")) map_whole_file_advice = MADV_RANDOM;
+	else if (0 == strcmp(str, "willneed")) map_whole_file_advice = MADV_WILLNEED;
+	else if (!atoi(str)) return;
+	map_whole_file = 1;
+}
+static void map_extra_whole_file(struct file_metadata *file, int fd)
+{
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) return;
+	size_t size = ROUND_UP(st.st_size, MIN_PAGE_SIZE);
+	void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (MMAP_RETURN_IS_ERROR(mapping)) return;
+	if (map_whole_file_advice != -1) madvise(mapping, size, map_whole_file_advice);
+	struct extra_mapping_table *t = __private_malloc(sizeof (struct extra_mapping_table)
+		+ sizeof (struct extra_mapping));
+	if (!t) abort();
+	*t = (struct extra_mapping_table) { .bytes = size, .mmaps = 1, .n = 1 };
+	t->m[0] = (struct extra_mapping) { mapping, 0, size };
+	/* The file is not yet visible to anyone else. */
+	file->extra_mappings = t;
+}
+static void unmap_extra_mappings(struct file_metadata *file)
+{
+	struct extra_mapping_table *t = file->extra_mappings;
+	if (!t) return;
+	for (unsigned i = 0; i < t->n; ++i) munmap(t->m[i].mapping_pagealigned, t->m[i].size);
+	for (struct extra_mapping_node *node = t->subsumed; node; )
+	{
+		struct extra_mapping_node *next = node->next;
+		munmap(node->m.mapping_pagealigned, node->m.size);
+		__private_free(node);
+		node = next;
+	}
+	while (t)
+	{
+		struct extra_mapping_table *superseded = t->superseded;
+		__private_free(t);
+		t = superseded;
+	}
+	file->extra_mappings = NULL;
+}
+void __runt_files_get_mapping_stats(struct file_metadata *fm,
+	struct __runt_files_mapping_stats *out)
+{
+	struct extra_mapping_table *t = __atomic_load_n(&fm->extra_mappings, __ATOMIC_ACQUIRE);
+	*out = (struct __runt_files_mapping_stats) {
+		.mappings = t ? t->n : 0,
+		.subsumed = t ? t->nsubsumed : 0,
+		.bytes = t ? t->bytes : 0,
+		.extended = t ? t->extended : 0,
+		.mmaps = t ? t->mmaps : 0
+	};
+}
+
+/* Notes. Almost always the loader has mapped them for us, in a PT_NOTE
+ * inside a LOAD, so we can read them without any syscalls. */
+static _Bool note_segment_in_memory(struct file_metadata *meta, ElfW(Phdr) *note)
+{
+	for (unsigned i = 0; i < meta->phnum; ++i)
+	{
+		ElfW(Phdr) *load = &meta->phdrs[i];
+		if (load->p_type == PT_LOAD && load->p_vaddr <= note->p_vaddr
+				&& note->p_vaddr + note->p_filesz <= load->p_vaddr + load->p_filesz) return 1;
+	}
+	return 0;
+}
+_Bool __runt_files_next_note(struct file_metadata *meta,
+	struct file_note_cursor *cursor, struct elf_note *out)
+{
+	for (; cursor->phndx < meta->phnum; ++cursor->phndx, cursor->pos = NULL)
+	{
+		ElfW(Phdr) *phdr = &meta->phdrs[cursor->phndx];
+		if (phdr->p_type != PT_NOTE || !note_segment_in_memory(meta, phdr)) continue;
+		const char *begin = (const char *) meta->l->l_addr + phdr->p_vaddr;
+		if (!cursor->pos) cursor->pos = begin;
+		if (elf_note_next(&cursor->pos, begin + phdr->p_filesz, phdr->p_align, out)) return 1;
+	}
+	return 0;
+}
+static void notice_note(struct file_metadata *meta, const struct elf_note *n)
+{
+	if (elf_note_is(n, "GNU", NT_GNU_BUILD_ID) && n->descsz > 0 && !meta->build_id)
+	{
+		meta->build_id = n->desc;
+		meta->build_id_len = n->descsz;
+	}
+	else if (elf_note_is(n, "GNU", NT_GNU_ABI_TAG) && n->descsz >= 4 * sizeof (ElfW(Word))
+			&& !meta->abi_tag) meta->abi_tag = n->desc;
+	else if (elf_note_is(n, "GNU", NT_GNU_PROPERTY_TYPE_0) && !meta->gnu_property)
+	{
+		meta->gnu_property = n->desc;
+		meta->gnu_property_sz = n->descsz;
+	}
+}
+static void read_notes_from_phdrs(struct file_metadata *meta)
+{
+	struct file_note_cursor cursor = { 0 };
+	struct elf_note n;
+	while (__runt_files_next_note(meta, &cursor, &n)) notice_note(meta, &n);
+}
+
 static void *get_or_map_file_range(struct file_metadata *file,
 	size_t length, int fd, off_t offset)
 {
@@ -241,43 +1291,10 @@ static void *get_or_map_file_range(struct file_metadata *file,
 			}
 		}
 	}
+	void *found = lookup_extra_mapping(file, offset, length);
 	/* Without an fd (e.g. for the vdso) we can only return existing mappings. */
-	if (fd == -1) return NULL;
-	/* Now we can try making a fresh mapping. But maybe an existing one will do. */
-	unsigned midx = 0;
-	for (; midx < MAPPING_MAX; ++midx)
-	{
-		struct extra_mapping *m = &file->extra_mappings[midx];
-		if (!m->mapping_pagealigned)
-		{
-			// this is a free slot. we fill from index 0 upwards, so no more
-			break;
-		}
-		if (m->mapping_pagealigned
-			&& (unsigned long) m->fileoff_pagealigned <= (unsigned long) offset
-			&& (unsigned long) m->fileoff_pagealigned + m->size >= (unsigned long) offset + length)
-		{
-			return m->mapping_pagealigned + (offset - m->fileoff_pagealigned);
-		}
-	}
-	/* OK. We need to create a new extra mapping, unless there's no room... */
-	if (midx == MAPPING_MAX) return NULL;
-	// tweak our offset/length
-	off_t rounded_offset = ROUND_DOWN(offset, MIN_PAGE_SIZE);
-	length += offset - rounded_offset;
-	length = ROUND_UP(length, MIN_PAGE_SIZE);
-	// FIXME: racy
-	void *ret = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, rounded_offset);
-	if (!MMAP_RETURN_IS_ERROR(ret))
-	{
-		file->extra_mappings[midx] = (struct extra_mapping) {
-			.mapping_pagealigned = ret,
-			.fileoff_pagealigned = rounded_offset,
-			.size = length
-		};
-		return (char*) ret + (offset - rounded_offset);
-	}
-	return NULL;
+	if (found || fd == -1) return found;
+	return map_extra_range(file, fd, offset, length);
 }
 
 /* IMPORTANT: don't call this directly. We want to be able to wrap it.
@@ -298,6 +1315,49 @@ struct file_metadata *__runt_files_notify_load(void *handle, const void *load_si
 	 * this pointer into the file_metadata struct later, whose deallocator will
 	 * free it. */
 	const char *dynobj_name = __private_strdup(tmp);
+	struct file_metadata *meta = load_file_metadata(l, load_site, dynobj_name, 1);
+	/* The load may have brought in dependencies too; this catches those. */
+	__runt_symbols_notify_load();
+	return meta;
+}
+static void map_shdrs_and_define_sections(struct file_metadata *meta);
+/* With LIBRUNT_DEFER_SHDRS=1, loading a file touches only what the loader
+ * already mapped: phdrs, PT_DYNAMIC, dynsym/dynstr and notes. Reopening
+ * the file to map its section headers, symtab and shstrtab, and defining
+ * its sections, waits for the first query that needs them. Code that
+ * reads those fields directly must call this first. Returns whether the
+ * file has section headers (or false if we are called back mid-mapping). */
+static _Bool defer_shdrs;
+static __thread _Bool mapping_shdrs_here __attribute__((tls_model("initial-exec")));
+_Bool __runt_files_ensure_shdrs_mapped(struct file_metadata *meta)
+{
+	if (__builtin_expect(__runt_once_done(&meta->shdrs_state), 1)) return meta->shdrs != NULL;
+	/* As in segments.c, a reentrant caller just falls back. */
+	if (mapping_shdrs_here) return 0;
+	if (__runt_once_claim(&meta->shdrs_state))
+	{
+		mapping_shdrs_here = 1;
+		map_shdrs_and_define_sections(meta);
+		mapping_shdrs_here = 0;
+		__runt_once_finish(&meta->shdrs_state, 1);
+	}
+	return meta->shdrs != NULL;
+}
+_Bool __runt_files_shdrs_mapped(struct file_metadata *meta)
+{
+	return __runt_once_done(&meta->shdrs_state) && meta->shdrs != NULL;
+}
+static void decide_defer_shdrs(void)
+{
+	const char *str = getenv("LIBRUNT_DEFER_SHDRS");
+	defer_shdrs = str && atoi(str);
+}
+/* Do the work of notify_load, given the file's (strdup'd) name. If insert is
+ * false, the caller is responsible for inserting the metadata. Apart from
+ * that, this touches no shared state, so can run on any thread. */
+static struct file_metadata *load_file_metadata(struct link_map *l, const void *load_site,
+	const char *dynobj_name, _Bool insert)
+{
 	debug_printf(1, "librunt notified of load of object %s\n", dynobj_name);
 	/* Look up the mapping sequence for this file. Note that
 	 * although a file is notionally sparse, modern glibc's ld.so
@@ -347,7 +1407,7 @@ struct file_metadata *__runt_files_notify_load(void *handle, const void *load_si
 		}
 	}
 	/* We still haven't filled in everything... */
-	__insert_file_metadata(l, meta);
+	if (insert) __insert_file_metadata(l, meta);
 	/* The only semi-portable way to get phdrs is to iterate over
 	 * *all* the phdrs. But we only want to process a single file's
 	 * phdrs now. Our callback must do the test. */
@@ -364,27 +1424,41 @@ struct file_metadata *__runt_files_notify_load(void *handle, const void *load_si
 	meta->dynsym = (ElfW(Sym) *) MAYBE_FIXUP(dynamic_lookup(meta->l->l_ld, DT_SYMTAB)->d_un.d_ptr); /* always mapped by ld.so */
 	meta->dynstr = (unsigned char *) MAYBE_FIXUP(dynamic_lookup(meta->l->l_ld, DT_STRTAB)->d_un.d_ptr); /* always mapped by ld.so */
 	meta->dynstr_end = meta->dynstr + dynamic_lookup(meta->l->l_ld, DT_STRSZ)->d_un.d_val; /* always mapped by ld.so */
+	read_notes_from_phdrs(meta);
 	/* Now we have the most file metadata we can get without re-mapping extra
-	 * parts of the file. */
-	/* FIXME: we'd much rather not do open() on l->l_name (race condition) --
-	 * if we had the original fd that was exec'd, that would be great. If we
-	 * were in a libgerald- */
-	int fd = __reopen_file(meta->filename);
+	 * parts of the file. Everything else may wait until it is queried. */
+	if (!defer_shdrs) __runt_files_ensure_shdrs_mapped(meta);
+	else __runt_segments_notify_shdrs_deferred(meta);
+	return meta;
+}
+static void map_shdrs_and_define_sections(struct file_metadata *meta)
+{
+	/* We'd still rather have the original fd that was exec'd or dlopened,
+	 * but failing that, this avoids the name where it can (see above). */
+	int fd = __runt_files_reopen(meta);
 	if (fd < 0)
 	{
 		// warn, at a debug level that depends on whether the path looks sane
 		debug_printf((meta->filename && meta->filename[0] == '/' ? 0 : 5),
-			"could not re-open `%s'\n", l->l_name);
+			"could not re-open `%s'\n", meta->l->l_name);
 		fd = -1; /* We can still work with this, just not make new mappings. */
 	}
+	if (fd != -1 && map_whole_file) map_extra_whole_file(meta, fd);
 	meta->ehdr = get_or_map_file_range(meta, MIN_PAGE_SIZE, fd, 0);
 	if (!meta->ehdr) goto out;
 	assert(0 == memcmp(meta->ehdr, "\177ELF", 4));
-	bzero(meta->build_id, sizeof meta->build_id);
 	size_t shdrs_sz = meta->ehdr->e_shnum * meta->ehdr->e_shentsize;
-	// assert sanity
-#define MAX_SANE_SHDRS_SIZE 512*sizeof(ElfW(Shdr))
-	assert(shdrs_sz < MAX_SANE_SHDRS_SIZE);
+	/* Objects built with -ffunction-sections can have many thousands of
+	 * sections, so the only sane bound is the file itself. */
+	struct stat st;
+	if ((meta->ehdr->e_shnum && meta->ehdr->e_shentsize != sizeof (ElfW(Shdr)))
+			|| (fd != -1 && 0 == fstat(fd, &st)
+				&& (meta->ehdr->e_shoff > (size_t) st.st_size
+					|| shdrs_sz > (size_t) st.st_size - meta->ehdr->e_shoff)))
+	{
+		debug_printf(0, "section headers of `%s' are not within the file\n", meta->filename);
+		goto out;
+	}
 	meta->shdrs = get_or_map_file_range(meta, shdrs_sz, fd, meta->ehdr->e_shoff);
 	if (meta->shdrs)
 	{
@@ -418,37 +1492,18 @@ struct file_metadata *__runt_files_notify_load(void *handle, const void *load_si
 			}
 #undef GET_OR_MAP_SCN
 		}
-		/* Now we have shstrtab if there is one. Re-scan for any section we can
-		 * only recognise by name. */
-		if (meta->shstrtab)
-		{
-			for (unsigned i = 0; i < meta->ehdr->e_shnum; ++i)
-			{
-				if (meta->shdrs[i].sh_type == SHT_NOTE &&
-					0 == strcmp(".note.gnu.build-id", (char*) &meta->shstrtab[meta->shdrs[i].sh_name]))
-				{
-					/* The build ID section begins with 16 bytes of identifier. HACK: just skip
-					 * these. We should check they match the GNU marker. FIXME. */
-					if (meta->shdrs[i].sh_size < 16 + sizeof meta->build_id)
-					{
-						debug_printf(0, "Ignoring .note.gnu.build-id in '%s' that is less than the expected size (16 + %d bytes)\n",
-							l->l_name, (int) sizeof meta->build_id);
-						break;
-					}
-					ssize_t ret = pread(fd, meta->build_id, sizeof meta->build_id, meta->shdrs[i].sh_offset + 16);
-					if (ret != sizeof meta->build_id)
-					{
-						bzero(meta->build_id, sizeof meta->build_id);
-						debug_printf(1, "Failed to read .note.gnu.build-id from '%s'\n", l->l_name);
-					}
-				}
-			}
-		}
-		else
+		/* Only objects without a PT_NOTE need us to look for note sections. */
+		struct file_note_cursor cursor = { 0 };
+		struct elf_note n;
+		_Bool have_notes = __runt_files_next_note(meta, &cursor, &n);
+		for (unsigned i = 0; !have_notes && i < meta->ehdr->e_shnum; ++i)
 		{
-			debug_printf(1,
-				"Warning: no shstrtab in '%s' so we cannot scan for named sections (e.g. .note.gnu.build-id)\n",
-				l->l_name);
+			ElfW(Shdr) *shdr = &meta->shdrs[i];
+			if (shdr->sh_type != SHT_NOTE) continue;
+			const char *pos = get_or_map_file_range(meta, shdr->sh_size, fd, shdr->sh_offset);
+			if (!pos) continue;
+			const char *end = pos + shdr->sh_size;
+			while (elf_note_next(&pos, end, shdr->sh_addralign, &n)) notice_note(meta, &n);
 		}
 
 		/* Now define sections for all the allocated sections in the shdrs
@@ -464,24 +1519,35 @@ struct file_metadata *__runt_files_notify_load(void *handle, const void *load_si
 		// FIXME: the starts bitmaps need to be attached either to sections or
 		// to segments (if we don't have section headers). That's a bit nasty.
 		// It probably still works though.
-	out:
-		if (fd >= 0) close(fd);
+		/* Now we know the symbol tables, we can index them. */
+		__runt_segments_notify_symbols_ready(meta);
 	}
-	return meta;
+out:
+	if (fd >= 0) close(fd);
 }
 void __runt_deinit_file_metadata(void *fm) __attribute__((visibility("protected")));
 void __runt_deinit_file_metadata(void *fm)
 {
 	struct file_metadata *meta = (struct file_metadata *) fm;
 	__private_free((void*) meta->filename);
-	for (unsigned i = 0; i < MAPPING_MAX; ++i)
+	if (meta->symbols_index_mapping)
 	{
-		if (meta->extra_mappings[i].mapping_pagealigned)
+		/* The metavectors etc. all point into here. */
+		if (meta->symbols_index_mapping_size)
 		{
-			munmap(meta->extra_mappings[i].mapping_pagealigned,
-				meta->extra_mappings[i].size);
+			munmap(meta->symbols_index_mapping, meta->symbols_index_mapping_size);
 		}
 	}
+	else for (unsigned i = 0; i < meta->nload; ++i)
+	{
+		__private_free(meta->segments[i].metavector);
+		__private_free(meta->segments[i].metavector_search_keys);
+		__private_free(meta->segments[i].starts_bitmap);
+	}
+	__private_free(meta->symtab_name_index);
+	__runt_sections_free_index(meta);
+	__private_free(meta->sections);
+	unmap_extra_mappings(meta);
 }
 
 static int discover_segments_cb(struct dl_phdr_info *info, size_t size, void *segments_as_void)
@@ -528,14 +1594,29 @@ void __runt_files_notify_unload(const char *copied_filename)
 	if (initialized)
 	{
 		assert(copied_filename);
-		for (struct lm_pair *p = &lm_pairs[0]; p < &lm_pairs[npairs]; ++p)
+		/* Our filenames are realpath'd (see notify_load), but the caller's
+		 * comes from the link map and may not be, e.g. /lib/... where
+		 * /lib is a symlink. Resolve it before taking the lock, and into
+		 * our own buffer, not the static one behind realpath_quick. */
+		char real_buf[PATH_MAX];
+		const char *real_filename = (copied_filename[0]
+			&& realpath(copied_filename, real_buf)) ? real_buf : copied_filename;
+		BIG_LOCK
+		/* Each deletion publishes a new table, so rescan from the start
+		 * after each one. Holding the lock keeps the current table alive. */
+	rescan: ;
+		struct file_table *t = __atomic_load_n(&file_table, __ATOMIC_RELAXED);
+		for (unsigned i = 0; t && i < t->npairs; ++i)
 		{
-			if (!(p->lm)) break;
-			if (0 == strcmp(p->fm->filename, copied_filename))
+			if (0 == strcmp(t->pairs[i].fm->filename, copied_filename)
+					|| 0 == strcmp(t->pairs[i].fm->filename, real_filename))
 			{
-				__delete_file_metadata(&p->fm);
+				__delete_file_metadata(&t->pairs[i].fm);
+				goto rescan;
 			}
 		}
+		BIG_UNLOCK
+		__runt_symbols_notify_unload();
 	}
 }
 
@@ -551,16 +1632,14 @@ __runt_find_section_boundary(
 	 * we want to find some section's {base,end} address
 	 * that is {geq, leq} the search address
 	 * and where that section has all the flags in "flags".
-	 * We do this with a linear pass over the section headers.
-	 * We cannot assume that they are sorted by address, since
-	 * the ELF spec does not require that (as far as I can see).
-	 * It doesn't seem worth caching a sorted representation of
-	 * the section headers. */
+	 * We cannot assume that the section headers are sorted by
+	 * address, since the ELF spec does not require that (as far as
+	 * I can see). With -ffunction-sections there are thousands of
+	 * them, so sections.c keeps a sorted copy, built on first use. */
 	struct file_metadata *fm = __wrap___runt_files_metadata_by_addr(search_addr);
 	if (!fm) return backwards ? NULL : (void*)-1;
 	uintptr_t vaddr = (uintptr_t) search_addr - fm->l->l_addr;
-	uintptr_t ret = find_section_boundary(vaddr, flags, backwards, fm->shdrs, fm->ehdr->e_shnum,
-		out_shndx);
+	uintptr_t ret = __runt_sections_find_boundary(fm, vaddr, flags, backwards, out_shndx);
 	if (!ret || ret == (uintptr_t)-1) return (void*) ret;
 	if (out_fm) *out_fm = fm;
 	return (const void*) (fm->l->l_addr + ret);
@@ -157,7 +157,8 @@ int dl_for_one_object_phdrs(void *handle,
 #ifndef MAX_EARLY_LIBS
 #define MAX_EARLY_LIBS 16
 #endif
-struct link_map *early_lib_handles[MAX_EARLY_LIBS] __attribute__((visibility("hidden")));
+static struct link_map *early_lib_handles_buf[MAX_EARLY_LIBS + 1];
+struct link_map **early_lib_handles __attribute__((visibility("hidden"))) = early_lib_handles_buf;
 void init_early_libs(void) __attribute__((visibility("hidden")));
 void init_early_libs(void)
 {
@@ -170,12 +171,20 @@ void init_early_libs(void)
 	 * by  don't
 	 * want todouble-process any files that were already notified
 	 * (below) because they were opened with our dlopen wrapper. */
+	unsigned n = 0;
+	for (struct link_map *l = find_r_debug()->r_map; l; l = l->l_next) ++n;
+	/* Usually the static buffer is enough, but we support any number. */
+	if (n > MAX_EARLY_LIBS)
+	{
+		early_lib_handles = __private_malloc((n + 1) * sizeof (struct link_map *));
+		if (!early_lib_handles) abort();
+	}
 	unsigned idx = 0;
-	for (struct link_map *l = find_r_debug()->r_map; l; l = l->l_next)
+	for (struct link_map *l = find_r_debug()->r_map; l && idx < n; l = l->l_next)
 	{
-		if (idx == MAX_EARLY_LIBS) abort();
 		early_lib_handles[idx++] = l;
 	}
+	early_lib_handles[idx] = NULL;
 	/* This is snapshotting exactly those libs that are active
 	 * when we first trap dlopen. Is that set identical to the
 	 * ones we need to snapshot for "early /proc/pid/maps" purposes?
@@ -201,12 +210,17 @@ void __librunt_main_init(void)
 }
 
 // FIXME: do better!
+char *realpath_quick_r(const char *arg, char *buf) __attribute__((visibility("hidden")));
 char *realpath_quick(const char *arg) __attribute__((visibility("hidden")));
 char *realpath_quick(const char *arg)
 {
 	static char buf[4096];
+	return realpath_quick_r(arg, buf);
+}
+char *realpath_quick_r(const char *arg, char *buf)
+{
 	errno = 0; // FIXME: why do we do this? Can we not just leave errno be?
-	char *ret = realpath(arg, &buf[0]);
+	char *ret = realpath(arg, buf);
 	if (errno && !ret) { errno = 0; return NULL; }
 	if (errno)
 	{
@@ -223,6 +237,14 @@ char *realpath_quick(const char *arg)
 
 const char *dynobj_name_from_dlpi_name(const char *dlpi_name, void *dlpi_addr) __attribute__((visibility("protected")));
 const char *dynobj_name_from_dlpi_name(const char *dlpi_name, void *dlpi_addr)
+{
+	static char buf[4096];
+	return dynobj_name_from_dlpi_name_r(dlpi_name, dlpi_addr, buf);
+}
+/* The result is either in buf, or is something that doesn't change once
+ * computed (a string constant, dlpi_name itself or the executable's name,
+ * once get_exe_dynobj_fullname has been called). */
+const char *dynobj_name_from_dlpi_name_r(const char *dlpi_name, void *dlpi_addr, char *buf)
 {
 	if (strlen(dlpi_name) == 0)
 	{
@@ -263,7 +285,7 @@ const char *dynobj_name_from_dlpi_name(const char *dlpi_name, void *dlpi_addr)
 	else
 	{
 		// we need to realpath() it
-		const char *maybe_real = realpath_quick(dlpi_name);
+		const char *maybe_real = realpath_quick_r(dlpi_name, buf);
 		if (maybe_real) return maybe_real;
 		/* If realpath said nothing, it's a bogus non-empty filename. 
 		 * Return the filename directly. */
@@ -2,6 +2,7 @@
 #define LIBRUNT_PRIVATE_H_
 
 #include <stdio.h>
+#include <sched.h>
 #include "librunt.h"
 #include "vas.h"
 
@@ -22,6 +23,10 @@ char *get_exe_command_fullname(void) __attribute__((visibility("hidden")));
 char *get_exe_command_basename(void) __attribute__((visibility("hidden")));
 
 char *realpath_quick(const char *arg) __attribute__((visibility("hidden")));
+char *realpath_quick_r(const char *arg, char *buf /* [PATH_MAX] */) __attribute__((visibility("hidden")));
+/* Like dynobj_name_from_dlpi_name, but reentrant: any buffer is the caller's. */
+const char *dynobj_name_from_dlpi_name_r(const char *dlpi_name, void *dlpi_addr,
+	char *buf /* [PATH_MAX] */) __attribute__((visibility("hidden")));
 
 void init_early_libs(void) __attribute__((visibility("hidden")));
 
@@ -33,12 +38,78 @@ extern FILE *stream_err;
     } \
   } while (0)
 
+/* For batch lookups: sort addresses, remembering where each came from. */
+struct addr_and_idx
+{
+	uintptr_t addr;
+	size_t idx;
+};
+void __runt_sort_addrs_and_idxs(struct addr_and_idx *a, size_t n) __attribute__((visibility("hidden")));
+
+/* Per-file things we build on first use (indexes, deferred mappings)
+ * each have an unsigned state word, initially zero. The first thread to
+ * claim it builds; others wait for it. A build may also give up (say, if
+ * what it needs isn't there yet), in which case the next claimant tries.
+ * A thread that is building must not claim the same word again, since it
+ * would wait for itself, so anything that may be called back while
+ * building keeps a thread-local flag and falls back instead. */
+enum { RUNT_ONCE_NOT_DONE = 0, RUNT_ONCE_DOING, RUNT_ONCE_DONE };
+static inline _Bool __runt_once_done(unsigned *state)
+{
+	return __atomic_load_n(state, __ATOMIC_ACQUIRE) == RUNT_ONCE_DONE;
+}
+/* Returns false if it got done while we waited. */
+static inline _Bool __runt_once_claim(unsigned *state)
+{
+	for (;;)
+	{
+		unsigned expected = RUNT_ONCE_NOT_DONE;
+		if (__atomic_compare_exchange_n(state, &expected, RUNT_ONCE_DOING,
+				0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) return 1;
+		if (expected == RUNT_ONCE_DONE) return 0;
+		sched_yield();
+	}
+}
+static inline void __runt_once_finish(unsigned *state, _Bool done)
+{
+	__atomic_store_n(state, done ? RUNT_ONCE_DONE : RUNT_ONCE_NOT_DONE, __ATOMIC_RELEASE);
+}
+/* The same word makes a lock, for short sections that mustn't malloc. */
+static inline void __runt_spin_lock(unsigned *lock)
+{
+	while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE)) sched_yield();
+}
+static inline void __runt_spin_unlock(unsigned *lock)
+{
+	__atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
 void *__private_malloc(size_t sz);
 void __private_free(void *ptr);
 char *__private_strdup(const char *s);
 
+/* Bumped whenever a file is added to or removed from the file table, so
+ * that caches of anything derived from it can tell when they are stale.
+ * Never zero. */
+extern unsigned long __runt_files_generation __attribute__((visibility("hidden")));
+
+/* Keep the global symbol name index (see symbols.c) in sync with the link
+ * map. Build it once the startup objects are loaded, then call the notify
+ * functions after any load and unload. Withdraw it before anything that
+ * might unmap an object (see dso-meta.h), and notify afterwards. */
+void __runt_symbols_build_name_index(void) __attribute__((visibility("hidden")));
+void __runt_symbols_notify_load(void) __attribute__((visibility("hidden")));
+
+/* Sorted section boundaries (see sections.c), built on first use. */
+struct file_metadata;
+uintptr_t __runt_sections_find_boundary(struct file_metadata *fm, uintptr_t vaddr,
+	ElfW(Word) flags, _Bool backwards, unsigned *out_shndx) __attribute__((visibility("hidden")));
+void __runt_sections_free_index(struct file_metadata *fm) __attribute__((visibility("hidden")));
+
+/* Null-terminated. Up to MAX_EARLY_LIBS fit in a static buffer; beyond
+ * that we allocate. */
 #define MAX_EARLY_LIBS 128
-extern struct link_map *early_lib_handles[MAX_EARLY_LIBS] __attribute((visibility("hidden")));
+extern struct link_map **early_lib_handles __attribute((visibility("hidden")));
 
 /* Convenience for code that does raw mmap. */
 #ifndef MMAP_RETURN_IS_ERROR
@@ -14,6 +14,7 @@
 #include <stdint.h>
 #include <string.h>
 #include <errno.h>
+#include <sys/mman.h>
 #include "librunt_private.h"
 /* We don't have raw_write, so... HACK. */
 #ifndef RAW_SYSCALL_DEFS_H_
@@ -49,7 +50,7 @@ void *dlopen(const char *filename, int flag)
 	
 	if (!orig_dlopen) // happens if we're called before liballocs init
 	{
-		orig_dlopen = fake_dlsym(RTLD_NEXT, "dlopen");
+		orig_dlopen = FAKE_DLSYM(RTLD_NEXT, "dlopen");
 		if (!orig_dlopen) abort();
 	}
 	/* We ensure that all files loaded by the first dlopen
@@ -173,25 +174,32 @@ int dlclose(void *handle)
 		char *copied_filename = strdup(((struct link_map *) handle)->l_name);
 		assert(copied_filename != NULL);
 		
+		/* The symbol name index points into objects' symbol tables, and
+		 * dlclose may unmap the object and any of its dependencies. So
+		 * withdraw the index until we know what went. */
+		__runt_symbols_withdraw_name_index();
 		int ret = orig_dlclose(handle);
 		/* NOTE that a successful dlclose doesn't necessarily unload 
 		 * the library! To see whether it's really unloaded, we use 
 		 * dlopen *again* with RTLD_NOLOAD. FIXME: probably better
 		 * to use raw link map traversal somehow to test this. */
+		_Bool unloaded = 0;
 		if (ret == 0)
 		{
 			// was it really unloaded?
 			void *h = orig_dlopen(copied_filename, RTLD_LAZY | RTLD_NOLOAD);
 			if (h == NULL)
 			{
-				// yes, it was unloaded
+				// yes, it was unloaded; this rebuilds the name index too
 				__runt_files_notify_unload(copied_filename);
+				unloaded = 1;
 			}
 			else 
 			{
 				// it wasn't unloaded, so we do nothing
 			}
 		}
+		if (!unloaded) __runt_symbols_notify_unload();
 	
 	// out:
 		free(copied_filename);
@@ -211,7 +219,7 @@ static char *call_orig_dlerror(void)
 	{
 		char *saved_msg = our_dlerror;
 		// always use the fake dlsym, so we don't clobber the real dlerror
-		orig_dlerror = fake_dlsym(RTLD_NEXT, "dlerror");
+		orig_dlerror = FAKE_DLSYM(RTLD_NEXT, "dlerror");
 		if (!orig_dlerror) abort();
 		our_dlerror = saved_msg;
 	}
@@ -245,7 +253,7 @@ void *dlsym(void *handle, const char *symbol)
 	
 	if (!orig_dlsym)
 	{
-		orig_dlsym = fake_dlsym(RTLD_NEXT, "dlsym");
+		orig_dlsym = FAKE_DLSYM(RTLD_NEXT, "dlsym");
 		if (orig_dlsym == (void*) -1)
 		{
 			our_dlerror = "symbol not found";
@@ -273,6 +281,41 @@ void *__runt_fake_dlsym(void *handle, const char *symbol)
 	}
 	return ret;
 }
+/* Batch version: out[i] gets what __runt_fake_dlsym(handle, names[i])
+ * would return, but we visit each object only once, rather than once per
+ * name. Neither this nor the name index's lookups malloc, so this is
+ * usable early (e.g. from a malloc interposer's startup). Each name needs
+ * a query while we walk, so we keep a few on the stack and map memory
+ * for more. */
+#define FAKE_DLSYMS_ON_STACK 32
+void __runt_fake_dlsyms(void *handle, const char **names, size_t n, void **out)
+{
+	struct fake_dlsym_query stack_qs[FAKE_DLSYMS_ON_STACK];
+	struct fake_dlsym_query *qs = stack_qs;
+	size_t mapping_size = 0;
+	if (n > FAKE_DLSYMS_ON_STACK)
+	{
+		mapping_size = ROUND_UP(n * sizeof (struct fake_dlsym_query), MIN_PAGE_SIZE);
+		qs = mmap(NULL, mapping_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if (qs == MAP_FAILED)
+		{
+			for (size_t i = 0; i < n; ++i) out[i] = __runt_fake_dlsym(handle, names[i]);
+			return;
+		}
+	}
+	for (size_t i = 0; i < n; ++i) qs[i].name = names[i];
+	fake_dlsyms(handle, qs, n);
+	for (size_t i = 0; i < n; ++i)
+	{
+		out[i] = qs[i].addr;
+		if (out[i] == (void*) -1)
+		{
+			our_dlerror = "fake dlsym failed";
+			out[i] = NULL;
+		}
+	}
+	if (mapping_size) munmap(qs, mapping_size);
+}
 
 int dladdr(const void *addr, Dl_info *info)
 {
@@ -365,7 +408,7 @@ int dl_iterate_phdr(
 		// write_string("Blah11\n");
 		/* Needs to be fake, because if liballocs gets init'd in the middle of a malloc,
 		 * the real dlsym would try to reentrantly malloc. */
-		orig_dl_iterate_phdr = fake_dlsym(RTLD_NEXT, "dl_iterate_phdr");
+		orig_dl_iterate_phdr = FAKE_DLSYM(RTLD_NEXT, "dl_iterate_phdr");
 		if (orig_dl_iterate_phdr == (void*) -1)
 		{
 			our_dlerror = "symbol not found";
@@ -10,6 +10,7 @@
 #include <string.h>
 #include <dlfcn.h>
 #include <limits.h>
+#include <sched.h>
 #include <link.h>
 #include "relf.h"
 #include "librunt_private.h"
@@ -24,11 +25,15 @@ void __runt_sections_init(void)
 	/* Sections are created by the static file allocator,
 	 * so there is nothing to do.  */
 }
-struct section_metadata
-{
-	const ElfW(Shdr) *shdr; /* should *not* be null; we don't create dummy sections */
-};
 
+/* Which sections go in the file's section table? Those that occupy
+ * address space in the image. .tbss is allocated but overlaps whatever
+ * follows it, since it only describes the per-thread copies. */
+static _Bool section_is_tabled(const ElfW(Shdr) *shdr)
+{
+	return (shdr->sh_flags & SHF_ALLOC) && shdr->sh_size > 0
+		&& !((shdr->sh_flags & SHF_TLS) && shdr->sh_type == SHT_NOBITS);
+}
 void __runt_sections_notify_define_section(
 	struct file_metadata *meta,
 	const ElfW(Shdr) *shdr
@@ -38,6 +43,208 @@ void __runt_sections_notify_define_section(
 	{
 		debug_printf(3, "notified of section at %p within %s\n",
 			(void*) (meta->l->l_addr + shdr->sh_addr),
-			dynobj_name_from_dlpi_name(meta->l->l_name, (void*) meta->l->l_addr));
+			meta->filename);
+	}
+	if (!section_is_tabled(shdr)) return;
+	if (!meta->sections)
+	{
+		/* Size the table exactly, on the first section we hear about. */
+		unsigned n = 0;
+		for (unsigned i = 0; i < meta->ehdr->e_shnum; ++i) n += section_is_tabled(&meta->shdrs[i]);
+		meta->sections = __private_malloc(n * sizeof (struct section_metadata));
+		if (!meta->sections) abort();
+	}
+	struct section_metadata s = {
+		.start = shdr->sh_addr,
+		.end = shdr->sh_addr + shdr->sh_size,
+		.flags = shdr->sh_flags,
+		.type = shdr->sh_type,
+		.shndx = shdr - meta->shdrs
+	};
+	/* Section headers are almost always in address order already, so
+	 * insertion keeps the table sorted at little cost. */
+	unsigned pos = meta->nsections;
+	while (pos > 0 && meta->sections[pos - 1].start > s.start)
+	{
+		meta->sections[pos] = meta->sections[pos - 1];
+		--pos;
+	}
+	meta->sections[pos] = s;
+	++meta->nsections;
+}
+
+#define proj_start(p) (p)->start
+const struct section_metadata *__runt_sections_lookup_by_vaddr(
+	struct file_metadata *meta,
+	uintptr_t vaddr
+)
+{
+	__runt_files_ensure_shdrs_mapped(meta);
+	if (!meta->nsections) return NULL;
+	struct section_metadata *found = bsearch_leq_generic(struct section_metadata, vaddr,
+		meta->sections, meta->nsections, proj_start);
+	return (found && vaddr < found->end) ? found : NULL;
+}
+#undef proj_start
+struct file_metadata *__wrap___runt_files_metadata_by_addr(void *addr);
+const struct section_metadata *__runt_sections_lookup_by_addr(
+	const void *addr,
+	struct file_metadata **out_fm
+)
+{
+	struct file_metadata *fm = __wrap___runt_files_metadata_by_addr((void*) addr);
+	if (!fm) return NULL;
+	const struct section_metadata *found = __runt_sections_lookup_by_vaddr(fm,
+		(uintptr_t) addr - fm->l->l_addr);
+	if (found && out_fm) *out_fm = fm;
+	return found;
+}
+
+/* Section boundary queries (see __runt_find_section_boundary) used to scan
+ * all the section headers, but -ffunction-sections objects have thousands
+ * of sections. So on first use we sort each file's section starts and ends
+ * by address. Queries name a flags mask, and sections qualify if they have
+ * any of its flags; for each mask we see, we keep a filtered copy of the
+ * sorted arrays, so that a query is just a binary search. Filters are only
+ * ever added, at the head of a list, so readers need no lock. */
+struct section_boundaries
+{
+	struct section_boundaries *next;
+	ElfW(Word) flags;
+	unsigned n;
+	struct addr_and_idx *starts; /* sorted by sh_addr */
+	struct addr_and_idx *ends;   /* sorted by sh_addr + sh_size */
+};
+struct section_index
+{
+	struct section_boundaries all; /* every section, unfiltered */
+	struct section_boundaries *filters;
+};
+static __thread _Bool building_section_index_here __attribute__((tls_model("initial-exec")));
+
+static struct section_index *build_section_index(ElfW(Shdr) *shdrs, unsigned nshdr)
+{
+	struct section_index *idx = __private_malloc(sizeof (struct section_index)
+		+ 2 * (size_t) nshdr * sizeof (struct addr_and_idx));
+	if (!idx) abort();
+	idx->all = (struct section_boundaries) {
+		.n = nshdr,
+		.starts = (struct addr_and_idx *) (idx + 1)
+	};
+	idx->all.ends = idx->all.starts + nshdr;
+	idx->filters = NULL;
+	for (unsigned i = 0; i < nshdr; ++i)
+	{
+		idx->all.starts[i] = (struct addr_and_idx) { shdrs[i].sh_addr, i };
+		idx->all.ends[i] = (struct addr_and_idx) { shdrs[i].sh_addr + shdrs[i].sh_size, i };
+	}
+	__runt_sort_addrs_and_idxs(idx->all.starts, nshdr);
+	__runt_sort_addrs_and_idxs(idx->all.ends, nshdr);
+	return idx;
+}
+static struct section_index *ensure_section_index(struct file_metadata *fm)
+{
+	if (__builtin_expect(__runt_once_done(&fm->section_index_state), 1)) return fm->section_index;
+	/* As in segments.c, a reentrant caller just falls back. */
+	if (building_section_index_here) return NULL;
+	if (!__runt_once_claim(&fm->section_index_state)) return fm->section_index;
+	building_section_index_here = 1;
+	if (fm->shdrs) fm->section_index = build_section_index(fm->shdrs, fm->ehdr->e_shnum);
+	building_section_index_here = 0;
+	/* Without shdrs (say, we were called back while mapping them),
+	 * leave it for a later query to build. */
+	__runt_once_finish(&fm->section_index_state, fm->section_index != NULL);
+	return fm->section_index;
+}
+static struct section_boundaries *section_boundaries_for_flags(struct section_index *idx,
+	ElfW(Shdr) *shdrs, ElfW(Word) flags)
+{
+	for (struct section_boundaries *f = __atomic_load_n(&idx->filters, __ATOMIC_ACQUIRE);
+			f; f = f->next)
+	{
+		if (f->flags == flags) return f;
+	}
+	/* Filtering the sorted arrays keeps them sorted. */
+	unsigned n = 0;
+	for (unsigned i = 0; i < idx->all.n; ++i) n += !!(shdrs[i].sh_flags & flags);
+	struct section_boundaries *f = __private_malloc(sizeof (struct section_boundaries)
+		+ 2 * (size_t) n * sizeof (struct addr_and_idx));
+	if (!f) return NULL;
+	*f = (struct section_boundaries) {
+		.flags = flags,
+		.n = n,
+		.starts = (struct addr_and_idx *) (f + 1)
+	};
+	f->ends = f->starts + n;
+	unsigned nstarts = 0, nends = 0;
+	for (unsigned i = 0; i < idx->all.n; ++i)
+	{
+		if (shdrs[idx->all.starts[i].idx].sh_flags & flags) f->starts[nstarts++] = idx->all.starts[i];
+		if (shdrs[idx->all.ends[i].idx].sh_flags & flags) f->ends[nends++] = idx->all.ends[i];
+	}
+	/* If we race with another thread adding the same mask, both copies
+	 * go on the list, which is harmless. */
+	f->next = __atomic_load_n(&idx->filters, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&idx->filters, &f->next, f,
+			1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	return f;
+}
+void __runt_sections_free_index(struct file_metadata *fm)
+{
+	struct section_index *idx = fm->section_index;
+	if (!idx) return;
+	for (struct section_boundaries *f = idx->filters; f; )
+	{
+		struct section_boundaries *next = f->next;
+		__private_free(f);
+		f = next;
+	}
+	__private_free(idx);
+}
+
+#define proj_addr(p) (p)->addr
+/* Like relf.h's find_section_boundary, but in O(log n), and with the same
+ * answer: of several sections sharing the nearest boundary, the one that
+ * comes first in the section header table. */
+uintptr_t __runt_sections_find_boundary(struct file_metadata *fm, uintptr_t vaddr,
+	ElfW(Word) flags, _Bool backwards, unsigned *out_shndx)
+{
+	__runt_files_ensure_shdrs_mapped(fm);
+	struct section_index *idx = ensure_section_index(fm);
+	struct section_boundaries *f = idx ? section_boundaries_for_flags(idx, fm->shdrs, flags) : NULL;
+	if (!f)
+	{
+		if (!fm->shdrs) return backwards ? 0 : (uintptr_t) -1;
+		return find_section_boundary(vaddr, flags, backwards, fm->shdrs, fm->ehdr->e_shnum,
+			out_shndx);
+	}
+	if (f->n == 0) return backwards ? 0 : (uintptr_t) -1;
+	struct addr_and_idx *found;
+	if (backwards)
+	{
+		/* The last end <= vaddr... */
+		found = bsearch_leq_generic(struct addr_and_idx, vaddr, f->ends, f->n, proj_addr);
+		if (!found) return 0;
+		/* ... or, if several sections end there, the first of them. */
+		for (struct addr_and_idx *p = found; p > f->ends && (p-1)->addr == found->addr; --p)
+		{
+			if ((p-1)->idx < found->idx) found = p-1;
+		}
+	}
+	else
+	{
+		/* The first start >= vaddr is the one after the last start < vaddr... */
+		struct addr_and_idx *below = bsearch_leq_generic_w_op(struct addr_and_idx, vaddr,
+			f->starts, f->n, proj_addr, <);
+		found = below ? below + 1 : f->starts;
+		if (found == f->starts + f->n) return (uintptr_t) -1;
+		/* ... or, if several sections start there, the first of them. */
+		for (struct addr_and_idx *p = found + 1; p < f->starts + f->n && p->addr == found->addr; ++p)
+		{
+			if (p->idx < found->idx) found = p;
+		}
 	}
+	if (out_shndx) *out_shndx = found->idx;
+	return found->addr;
 }
+#undef proj_addr
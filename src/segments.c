@@ -11,8 +11,14 @@
 #include <dlfcn.h>
 #include <limits.h>
 #include <link.h>
+#include <sched.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "relf.h"
 #include "dso-meta.h"
+#include "eytzinger.h"
 #include "librunt_private.h"
 
 /* static */ _Bool __runt_segments_trying_to_initialize __attribute__((visibility("hidden")));
@@ -52,7 +58,7 @@ void __runt_segments_notify_define_segment(
 	ElfW(Phdr) *phdr = &file->phdrs[phndx];
 	const void *segment_start_addr = (char*) file->l->l_addr + phdr->p_vaddr;
 	debug_printf(2, "notified of segment at %p within %s\n", segment_start_addr,
-		dynobj_name_from_dlpi_name(file->l->l_name, (void*) file->l->l_addr));
+		file->filename);
 	/* Fill in the per-segment info that is stored in the file metadata.
 	 * We just fill in a metadataless dummy version; liballocs will do more. */
 	file->segments[loadndx] = (struct segment_metadata) {
@@ -60,6 +66,795 @@ void __runt_segments_notify_define_segment(
 		.metavector = NULL,
 		.metavector_size = 0
 	};
+	/* The metavector is filled in later; see notify_symbols_ready. */
+}
+
+/* Once the file's symbol tables are known, build each LOAD segment's
+ * metavector. This can't happen at segment definition time, because we
+ * don't have dynsym or symtab yet. We index only "spans", i.e. symbols
+ * with a nonzero size and a real address, so not TLS, undefined or absolute
+ * symbols. Where spans overlap, each address goes to the first span
+ * containing it in the order (start address, dynsym-before-symtab, table
+ * index). So a later span nested within earlier ones is discarded, and one
+ * that extends past them is kept with its recorded start clipped to where
+ * they end; its symbol still gives the true start and size. The result is
+ * non-overlapping, so a lookup is one search for the greatest start <= the
+ * address. Any address within some symbol finds one containing it, though
+ * not always the one a linear search of dynsym then symtab would pick. */
+static int compare_metavector_recs(const void *v1, const void *v2)
+{
+	const union sym_or_reloc_rec *r1 = v1;
+	const union sym_or_reloc_rec *r2 = v2;
+	if (r1->sym.vaddr_off != r2->sym.vaddr_off) return (r1->sym.vaddr_off < r2->sym.vaddr_off) ? -1 : 1;
+	if (r1->sym.kind != r2->sym.kind) return (r1->sym.kind < r2->sym.kind) ? -1 : 1;
+	return (r1->sym.idx == r2->sym.idx) ? 0 : (r1->sym.idx < r2->sym.idx) ? -1 : 1;
+}
+static _Bool is_indexable_span(const ElfW(Sym) *sym)
+{
+	return sym->st_size > 0
+		&& ELFW_ST_TYPE(sym->st_info) != STT_TLS
+		&& sym->st_shndx != SHN_UNDEF
+		&& sym->st_shndx != SHN_ABS;
+}
+/* Which of the file's LOAD segments does this span start in? */
+static int loadndx_for_vaddr(struct file_metadata *file, ElfW(Addr) vaddr)
+{
+	for (unsigned i = 0; i < file->nload; ++i)
+	{
+		ElfW(Phdr) *phdr = &file->phdrs[file->segments[i].phdr_idx];
+		if (vaddr >= phdr->p_vaddr && vaddr - phdr->p_vaddr < phdr->p_memsz) return i;
+	}
+	return -1;
+}
+ElfW(Sym) *__runt_segments_metavector_rec_sym(
+	struct file_metadata *file,
+	union sym_or_reloc_rec *rec,
+	unsigned char **out_strtab
+)
+{
+	switch (rec->sym.kind)
+	{
+		case REC_DYNSYM:
+			if (out_strtab) *out_strtab = file->dynstr;
+			return &file->dynsym[rec->sym.idx];
+		case REC_SYMTAB:
+			if (out_strtab) *out_strtab = file->strtab;
+			return &file->symtab[rec->sym.idx];
+		default:
+			return NULL;
+	}
+}
+/* Starts bitmaps let us find the span for an address without searching:
+ * the number of set bits at or below the address's bit (one rank query)
+ * identifies the last span starting at or before it. They cost a bit per
+ * word of the segment, plus half that again for the rank structure, so
+ * we don't build them for very large segments; those just get searched. */
+#ifndef STARTS_BITMAP_MAX_SEGMENT_SIZE
+#define STARTS_BITMAP_MAX_SEGMENT_SIZE (64ul<<20)
+#endif
+static void build_starts_bitmap(struct file_metadata *file, unsigned loadndx,
+	union sym_or_reloc_rec *metavector, size_t n)
+{
+	struct segment_metadata *seg = &file->segments[loadndx];
+	ElfW(Phdr) *phdr = &file->phdrs[seg->phdr_idx];
+	if (n == 0 || phdr->p_memsz > STARTS_BITMAP_MAX_SEGMENT_SIZE) return;
+	size_t nbits = STARTS_BITMAP_NWORDS_FOR_PHDR(phdr);
+	size_t nwords = (nbits + BITMAP_WORD_NBITS - 1) / BITMAP_WORD_NBITS;
+	/* The vaddr_off in our records is relative to p_vaddr, but bits are
+	 * relative to p_vaddr rounded down to a word. */
+	uintptr_t misalign = phdr->p_vaddr % sizeof (void*);
+	/* One allocation: bitmap, then rank per bitmap word, then first-record
+	 * per set bit (of which there are at most n). */
+	bitmap_word_t *bitmap = __private_malloc(nwords * sizeof (bitmap_word_t)
+		+ nwords * sizeof (unsigned) + n * sizeof (unsigned));
+	if (!bitmap) abort();
+	bzero(bitmap, nwords * sizeof (bitmap_word_t));
+	unsigned *rank = (unsigned *) (bitmap + nwords);
+	unsigned *first_rec = rank + nwords;
+	unsigned nset = 0;
+	for (size_t j = 0; j < n; ++j)
+	{
+		size_t bit = (misalign + metavector[j].sym.vaddr_off) / sizeof (void*);
+		if (bitmap_get_l(bitmap, bit)) continue; /* shares a word with the previous span */
+		bitmap_set_l(bitmap, bit);
+		first_rec[nset++] = j;
+	}
+	unsigned total = 0;
+	for (size_t w = 0; w < nwords; ++w)
+	{
+		rank[w] = total;
+		total += popcount_word(bitmap[w]);
+	}
+	assert(total == nset);
+	seg->starts_bitmap_nbits = nbits;
+	seg->starts_rank = rank;
+	seg->starts_first_rec = first_rec;
+	/* As with the metavector, publish this last. */
+	__atomic_store_n(&seg->starts_bitmap, bitmap, __ATOMIC_RELEASE);
+}
+/* Using the starts bitmap, find the index of the last span starting at or
+ * before the segment-relative offset off, or -1 if there is none. */
+static long starts_bitmap_lookup(struct segment_metadata *seg, bitmap_word_t *bitmap,
+	ElfW(Phdr) *phdr, union sym_or_reloc_rec *metavector, uintptr_t off)
+{
+	size_t bit = ((phdr->p_vaddr % sizeof (void*)) + off) / sizeof (void*);
+	if (bit >= seg->starts_bitmap_nbits) bit = seg->starts_bitmap_nbits - 1;
+	size_t w = bit / BITMAP_WORD_NBITS;
+	/* Count the set bits at or below ours. (2ul << 63) - 1 is all ones. */
+	bitmap_word_t mask = (2ul << (bit % BITMAP_WORD_NBITS)) - 1;
+	unsigned nset = seg->starts_rank[w] + popcount_word(bitmap[w] & mask);
+	if (nset == 0) return -1;
+	long idx = seg->starts_first_rec[nset - 1];
+	/* Several spans may start in the same word, and the first may start
+	 * after off, in which case we want the last span of an earlier word. */
+	while ((size_t) idx + 1 < seg->metavector_size && metavector[idx + 1].sym.vaddr_off <= off) ++idx;
+	if (metavector[idx].sym.vaddr_off > off) --idx;
+	return idx;
+}
+
+static unsigned nsyms_in_section(struct file_metadata *file, ElfW(Half) ndx)
+{
+	return ndx ? file->shdrs[ndx].sh_size / file->shdrs[ndx].sh_entsize : 0;
+}
+static void build_symbols_index(struct file_metadata *file)
+{
+	if (!file->shdrs) return;
+	struct { ElfW(Sym) *syms; unsigned nsyms; enum sym_or_reloc_kind kind; } tables[] = {
+		{ file->dynsym, nsyms_in_section(file, file->dynsymndx), REC_DYNSYM },
+		{ file->symtab, nsyms_in_section(file, file->symtabndx), REC_SYMTAB }
+	};
+	/* First count the spans in each segment, so we can allocate exactly. */
+	size_t counts[file->nload];
+	bzero(counts, sizeof counts);
+	for (unsigned t = 0; t < sizeof tables / sizeof tables[0]; ++t)
+	{
+		if (!tables[t].syms) continue;
+		for (unsigned i = 0; i < tables[t].nsyms; ++i)
+		{
+			if (!is_indexable_span(&tables[t].syms[i])) continue;
+			int loadndx = loadndx_for_vaddr(file, tables[t].syms[i].st_value);
+			if (loadndx >= 0) ++counts[loadndx];
+		}
+	}
+	/* Every segment gets a metavector, even if empty, so that a null one
+	 * means "not built". Segments too big for our offsets get none. */
+	union sym_or_reloc_rec *recs[file->nload];
+	for (unsigned i = 0; i < file->nload; ++i)
+	{
+		recs[i] = NULL;
+		if (file->phdrs[file->segments[i].phdr_idx].p_memsz > UINT_MAX) continue;
+		recs[i] = __private_malloc((counts[i] ? counts[i] : 1) * sizeof (union sym_or_reloc_rec));
+		if (!recs[i]) abort();
+		counts[i] = 0;
+	}
+	for (unsigned t = 0; t < sizeof tables / sizeof tables[0]; ++t)
+	{
+		if (!tables[t].syms) continue;
+		for (unsigned i = 0; i < tables[t].nsyms; ++i)
+		{
+			ElfW(Sym) *sym = &tables[t].syms[i];
+			if (!is_indexable_span(sym)) continue;
+			int loadndx = loadndx_for_vaddr(file, sym->st_value);
+			if (loadndx < 0 || !recs[loadndx]) continue;
+			recs[loadndx][counts[loadndx]++] = (union sym_or_reloc_rec) { .sym = {
+				.kind = tables[t].kind,
+				.idx = i,
+				.vaddr_off = sym->st_value - file->phdrs[file->segments[loadndx].phdr_idx].p_vaddr
+			} };
+		}
+	}
+	for (unsigned i = 0; i < file->nload; ++i)
+	{
+		if (!recs[i]) continue;
+		qsort(recs[i], counts[i], sizeof (union sym_or_reloc_rec), compare_metavector_recs);
+		/* Discard spans that lie within the part already covered, and
+		 * clip the start of any that extend beyond it. */
+		size_t nkept = 0;
+		uintptr_t kept_end = 0;
+		for (size_t j = 0; j < counts[i]; ++j)
+		{
+			ElfW(Sym) *sym = __runt_segments_metavector_rec_sym(file, &recs[i][j], NULL);
+			uintptr_t end = (uintptr_t) recs[i][j].sym.vaddr_off + sym->st_size;
+			if (nkept > 0 && end <= kept_end) continue;
+			recs[i][nkept] = recs[i][j];
+			if (nkept > 0 && recs[i][nkept].sym.vaddr_off < kept_end) recs[i][nkept].sym.vaddr_off = kept_end;
+			++nkept;
+			kept_end = end;
+		}
+		uintptr_t *keys = __private_malloc((nkept + 1) * (sizeof (uintptr_t) + sizeof (unsigned)));
+		if (!keys) abort();
+		unsigned *ranks = (unsigned *) &keys[nkept + 1];
+#define proj_rec_vaddr_off(r) (r)->sym.vaddr_off
+		eytzinger_layout(ranks, nkept);
+		eytzinger_fill_keys(keys, ranks, nkept, recs[i], proj_rec_vaddr_off);
+#undef proj_rec_vaddr_off
+		file->segments[i].metavector_size = nkept;
+		file->segments[i].metavector_search_keys = keys;
+		file->segments[i].metavector_search_ranks = ranks;
+		build_starts_bitmap(file, i, recs[i], nkept);
+		/* The file is already visible to lookups, so publish this last. */
+		__atomic_store_n(&file->segments[i].metavector, recs[i], __ATOMIC_RELEASE);
+	}
+}
+
+/* Building the index means sorting every span in the file, which is much
+ * of the startup cost for a short-lived process that symbolizes a few
+ * addresses and exits. With LIBRUNT_INDEX_CACHE=1, we save each file's
+ * index under $META_BASE/.build-id/, named by the file's build-id, and
+ * later processes map it instead of building it. The index refers to
+ * symbols by table index, so it is only good for exactly the same file:
+ * we check the build-id, and also the table sizes, since stripping a file
+ * keeps its build-id. Files without a build-id are not cached. */
+#ifndef META_BASE
+#define META_BASE "/usr/lib/meta"
+#endif
+#define SYMIDX_MAGIC "RUNTSYMX"
+#define SYMIDX_VERSION 2
+/* Longer build-ids are compared only up to this length. */
+#define SYMIDX_BUILD_ID_MAX 64
+struct symidx_segment
+{
+	uint64_t p_vaddr;
+	uint64_t p_memsz;
+	uint64_t metavector_off; /* 0 if the segment has no metavector */
+	uint64_t metavector_size;
+	uint64_t keys_off; /* keys then ranks, as in build_symbols_index */
+	uint64_t bitmap_off; /* 0 if none; else bitmap, rank, first_rec as in build_starts_bitmap */
+	uint64_t bitmap_nbits;
+	uint64_t bitmap_nset;
+};
+struct symidx_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t ptr_size;
+	uint32_t build_id_len;
+	unsigned char build_id[SYMIDX_BUILD_ID_MAX];
+	uint32_t nload;
+	uint64_t ndynsym;
+	uint64_t nsymtab;
+	uint64_t total_size;
+	struct symidx_segment segments[];
+};
+#define SYMIDX_ALIGN(n) ROUND_UP((n), sizeof (uint64_t))
+static int index_cache_enabled = -1;
+static const char *index_cache_base;
+static unsigned long files_index_mapped;
+static unsigned long files_index_embedded;
+static _Bool use_index_cache(void)
+{
+	if (index_cache_enabled == -1)
+	{
+		const char *str = getenv("LIBRUNT_INDEX_CACHE");
+		index_cache_base = getenv("META_BASE");
+		if (!index_cache_base) index_cache_base = META_BASE;
+		index_cache_enabled = str && atoi(str);
+	}
+	return index_cache_enabled;
+}
+static _Bool has_build_id(struct file_metadata *file)
+{
+	return file->build_id_len != 0;
+}
+static size_t symidx_build_id_prefix_len(struct file_metadata *file)
+{
+	return (file->build_id_len < SYMIDX_BUILD_ID_MAX) ? file->build_id_len : SYMIDX_BUILD_ID_MAX;
+}
+/* Write the cache path for file into buf, returning the length of the
+ * directory part (so that the caller can create it), or 0 on failure. */
+static size_t index_cache_path(struct file_metadata *file, char *buf, size_t sz)
+{
+	if (!has_build_id(file)) return 0;
+	static const char hex[] = "0123456789abcdef";
+	const unsigned char *id = file->build_id;
+	/* As in /usr/lib/debug/.build-id: the first byte names a directory. */
+	int ret = snprintf(buf, sz, "%s/.build-id/%c%c/", index_cache_base,
+		hex[id[0] >> 4], hex[id[0] & 0xf]);
+	if (ret < 0 || (size_t) ret >= sz) return 0;
+	size_t pos = ret;
+	if (2 * (file->build_id_len - 1) + sizeof ".symidx" > sz - pos) return 0;
+	for (unsigned i = 1; i < file->build_id_len; ++i)
+	{
+		buf[pos++] = hex[id[i] >> 4];
+		buf[pos++] = hex[id[i] & 0xf];
+	}
+	memcpy(buf + pos, ".symidx", sizeof ".symidx");
+	return ret - 1;
+}
+/* How many dynsym entries does file have? Without section headers, we
+ * count them from PT_DYNAMIC's hash tables. */
+static unsigned long ndynsym_for_file(struct file_metadata *file)
+{
+	if (!file->dynsym) return 0;
+	if (file->shdrs) return nsyms_in_section(file, file->dynsymndx);
+	ElfW(Dyn) *d = (ElfW(Dyn) *) file->l->l_ld;
+	ElfW(Word) *gnu_hash = get_gnu_hash_from_dyn(d, file->l->l_addr);
+	if (gnu_hash) return gnu_hash_symbol_count(gnu_hash);
+	return dynamic_symbol_count_from_dyn(d, file->l->l_addr);
+}
+/* Is the in-bounds segment index s self-consistent, and consistent with
+ * file's symbols? We rely on this when searching it: every record names a
+ * real span within the segment, records are sorted and non-overlapping,
+ * and the search structures only ever yield indices of records. */
+static _Bool check_symidx_segment(struct file_metadata *file, const struct symidx_header *h,
+	const struct symidx_segment *s, ElfW(Phdr) *phdr)
+{
+	size_t n = s->metavector_size;
+	const union sym_or_reloc_rec *recs = (const union sym_or_reloc_rec *) ((char*) h + s->metavector_off);
+	uintptr_t prev_end = 0;
+	for (size_t j = 0; j < n; ++j)
+	{
+		const ElfW(Sym) *sym;
+		switch (recs[j].sym.kind)
+		{
+			case REC_DYNSYM:
+				if (recs[j].sym.idx >= h->ndynsym) return 0;
+				sym = &file->dynsym[recs[j].sym.idx];
+				break;
+			case REC_SYMTAB:
+				if (recs[j].sym.idx >= h->nsymtab) return 0;
+				sym = &file->symtab[recs[j].sym.idx];
+				break;
+			default:
+				return 0;
+		}
+		uintptr_t start = recs[j].sym.vaddr_off;
+		if (!is_indexable_span(sym)
+				|| (j > 0 && start < prev_end)
+				|| start >= phdr->p_memsz
+				|| sym->st_value > phdr->p_vaddr + start
+				|| phdr->p_vaddr + start - sym->st_value >= sym->st_size) return 0;
+		prev_end = sym->st_value + sym->st_size - phdr->p_vaddr;
+	}
+	const uintptr_t *keys = (const uintptr_t *) ((char*) h + s->keys_off);
+	const unsigned *ranks = (const unsigned *) &keys[n + 1];
+	for (size_t k = 1; k <= n; ++k)
+	{
+		if (ranks[k] >= n || keys[k] != recs[ranks[k]].sym.vaddr_off) return 0;
+	}
+	if (!s->bitmap_off) return 1;
+	const bitmap_word_t *bitmap = (const bitmap_word_t *) ((char*) h + s->bitmap_off);
+	size_t nwords = (s->bitmap_nbits + BITMAP_WORD_NBITS - 1) / BITMAP_WORD_NBITS;
+	const unsigned *rank = (const unsigned *) (bitmap + nwords);
+	const unsigned *first_rec = rank + nwords;
+	uint64_t total = 0;
+	for (size_t w = 0; w < nwords; ++w)
+	{
+		if (rank[w] != total) return 0;
+		total += popcount_word(bitmap[w]);
+	}
+	if (total != s->bitmap_nset || s->bitmap_nset > n) return 0;
+	for (size_t j = 0; j < s->bitmap_nset; ++j)
+	{
+		if (first_rec[j] >= n || (j > 0 && first_rec[j] <= first_rec[j - 1])) return 0;
+	}
+	return 1;
+}
+/* Is h, of total bytes, a good index for file? */
+static _Bool check_symidx(struct file_metadata *file, const struct symidx_header *h, size_t total)
+{
+#define IN_BOUNDS(off, len) ((off) % sizeof (uint64_t) == 0 && (off) <= total && (len) <= total - (off))
+	if (total < sizeof *h
+			|| 0 != memcmp(h->magic, SYMIDX_MAGIC, sizeof h->magic)
+			|| h->version != SYMIDX_VERSION
+			|| h->ptr_size != sizeof (void*)
+			|| h->build_id_len != file->build_id_len
+			|| (file->build_id_len && 0 != memcmp(h->build_id, file->build_id,
+				symidx_build_id_prefix_len(file)))
+			|| h->nload != file->nload
+			|| h->ndynsym != ndynsym_for_file(file)
+			|| h->nsymtab != (file->symtab ? nsyms_in_section(file, file->symtabndx) : 0)
+			|| h->total_size != total
+			|| !IN_BOUNDS(sizeof *h, file->nload * sizeof h->segments[0])) return 0;
+	for (unsigned i = 0; i < file->nload; ++i)
+	{
+		const struct symidx_segment *s = &h->segments[i];
+		ElfW(Phdr) *phdr = &file->phdrs[file->segments[i].phdr_idx];
+		if (s->p_vaddr != phdr->p_vaddr || s->p_memsz != phdr->p_memsz) return 0;
+		if (!s->metavector_off) continue;
+		size_t n = s->metavector_size;
+		if (!IN_BOUNDS(s->metavector_off, n * sizeof (union sym_or_reloc_rec))
+				|| !IN_BOUNDS(s->keys_off, (n + 1) * (sizeof (uintptr_t) + sizeof (unsigned))))
+			return 0;
+		if (s->bitmap_off)
+		{
+			size_t nwords = (s->bitmap_nbits + BITMAP_WORD_NBITS - 1) / BITMAP_WORD_NBITS;
+			if (s->bitmap_nbits != STARTS_BITMAP_NWORDS_FOR_PHDR(phdr)
+					|| !IN_BOUNDS(s->bitmap_off, nwords * (sizeof (bitmap_word_t) + sizeof (unsigned))
+						+ s->bitmap_nset * sizeof (unsigned))) return 0;
+		}
+		if (!check_symidx_segment(file, h, s, phdr)) return 0;
+	}
+#undef IN_BOUNDS
+	return 1;
+}
+/* Point file's segments into a checked index, publishing as
+ * build_symbols_index does. */
+static void install_symidx(struct file_metadata *file, const struct symidx_header *h)
+{
+	for (unsigned i = 0; i < file->nload; ++i)
+	{
+		const struct symidx_segment *s = &h->segments[i];
+		struct segment_metadata *seg = &file->segments[i];
+		if (!s->metavector_off) continue;
+		seg->metavector_size = s->metavector_size;
+		seg->metavector_search_keys = (uintptr_t *) ((char*) h + s->keys_off);
+		seg->metavector_search_ranks = (unsigned *) &seg->metavector_search_keys[s->metavector_size + 1];
+		if (s->bitmap_off)
+		{
+			bitmap_word_t *bitmap = (bitmap_word_t *) ((char*) h + s->bitmap_off);
+			size_t nwords = (s->bitmap_nbits + BITMAP_WORD_NBITS - 1) / BITMAP_WORD_NBITS;
+			seg->starts_bitmap_nbits = s->bitmap_nbits;
+			seg->starts_rank = (unsigned *) (bitmap + nwords);
+			seg->starts_first_rec = seg->starts_rank + nwords;
+			__atomic_store_n(&seg->starts_bitmap, bitmap, __ATOMIC_RELEASE);
+		}
+		__atomic_store_n(&seg->metavector,
+			(union sym_or_reloc_rec *) ((char*) h + s->metavector_off), __ATOMIC_RELEASE);
+	}
+}
+static _Bool map_cached_symbols_index(struct file_metadata *file)
+{
+	char path[PATH_MAX];
+	if (!file->shdrs || !index_cache_path(file, path, sizeof path)) return 0;
+	int fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd == -1) return 0;
+	struct stat st;
+	void *mapping = MAP_FAILED;
+	if (0 == fstat(fd, &st) && st.st_size >= (off_t) sizeof (struct symidx_header))
+	{
+		mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	close(fd);
+	if (mapping == MAP_FAILED) return 0;
+	if (!check_symidx(file, mapping, st.st_size))
+	{
+		debug_printf(1, "ignoring stale or corrupt symbols index %s\n", path);
+		munmap(mapping, st.st_size);
+		return 0;
+	}
+	file->symbols_index_mapping = mapping;
+	file->symbols_index_mapping_size = st.st_size;
+	install_symidx(file, mapping);
+	debug_printf(1, "mapped symbols index for %s from %s\n", file->filename, path);
+	return 1;
+}
+/* Is there an index embedded in the file (by tools/embed-meta)? We find
+ * it through a note in the phdrs, so it is already mapped, and we use it
+ * in place. If it covers only dynsym, we can check it against PT_DYNAMIC
+ * and use it without the section headers. If it covers the symtab too,
+ * we try again once they are mapped. */
+static _Bool use_embedded_symbols_index(struct file_metadata *file)
+{
+	struct file_note_cursor cursor = { 0 };
+	struct elf_note n;
+	while (__runt_files_next_note(file, &cursor, &n))
+	{
+		if (!elf_note_is(&n, LIBRUNT_NOTE_NAME, NT_LIBRUNT_META)
+				|| n.descsz < sizeof (struct librunt_meta_note)) continue;
+		struct librunt_meta_note note;
+		memcpy(&note, n.desc, sizeof note); /* desc may be only 4-aligned */
+		/* The index must be in the file's mapped part. */
+		int loadndx = loadndx_for_vaddr(file, note.symidx_vaddr);
+		if (loadndx < 0) return 0;
+		ElfW(Phdr) *load = &file->phdrs[file->segments[loadndx].phdr_idx];
+		if (note.symidx_size > load->p_vaddr + load->p_filesz - note.symidx_vaddr) return 0;
+		const struct symidx_header *h = (void*) (file->l->l_addr + note.symidx_vaddr);
+		/* If it covers the symtab, it must wait until the section headers
+		 * are mapped (with LIBRUNT_DEFER_SHDRS=1, maybe not yet). */
+		if (note.symidx_size >= sizeof *h && h->nsymtab && !file->symtab)
+		{
+			debug_printf(1, "embedded symbols index in %s awaits the symtab\n", file->filename);
+			return 0;
+		}
+		if (!check_symidx(file, h, note.symidx_size))
+		{
+			debug_printf(0, "ignoring bad embedded symbols index in %s\n", file->filename);
+			return 0;
+		}
+		/* A zero size says not to unmap it. */
+		file->symbols_index_mapping = (void*) h;
+		file->symbols_index_mapping_size = 0;
+		install_symidx(file, h);
+		return 1;
+	}
+	return 0;
+}
+/* Lay out a file's index as a symidx, returning a __private_malloc'd
+ * buffer, or NULL. */
+static char *serialize_symbols_index(struct file_metadata *file, size_t *out_size)
+{
+	struct symidx_segment segs[file->nload];
+	size_t off = SYMIDX_ALIGN(sizeof (struct symidx_header) + sizeof segs);
+	for (unsigned i = 0; i < file->nload; ++i)
+	{
+		struct segment_metadata *seg = &file->segments[i];
+		ElfW(Phdr) *phdr = &file->phdrs[seg->phdr_idx];
+		segs[i] = (struct symidx_segment) { .p_vaddr = phdr->p_vaddr, .p_memsz = phdr->p_memsz };
+		if (!seg->metavector) continue;
+		size_t n = seg->metavector_size;
+		segs[i].metavector_size = n;
+		segs[i].metavector_off = off;
+		off = SYMIDX_ALIGN(off + n * sizeof (union sym_or_reloc_rec));
+		segs[i].keys_off = off;
+		off = SYMIDX_ALIGN(off + (n + 1) * (sizeof (uintptr_t) + sizeof (unsigned)));
+		if (!seg->starts_bitmap) continue;
+		size_t nwords = (seg->starts_bitmap_nbits + BITMAP_WORD_NBITS - 1) / BITMAP_WORD_NBITS;
+		segs[i].bitmap_off = off;
+		segs[i].bitmap_nbits = seg->starts_bitmap_nbits;
+		segs[i].bitmap_nset = seg->starts_rank[nwords - 1] + popcount_word(seg->starts_bitmap[nwords - 1]);
+		off = SYMIDX_ALIGN(off + nwords * (sizeof (bitmap_word_t) + sizeof (unsigned))
+			+ segs[i].bitmap_nset * sizeof (unsigned));
+	}
+	char *buf = __private_malloc(off);
+	if (!buf) return NULL;
+	bzero(buf, off);
+	struct symidx_header *h = (struct symidx_header *) buf;
+	memcpy(h->magic, SYMIDX_MAGIC, sizeof h->magic);
+	h->version = SYMIDX_VERSION;
+	h->ptr_size = sizeof (void*);
+	h->build_id_len = file->build_id_len;
+	if (file->build_id_len) memcpy(h->build_id, file->build_id,
+		symidx_build_id_prefix_len(file));
+	h->nload = file->nload;
+	h->ndynsym = file->dynsym ? nsyms_in_section(file, file->dynsymndx) : 0;
+	h->nsymtab = file->symtab ? nsyms_in_section(file, file->symtabndx) : 0;
+	h->total_size = off;
+	memcpy(h->segments, segs, sizeof segs);
+	for (unsigned i = 0; i < file->nload; ++i)
+	{
+		struct segment_metadata *seg = &file->segments[i];
+		size_t n = segs[i].metavector_size;
+		if (!segs[i].metavector_off) continue;
+		memcpy(buf + segs[i].metavector_off, seg->metavector, n * sizeof (union sym_or_reloc_rec));
+		/* The ranks directly follow the keys. */
+		memcpy(buf + segs[i].keys_off, seg->metavector_search_keys,
+			(n + 1) * (sizeof (uintptr_t) + sizeof (unsigned)));
+		if (!segs[i].bitmap_off) continue;
+		size_t nwords = (segs[i].bitmap_nbits + BITMAP_WORD_NBITS - 1) / BITMAP_WORD_NBITS;
+		memcpy(buf + segs[i].bitmap_off, seg->starts_bitmap,
+			nwords * (sizeof (bitmap_word_t) + sizeof (unsigned))
+				+ segs[i].bitmap_nset * sizeof (unsigned));
+	}
+	*out_size = off;
+	return buf;
+}
+static void save_symbols_index(struct file_metadata *file)
+{
+	char path[PATH_MAX];
+	size_t dirlen = index_cache_path(file, path, sizeof path);
+	if (!dirlen) return;
+	size_t size;
+	char *buf = serialize_symbols_index(file, &size);
+	if (!buf) return;
+	/* Create the directories, then write to a temporary file and rename
+	 * it, so that readers never see a partial index. Failure is fine; we
+	 * just don't get a cache (the directory may well not be writable). */
+	for (char *slash = path + 1; slash <= path + dirlen; ++slash)
+	{
+		if (*slash != '/') continue;
+		*slash = '\0';
+		int ret = mkdir(path, 0755);
+		*slash = '/';
+		if (ret == -1 && errno != EEXIST) goto out;
+	}
+	char tmp_path[PATH_MAX + 32];
+	snprintf(tmp_path, sizeof tmp_path, "%s.%d.tmp", path, (int) getpid());
+	int fd = open(tmp_path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+	if (fd == -1) goto out;
+	size_t written = 0;
+	while (written < size)
+	{
+		ssize_t ret = write(fd, buf + written, size - written);
+		if (ret <= 0) break;
+		written += ret;
+	}
+	close(fd);
+	if (written != size || 0 != rename(tmp_path, path)) unlink(tmp_path);
+	else debug_printf(1, "saved symbols index for %s to %s\n", file->filename, path);
+out:
+	__private_free(buf);
+}
+/* For tools/embed-meta: build the index for the ELF file in image, which
+ * need not be loaded, and return it serialized. Symbol tables are read
+ * straight from the image; nothing here depends on where it is loaded. */
+void *__runt_segments_build_embeddable_index(const void *image, size_t size,
+	size_t *out_size) __attribute__((visibility("protected")));
+void *__runt_segments_build_embeddable_index(const void *image, size_t size,
+	size_t *out_size)
+{
+	const ElfW(Ehdr) *ehdr = image;
+	if (size < sizeof *ehdr || 0 != memcmp(ehdr->e_ident, ELFMAG, SELFMAG)
+			|| ehdr->e_phentsize != sizeof (ElfW(Phdr))
+			|| ehdr->e_shentsize != sizeof (ElfW(Shdr))
+			|| ehdr->e_phoff > size || ehdr->e_phnum * sizeof (ElfW(Phdr)) > size - ehdr->e_phoff
+			|| ehdr->e_shoff > size || ehdr->e_shnum * sizeof (ElfW(Shdr)) > size - ehdr->e_shoff
+			|| ehdr->e_shnum == 0) return NULL;
+	ElfW(Phdr) *phdrs = (ElfW(Phdr) *) ((char*) image + ehdr->e_phoff);
+	ElfW(Shdr) *shdrs = (ElfW(Shdr) *) ((char*) image + ehdr->e_shoff);
+	unsigned nload = 0;
+	for (unsigned i = 0; i < ehdr->e_phnum; ++i) if (phdrs[i].p_type == PT_LOAD) ++nload;
+	size_t meta_sz = offsetof(struct file_metadata, segments) + nload * sizeof (struct segment_metadata);
+	struct file_metadata *file = __private_malloc(meta_sz);
+	if (!file) return NULL;
+	bzero(file, meta_sz);
+	file->ehdr = (ElfW(Ehdr) *) ehdr;
+	file->phdrs = phdrs;
+	file->phnum = ehdr->e_phnum;
+	file->nload = nload;
+	file->shdrs = shdrs;
+	for (unsigned i = 0, loadndx = 0; i < ehdr->e_phnum; ++i)
+	{
+		if (phdrs[i].p_type == PT_LOAD) file->segments[loadndx++].phdr_idx = i;
+	}
+	void *ret = NULL;
+	for (unsigned i = 0; i < ehdr->e_shnum; ++i)
+	{
+		if (shdrs[i].sh_type == SHT_NOBITS) continue;
+		if (shdrs[i].sh_offset > size || shdrs[i].sh_size > size - shdrs[i].sh_offset) goto out;
+		if (shdrs[i].sh_type == SHT_DYNSYM || shdrs[i].sh_type == SHT_SYMTAB)
+		{
+			if (shdrs[i].sh_entsize != sizeof (ElfW(Sym))) goto out;
+			ElfW(Sym) *syms = (ElfW(Sym) *) ((char*) image + shdrs[i].sh_offset);
+			if (shdrs[i].sh_type == SHT_DYNSYM) { file->dynsymndx = i; file->dynsym = syms; }
+			else { file->symtabndx = i; file->symtab = syms; }
+		}
+		if (shdrs[i].sh_type == SHT_NOTE && !file->build_id)
+		{
+			const char *pos = (char*) image + shdrs[i].sh_offset;
+			struct elf_note n;
+			while (elf_note_next(&pos, pos + shdrs[i].sh_size, shdrs[i].sh_addralign, &n))
+			{
+				if (elf_note_is(&n, "GNU", NT_GNU_BUILD_ID) && n.descsz > 0)
+				{
+					file->build_id = n.desc;
+					file->build_id_len = n.descsz;
+				}
+			}
+		}
+	}
+	build_symbols_index(file);
+	ret = serialize_symbols_index(file, out_size);
+	for (unsigned i = 0; i < file->nload; ++i)
+	{
+		__private_free(file->segments[i].metavector);
+		__private_free(file->segments[i].metavector_search_keys);
+		__private_free(file->segments[i].starts_bitmap);
+	}
+out:
+	__private_free(file);
+	return ret;
+}
+
+/* With LIBRUNT_INDEX=lazy, we don't build a file's symbol index when it is
+ * loaded, but only when a symbol query that may allocate (fake_dladdrs, or
+ * a direct call to __runt_segments_ensure_symbols_indexed) first touches
+ * it. That saves the work (and the memory) for files that are never
+ * queried. fake_dladdr_with_cache must not malloc, so it never builds an
+ * index, and searches linearly in files that are not yet indexed.
+ * Concurrent first queries race to claim the build; the losers wait for
+ * the winner. */
+static int index_lazily = -1;
+static unsigned long files_loaded;
+static unsigned long files_indexed;
+static __thread _Bool building_index_here __attribute__((tls_model("initial-exec")));
+static void decide_index_lazily(void)
+{
+	if (index_lazily == -1)
+	{
+		const char *str = getenv("LIBRUNT_INDEX");
+		index_lazily = str && 0 == strcmp(str, "lazy");
+	}
+}
+void __runt_segments_notify_symbols_ready(
+	struct file_metadata *file
+)
+{
+	decide_index_lazily();
+	__atomic_fetch_add(&files_loaded, 1, __ATOMIC_RELAXED);
+	if (!index_lazily) __runt_segments_ensure_symbols_indexed(file);
+}
+/* Claim the building of file's index, waiting while anyone else tries.
+ * Returns false if the index got built meanwhile. */
+static _Bool claim_index_build(struct file_metadata *file)
+{
+	return __runt_once_claim(&file->symbols_index_state);
+}
+static void finish_index_build(struct file_metadata *file, _Bool built)
+{
+	if (built) __atomic_fetch_add(&files_indexed, 1, __ATOMIC_RELAXED);
+	__runt_once_finish(&file->symbols_index_state, built);
+}
+/* An embedded index needs only what the loader mapped, unless it covers
+ * the symtab, so we try it before mapping any section headers. Returns
+ * whether the index is built. */
+static _Bool try_embedded_symbols_index(struct file_metadata *file)
+{
+	if (!claim_index_build(file)) return 1;
+	building_index_here = 1;
+	_Bool used = use_embedded_symbols_index(file);
+	if (used) __atomic_fetch_add(&files_index_embedded, 1, __ATOMIC_RELAXED);
+	building_index_here = 0;
+	finish_index_build(file, used);
+	return used;
+}
+void __runt_segments_notify_shdrs_deferred(
+	struct file_metadata *file
+)
+{
+	decide_index_lazily();
+	if (!index_lazily) (void) try_embedded_symbols_index(file);
+}
+void __runt_segments_ensure_symbols_indexed(
+	struct file_metadata *file
+)
+{
+	if (__builtin_expect(__runt_once_done(&file->symbols_index_state), 1)) return;
+	/* If we're called back while building (say from a malloc that wants
+	 * to know its caller), just let the caller fall back. */
+	if (building_index_here) return;
+	if (try_embedded_symbols_index(file)) return;
+	/* If the section headers were deferred, mapping them notifies us, and
+	 * (unless we are lazy) the index gets built then. That calls us back,
+	 * so we must not hold the claim while mapping. */
+	_Bool had_shdrs = (file->shdrs != NULL);
+	__runt_files_ensure_shdrs_mapped(file);
+	if (!claim_index_build(file)) return;
+	building_index_here = 1;
+	/* With the symtab mapped, an embedded index that covers it may do. */
+	if (!had_shdrs && file->shdrs && use_embedded_symbols_index(file))
+	{
+		__atomic_fetch_add(&files_index_embedded, 1, __ATOMIC_RELAXED);
+	}
+	else if (use_index_cache() && map_cached_symbols_index(file))
+	{
+		__atomic_fetch_add(&files_index_mapped, 1, __ATOMIC_RELAXED);
+	}
+	else
+	{
+		build_symbols_index(file);
+		if (use_index_cache()) save_symbols_index(file);
+	}
+	building_index_here = 0;
+	finish_index_build(file, 1);
+}
+void __runt_segments_get_index_stats(struct __runt_segments_index_stats *out)
+{
+	*out = (struct __runt_segments_index_stats) {
+		.files_loaded = __atomic_load_n(&files_loaded, __ATOMIC_RELAXED),
+		.files_indexed = __atomic_load_n(&files_indexed, __ATOMIC_RELAXED),
+		.files_index_mapped = __atomic_load_n(&files_index_mapped, __ATOMIC_RELAXED),
+		.files_index_embedded = __atomic_load_n(&files_index_embedded, __ATOMIC_RELAXED)
+	};
+}
+
+/* Find the metavector record whose span contains vaddr (file-relative).
+ * Returns 0 if vaddr's segment has no metavector (yet), else 1 with
+ * *out_rec set to the containing record, or NULL if none. We don't build
+ * a lazy index here; callers that may allocate ensure it first. */
+_Bool __runt_segments_metavector_lookup(
+	struct file_metadata *file,
+	uintptr_t vaddr,
+	union sym_or_reloc_rec **out_rec
+)
+{
+	int loadndx = loadndx_for_vaddr(file, vaddr);
+	if (loadndx < 0) return 0;
+	struct segment_metadata *seg = &file->segments[loadndx];
+	union sym_or_reloc_rec *metavector = __atomic_load_n(&seg->metavector, __ATOMIC_ACQUIRE);
+	if (!metavector) return 0;
+	*out_rec = NULL;
+	uintptr_t off = vaddr - file->phdrs[seg->phdr_idx].p_vaddr;
+	bitmap_word_t *bitmap = __atomic_load_n(&seg->starts_bitmap, __ATOMIC_ACQUIRE);
+	long idx = bitmap ?
+		starts_bitmap_lookup(seg, bitmap, &file->phdrs[seg->phdr_idx], metavector, off)
+		: eytzinger_search_leq(seg->metavector_search_keys, seg->metavector_search_ranks,
+			seg->metavector_size, off);
+	if (idx < 0) return 1;
+	ElfW(Sym) *sym = __runt_segments_metavector_rec_sym(file, &metavector[idx], NULL);
+	/* The record's start may be clipped, so measure from the symbol's. */
+	if (sym && vaddr - sym->st_value < sym->st_size) *out_rec = &metavector[idx];
+	return 1;
 }
 
 void __runt_segments_notify_destroy_segment(
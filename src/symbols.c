@@ -10,11 +10,15 @@
 #include <string.h>
 #include <dlfcn.h>
 #include <limits.h>
+#include <sched.h>
 #include <link.h>
+#include <stddef.h>
+#include <sys/mman.h>
 #include "relf.h"
 #include "librunt_private.h"
 #include "dso-meta.h"
 
+static void decide_dladdr_cache_size(void);
 static _Bool trying_to_initialize;
 static _Bool initialized;
 void __runt_symbols_init(void) __attribute__((constructor(102)));
@@ -26,52 +30,182 @@ void __runt_symbols_init(void)
 		/* Initialize what we depend on. */
 		__runt_segments_init();
 		__runt_sections_init();
+		decide_dladdr_cache_size();
 		initialized = 1;
 		trying_to_initialize = 0;
 	}
 }
 
-/* FIXME: invalidate cache entries on dlclose().
+/* dladdr_with_cache and fake_dladdr_with_cache remember their answers,
+ * including negative ones, in a per-thread set-associative cache keyed by
+ * a hash of the address. Since the answers depend on what files are
+ * loaded, each entry records the file table generation it was made in,
+ * and is valid only while that is current; so any dlopen() or dlclose()
+ * invalidates the whole cache. Entries remember which of the two
+ * functions made them, since the real dladdr may answer differently.
  * FIXME: get rid of this cache. Integrate the dladdr cache into the usual memrange cache
  * and/or the new static file/symbol alloc metadata. That means this code can probably
  * move back to liballocs. Also we should change the name from dladdr_with_cache...
  * the main utility of this function is that it returns the struct directly, so can be
  * called from a debugger. */
+/* Only a pointer to each thread's cache is initial-exec TLS, since when
+ * we are dlopen'd that comes out of the loader's small static TLS surplus
+ * (glibc keeps only 512 bytes for this by default). The cache itself is
+ * mapped on the thread's first query (mmap, so never malloc) and unmapped
+ * when the thread exits. Its size, in entries, is LIBRUNT_DLADDR_CACHE_SIZE,
+ * rounded down to a power-of-two number of sets. */
 #ifndef DLADDR_CACHE_SIZE
-#define DLADDR_CACHE_SIZE 16
+#define DLADDR_CACHE_SIZE 128
 #endif
-struct dladdr_cache_rec { const void *addr; Dl_info info; };
-static struct dladdr_cache_rec dladdr_cache[DLADDR_CACHE_SIZE];
-static unsigned dladdr_cache_next_free;
+#ifndef DLADDR_CACHE_WAYS
+#define DLADDR_CACHE_WAYS 4
+#endif
+struct dladdr_cache_rec
+{
+	const void *addr;
+	unsigned long tag; /* generation << 1 | fake; zero (never valid) if unused */
+	Dl_info info;
+};
+#define DLADDR_CACHE_TAG(generation, fake) (((generation) << 1) | (fake))
+struct dladdr_cache_set
+{
+	struct dladdr_cache_rec ways[DLADDR_CACHE_WAYS];
+	unsigned next_victim;
+};
+struct dladdr_cache
+{
+	size_t mapping_size;
+	unsigned long nsets; /* a power of two */
+	struct dladdr_cache_set sets[];
+};
+static unsigned long dladdr_cache_nsets = DLADDR_CACHE_SIZE / DLADDR_CACHE_WAYS;
+/* MAP_FAILED if we couldn't map it, and then we don't cache. */
+static __thread struct dladdr_cache *dladdr_cache __attribute__((tls_model("initial-exec")));
+#ifndef NO_PTHREADS
+#include <pthread.h>
+static pthread_key_t dladdr_cache_key;
+static void unmap_dladdr_cache(void *c)
+{
+	munmap(c, ((struct dladdr_cache *) c)->mapping_size);
+}
+#endif
+static void decide_dladdr_cache_size(void)
+{
+	const char *str = getenv("LIBRUNT_DLADDR_CACHE_SIZE");
+	long n = str ? atol(str) / DLADDR_CACHE_WAYS : 0;
+	if (n > 0)
+	{
+		unsigned long nsets = 1;
+		while (nsets * 2 <= (unsigned long) n) nsets *= 2;
+		dladdr_cache_nsets = nsets;
+	}
+#ifndef NO_PTHREADS
+	pthread_key_create(&dladdr_cache_key, unmap_dladdr_cache);
+#endif
+}
+static struct dladdr_cache *get_dladdr_cache(void)
+{
+	struct dladdr_cache *c = dladdr_cache;
+	if (__builtin_expect(c != NULL, 1)) return c == MAP_FAILED ? NULL : c;
+	unsigned long nsets = __atomic_load_n(&dladdr_cache_nsets, __ATOMIC_RELAXED);
+	size_t size = offsetof(struct dladdr_cache, sets) + nsets * sizeof (struct dladdr_cache_set);
+	c = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	dladdr_cache = c;
+	if (c == MAP_FAILED) return NULL;
+	/* Fresh anonymous memory is zeroed, so every way is unused. */
+	c->mapping_size = size;
+	c->nsets = nsets;
+#ifndef NO_PTHREADS
+	pthread_setspecific(dladdr_cache_key, c);
+#endif
+	return c;
+}
+/* Stats are striped across cache lines, a stripe per thread (modulo
+ * collisions), so that counting doesn't make threads contend. */
+#define DLADDR_CACHE_STAT_STRIPES 64
+static struct dladdr_cache_stat_stripe
+{
+	unsigned long hits;
+	unsigned long misses;
+} __attribute__((aligned(64))) dladdr_cache_stats[DLADDR_CACHE_STAT_STRIPES];
+static unsigned next_stat_stripe;
+static __thread struct dladdr_cache_stat_stripe *my_stat_stripe __attribute__((tls_model("initial-exec")));
+#define BUMP_DLADDR_CACHE_STAT(field) do { \
+	if (!my_stat_stripe) my_stat_stripe = &dladdr_cache_stats[ \
+		__atomic_fetch_add(&next_stat_stripe, 1, __ATOMIC_RELAXED) % DLADDR_CACHE_STAT_STRIPES]; \
+	__atomic_fetch_add(&my_stat_stripe->field, 1, __ATOMIC_RELAXED); \
+} while (0)
 
-Dl_info dladdr_with_cache(const void *addr); // __attribute__((visibility("protected")));
-Dl_info dladdr_with_cache(const void *addr)
+static inline struct dladdr_cache_set *dladdr_cache_set_for(struct dladdr_cache *c,
+	const void *addr)
 {
-	for (unsigned i = 0; i < DLADDR_CACHE_SIZE; ++i)
+	/* Fibonacci hashing: the top bits of the product are well mixed. */
+	uintptr_t h = (uintptr_t) addr * (uintptr_t) 0x9e3779b97f4a7c15ull;
+	return &c->sets[(h >> (sizeof (uintptr_t) * 8 - 32)) & (c->nsets - 1)];
+}
+static _Bool dladdr_cache_lookup(const void *addr, _Bool fake, unsigned long generation,
+	Dl_info *out)
+{
+	struct dladdr_cache *c = get_dladdr_cache();
+	if (!c)
+	{
+		BUMP_DLADDR_CACHE_STAT(misses);
+		return 0;
+	}
+	struct dladdr_cache_set *set = dladdr_cache_set_for(c, addr);
+	unsigned long tag = DLADDR_CACHE_TAG(generation, fake);
+	for (unsigned i = 0; i < DLADDR_CACHE_WAYS; ++i)
 	{
-		if (dladdr_cache[i].addr)
+		struct dladdr_cache_rec *r = &set->ways[i];
+		if (r->addr == addr && r->tag == tag)
 		{
-			if (dladdr_cache[i].addr == addr)
-			{
-				/* This entry is useful, so maximise #misses before we recycle it. */
-				dladdr_cache_next_free = (i + 1) % DLADDR_CACHE_SIZE;
-				return dladdr_cache[i].info;
-			}
+			BUMP_DLADDR_CACHE_STAT(hits);
+			*out = r->info;
+			return 1;
 		}
 	}
+	BUMP_DLADDR_CACHE_STAT(misses);
+	return 0;
+}
+static void dladdr_cache_insert(const void *addr, _Bool fake, unsigned long generation,
+	Dl_info info)
+{
+	struct dladdr_cache *c = get_dladdr_cache();
+	if (!c) return;
+	struct dladdr_cache_set *set = dladdr_cache_set_for(c, addr);
+	/* Prefer a stale or unused way; else evict round-robin. */
+	unsigned victim = set->next_victim;
+	for (unsigned i = 0; i < DLADDR_CACHE_WAYS; ++i)
+	{
+		if ((set->ways[i].tag >> 1) != generation) { victim = i; break; }
+	}
+	if (victim == set->next_victim) set->next_victim = (victim + 1) % DLADDR_CACHE_WAYS;
+	set->ways[victim] = (struct dladdr_cache_rec) {
+		.addr = addr,
+		.tag = DLADDR_CACHE_TAG(generation, fake),
+		.info = info
+	};
+}
+void __runt_symbols_get_dladdr_cache_stats(struct __runt_symbols_dladdr_cache_stats *out)
+{
+	*out = (struct __runt_symbols_dladdr_cache_stats) { 0 };
+	for (unsigned i = 0; i < DLADDR_CACHE_STAT_STRIPES; ++i)
+	{
+		out->hits += __atomic_load_n(&dladdr_cache_stats[i].hits, __ATOMIC_RELAXED);
+		out->misses += __atomic_load_n(&dladdr_cache_stats[i].misses, __ATOMIC_RELAXED);
+	}
+}
+
+Dl_info dladdr_with_cache(const void *addr); // __attribute__((visibility("protected")));
+Dl_info dladdr_with_cache(const void *addr)
+{
+	unsigned long generation = __atomic_load_n(&__runt_files_generation, __ATOMIC_SEQ_CST);
 	Dl_info info;
+	if (dladdr_cache_lookup(addr, 0, generation, &info)) return info;
 	int ret = dladdr(addr, &info);
-	assert(ret != 0);
-
-	/* always cache the dladdr result */
-#define CACHE_ENTRY(addr, info) \
-	dladdr_cache[dladdr_cache_next_free++] = (struct dladdr_cache_rec) { (addr), (info) }; \
-	if (dladdr_cache_next_free == DLADDR_CACHE_SIZE) \
-	{ \
-		debug_printf(5, "dladdr cache wrapped around\n"); \
-		dladdr_cache_next_free = 0; \
-	}
-	CACHE_ENTRY(addr, info)
+	/* If dladdr doesn't know the address, remember that too. */
+	if (!ret) bzero(&info, sizeof info);
+	dladdr_cache_insert(addr, 0, generation, info);
 	return info;
 }
 
@@ -84,35 +218,746 @@ Dl_info fake_dladdr_with_cache(const void *addr)
 	 * One benefit of this function, over ordinary dladdr(), is that it guarantees
 	 * not to call malloc. */
 
-	struct file_metadata *fm = __runt_files_metadata_by_addr((void*) addr);
+	unsigned long generation = __atomic_load_n(&__runt_files_generation, __ATOMIC_SEQ_CST);
 	Dl_info info;
+	if (dladdr_cache_lookup(addr, 1, generation, &info)) return info;
+	struct file_metadata *fm = __runt_files_metadata_by_addr((void*) addr);
 	bzero(&info, sizeof info);
 	if (fm)
 	{
 		info.dli_fname = fm->filename;
 		info.dli_fbase = (void*) fm->l->l_addr;
-		/* We just do a linear search for a containing symbol. */
+		/* If the segment's metavector is built, search that. If the index
+		 * is lazy and not built yet, we leave it: building would malloc.
+		 * An embedded index may be there before the section headers are. */
+		union sym_or_reloc_rec *rec;
+		if (__runt_segments_metavector_lookup(fm, (uintptr_t) addr - fm->l->l_addr, &rec))
+		{
+			if (rec)
+			{
+				unsigned char *strtab;
+				ElfW(Sym) *sym = __runt_segments_metavector_rec_sym(fm, rec, &strtab);
+				if (sym)
+				{
+					info.dli_sname = (void*)(&strtab[sym->st_name]);
+					info.dli_saddr = (void*)(info.dli_fbase + sym->st_value);
+				}
+			}
+			goto out;
+		}
+		/* Otherwise we just do a linear search for a containing symbol. If
+		 * the section headers are deferred, mapping them would malloc, so
+		 * we search only dynsym, sized from PT_DYNAMIC. */
 		ElfW(Sym) *found = NULL;
-#define LINEAR_LOOKUP_IN_SYMTAB(symtab, symtab_shidx, strtab) \
+#define LINEAR_LOOKUP_IN_SYMTAB(symtab, symtab_end, strtab) \
 			found = symbol_lookup_linear_by_vaddr_contained( \
-				(symtab), \
-				(symtab) + fm->shdrs[(symtab_shidx)].sh_size / fm->shdrs[(symtab_shidx)].sh_entsize, \
+				(symtab), (symtab_end), \
 				(uintptr_t) addr - fm->l->l_addr); \
 			if (found) \
 			{ \
 				info.dli_sname = (void*)(&(strtab)[found->st_name]); \
 				info.dli_saddr = (void*)(info.dli_fbase + found->st_value); \
 			}
+#define SYMTAB_END(symtab, symtab_shidx) \
+			((symtab) + fm->shdrs[(symtab_shidx)].sh_size / fm->shdrs[(symtab_shidx)].sh_entsize)
 
-		if (fm->dynsym && fm->shdrs && fm->dynsymndx)
+		_Bool have_shdrs = __runt_files_shdrs_mapped(fm);
+		if (fm->dynsym && have_shdrs && fm->dynsymndx)
+		{
+			LINEAR_LOOKUP_IN_SYMTAB(fm->dynsym, SYMTAB_END(fm->dynsym, fm->dynsymndx), fm->dynstr)
+		}
+		else if (fm->dynsym && !have_shdrs)
 		{
-			LINEAR_LOOKUP_IN_SYMTAB(fm->dynsym, fm->dynsymndx, fm->dynstr)
+			LINEAR_LOOKUP_IN_SYMTAB(fm->dynsym,
+				fm->dynsym + dynamic_symbol_count_from_dyn(fm->l->l_ld, fm->l->l_addr),
+				fm->dynstr)
 		}
-		if (!found && fm->symtab && fm->shdrs && fm->symtabndx)
+		if (!found && fm->symtab && have_shdrs && fm->symtabndx)
 		{
-			LINEAR_LOOKUP_IN_SYMTAB(fm->symtab, fm->symtabndx, fm->strtab)
+			LINEAR_LOOKUP_IN_SYMTAB(fm->symtab, SYMTAB_END(fm->symtab, fm->symtabndx), fm->strtab)
 		}
 	}
-	CACHE_ENTRY(addr, info)
+out:
+	dladdr_cache_insert(addr, 1, generation, info);
 	return info;
 }
+
+/* Batch version of fake_dladdr_with_cache, for symbolizing many addresses
+ * at once (e.g. a buffer of stack samples). We sort the addresses and look
+ * up their files in one merge pass. Then we search the metavectors, or,
+ * for segments that don't have one, sweep each file's symbols once for all
+ * the addresses in that file, rather than once per address. The results
+ * are the same as from fake_dladdr_with_cache. Unlike that function, we do
+ * call malloc, and so we build any lazy index we need, and we don't touch
+ * the cache. */
+/* Sweep one symbol table over the sorted addresses [begin, end), all in fm.
+ * Returns how many addresses are still without a symbol. */
+static size_t sweep_symtab_for_addrs(struct file_metadata *fm,
+	ElfW(Sym) *symtab, ElfW(Half) symtab_shidx, unsigned char *strtab,
+	struct addr_and_idx *begin, struct addr_and_idx *end, Dl_info *out, size_t nleft)
+{
+	ElfW(Sym) *symtab_end = symtab
+		+ fm->shdrs[symtab_shidx].sh_size / fm->shdrs[symtab_shidx].sh_entsize;
+	for (ElfW(Sym) *p_sym = symtab; p_sym < symtab_end && nleft > 0; ++p_sym)
+	{
+		if (p_sym->st_size == 0) continue;
+		uintptr_t sym_begin = fm->l->l_addr + p_sym->st_value;
+		uintptr_t sym_end = sym_begin + p_sym->st_size;
+		/* Find the first address >= the symbol's start. */
+		struct addr_and_idx *lower = begin, *upper = end;
+		while (lower != upper)
+		{
+			struct addr_and_idx *mid = lower + (upper - lower) / 2;
+			if (mid->addr < sym_begin) lower = mid + 1;
+			else upper = mid;
+		}
+		for (struct addr_and_idx *a = lower; a != end && a->addr < sym_end; ++a)
+		{
+			/* The first symbol in table order wins, as in the linear search. */
+			if (out[a->idx].dli_sname) continue;
+			out[a->idx].dli_sname = (void*)(&strtab[p_sym->st_name]);
+			out[a->idx].dli_saddr = (void*) sym_begin;
+			--nleft;
+		}
+	}
+	return nleft;
+}
+void fake_dladdrs(const void **addrs, size_t n, Dl_info *out)
+{
+	if (n == 0) return;
+	/* One allocation: the sorted addresses, then a plain copy of them
+	 * (so the file lookup sees sorted input and skips its own sort),
+	 * then the files they map to. */
+	struct addr_and_idx *sorted = __private_malloc(n * (sizeof (struct addr_and_idx)
+		+ sizeof (void*) + sizeof (struct file_metadata *)));
+	if (!sorted) abort();
+	const void **sorted_plain = (const void **) (sorted + n);
+	struct file_metadata **fms = (struct file_metadata **) (sorted_plain + n);
+	for (size_t i = 0; i < n; ++i) sorted[i] = (struct addr_and_idx) { (uintptr_t) addrs[i], i };
+	__runt_sort_addrs_and_idxs(sorted, n);
+	for (size_t i = 0; i < n; ++i) sorted_plain[i] = (const void *) sorted[i].addr;
+	__runt_files_metadata_by_addrs(sorted_plain, n, fms);
+	bzero(out, n * sizeof (Dl_info));
+	for (size_t run_begin = 0, run_end; run_begin < n; run_begin = run_end)
+	{
+		struct file_metadata *fm = fms[run_begin];
+		for (run_end = run_begin + 1; run_end < n && fms[run_end] == fm; ++run_end);
+		if (!fm) continue;
+		__runt_segments_ensure_symbols_indexed(fm);
+		for (size_t k = run_begin; k < run_end; ++k)
+		{
+			out[sorted[k].idx].dli_fname = fm->filename;
+			out[sorted[k].idx].dli_fbase = (void*) fm->l->l_addr;
+		}
+		/* Answer what we can from the metavectors, and move the rest
+		 * to the front of the run, keeping them sorted. */
+		size_t unindexed_end = run_begin;
+		for (size_t k = run_begin; k < run_end; ++k)
+		{
+			union sym_or_reloc_rec *rec;
+			if (!__runt_segments_metavector_lookup(fm, sorted[k].addr - fm->l->l_addr, &rec))
+			{
+				sorted[unindexed_end++] = sorted[k];
+				continue;
+			}
+			if (!rec) continue;
+			unsigned char *strtab;
+			ElfW(Sym) *sym = __runt_segments_metavector_rec_sym(fm, rec, &strtab);
+			if (!sym) continue;
+			out[sorted[k].idx].dli_sname = (void*)(&strtab[sym->st_name]);
+			out[sorted[k].idx].dli_saddr = (void*)(fm->l->l_addr + sym->st_value);
+		}
+		size_t nleft = unindexed_end - run_begin;
+		if (nleft > 0 && fm->dynsym && fm->shdrs && fm->dynsymndx)
+		{
+			nleft = sweep_symtab_for_addrs(fm, fm->dynsym, fm->dynsymndx, fm->dynstr,
+				&sorted[run_begin], &sorted[unindexed_end], out, nleft);
+		}
+		if (nleft > 0 && fm->symtab && fm->shdrs && fm->symtabndx)
+		{
+			sweep_symtab_for_addrs(fm, fm->symtab, fm->symtabndx, fm->strtab,
+				&sorted[run_begin], &sorted[unindexed_end], out, nleft);
+		}
+	}
+	__private_free(sorted);
+}
+
+/* An index of every loaded object's dynamic symbols by name, for
+ * fake_dlsym's RTLD_DEFAULT and RTLD_NEXT lookups. Walking the link map
+ * costs a hash lookup per object; instead we keep one hash table for the
+ * whole process, whose buckets hold every object's definition of each name
+ * in link-map order. A lookup is then one probe, taking the first entry
+ * whose object comes after the caller's (for RTLD_NEXT) or any entry (for
+ * RTLD_DEFAULT). Within each object we index only the entry that the
+ * object's own hash lookup would find, so we give the same answers as the
+ * per-object search.
+ *
+ * Lookups never build the index, since they may come from inside malloc
+ * or while bootstrapping; until it exists, they decline and the caller
+ * walks the link map. We build it once librunt has initialized, then keep
+ * it in step with each load and unload by adding or removing just that
+ * object's nodes. Buckets are lists that lookups walk without taking a
+ * lock, so a writer links a node in only once it's complete, and frees
+ * what it unlinked only once no lookup can still be on it. New objects
+ * come last in the link map, so appending keeps each bucket in link-map
+ * order. Entries point into objects' dynsym and dynstr, so the preload
+ * dlclose() withdraws the index before the real dlclose can unmap
+ * anything, and we restore it when told what went. */
+struct name_index_obj;
+struct name_index_node
+{
+	struct name_index_node *next;    /* in the bucket, in link-map order */
+	struct name_index_node **p_prev; /* writer-only: what points to us */
+	uint32_t hash;
+	const char *name;
+	ElfW(Sym) *sym;
+	struct name_index_obj *obj;
+};
+struct name_index_obj
+{
+	struct name_index_obj *next; /* in link-map order */
+	struct link_map *l;          /* only compared, since it may be stale */
+	const void *dynamic;
+	uintptr_t load_addr;
+	unsigned long order;         /* ascending in link-map order */
+	_Bool present;               /* scratch, for resyncing */
+	size_t nnodes;
+	struct name_index_node nodes[];
+};
+struct name_index
+{
+	size_t nbuckets;        /* a power of two */
+	struct name_index_bucket
+	{
+		struct name_index_node *head;
+		struct name_index_node **p_tail; /* writer-only */
+	} buckets[];
+};
+static struct name_index *name_index; /* published; null if unbuilt or withdrawn */
+static struct name_index_obj *name_index_objs; /* read by RTLD_NEXT lookups */
+/* Bumped on every change, for the RTLD_NEXT caller cache. */
+static unsigned long name_index_generation = 1;
+
+/* Writer-side state, protected by name_index_mutex. */
+static struct name_index *name_index_table; /* even while withdrawn */
+static _Bool name_index_started;
+static unsigned long name_index_last_order;
+static size_t name_index_nobjs;
+static size_t name_index_nentries;
+/* Building the index calls malloc, which may call back into dlopen. */
+static __thread _Bool in_name_index __attribute__((tls_model("initial-exec")));
+#ifndef NO_PTHREADS
+#include <pthread.h>
+static pthread_mutex_t name_index_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define NAME_INDEX_LOCK   pthread_mutex_lock(&name_index_mutex);
+#define NAME_INDEX_UNLOCK pthread_mutex_unlock(&name_index_mutex);
+#else
+#define NAME_INDEX_LOCK
+#define NAME_INDEX_UNLOCK
+#endif
+
+static unsigned long name_index_answered;
+static unsigned long name_index_declined;
+
+/* Readers announce themselves as for the file table (see files.c): each
+ * counts itself against the parity of the grace-period sequence number.
+ * Unlike files.c's writers, ours can afford to wait, so a writer frees
+ * what it unpublished as soon as both parities have drained. */
+#ifndef NAME_INDEX_READER_SLOTS
+#define NAME_INDEX_READER_SLOTS 16
+#endif
+struct name_index_reader_slot
+{
+	unsigned long nreaders[2];
+} __attribute__((aligned(64)));
+static struct name_index_reader_slot name_index_reader_slots[NAME_INDEX_READER_SLOTS];
+static unsigned long name_index_grace_period_seq;
+static unsigned name_index_next_reader_slot;
+static __thread struct name_index_reader_slot *my_name_index_reader_slot
+	__attribute__((tls_model("initial-exec")));
+
+static inline unsigned long *name_index_read_lock(void)
+{
+	struct name_index_reader_slot *s = my_name_index_reader_slot;
+	if (__builtin_expect(!s, 0))
+	{
+		s = &name_index_reader_slots[__atomic_fetch_add(&name_index_next_reader_slot, 1,
+				__ATOMIC_RELAXED) % NAME_INDEX_READER_SLOTS];
+		my_name_index_reader_slot = s;
+	}
+	unsigned long *ctr = &s->nreaders[
+		__atomic_load_n(&name_index_grace_period_seq, __ATOMIC_SEQ_CST) & 1];
+	__atomic_fetch_add(ctr, 1, __ATOMIC_SEQ_CST);
+	return ctr;
+}
+static inline void name_index_read_unlock(unsigned long *ctr)
+{
+	__atomic_fetch_sub(ctr, 1, __ATOMIC_RELEASE);
+}
+static _Bool name_index_readers_drained(unsigned parity)
+{
+	for (unsigned i = 0; i < NAME_INDEX_READER_SLOTS; ++i)
+	{
+		if (__atomic_load_n(&name_index_reader_slots[i].nreaders[parity], __ATOMIC_SEQ_CST)) return 0;
+	}
+	return 1;
+}
+/* Wait until nobody can still be using a snapshot we've unpublished.
+ * Any such reader is counted against one parity or the other, and we
+ * wait for each in turn, advancing the sequence number so that new
+ * readers don't keep us waiting. */
+static void name_index_synchronize(void)
+{
+	for (unsigned i = 0; i < 2; ++i)
+	{
+		unsigned long seq = __atomic_load_n(&name_index_grace_period_seq, __ATOMIC_RELAXED);
+		while (!name_index_readers_drained((seq & 1) ^ 1)) sched_yield();
+		__atomic_store_n(&name_index_grace_period_seq, seq + 1, __ATOMIC_SEQ_CST);
+	}
+}
+
+static struct name_index_obj *name_index_make_obj(struct link_map *l)
+{
+	ElfW(Dyn) *d = (ElfW(Dyn) *) l->l_ld;
+	ElfW(Sym) *dynsym = d ? get_dynsym_from_dyn(d, l->l_addr) : NULL;
+	unsigned char *dynstr = dynsym ? get_dynstr_from_dyn(d, l->l_addr) : NULL;
+	ElfW(Word) *gnu_hash = dynsym ? get_gnu_hash_from_dyn(d, l->l_addr) : NULL;
+	size_t first = 0, end = 0;
+	if (gnu_hash)
+	{
+		/* Only symbols from symbias up are hashed, hence findable. */
+		first = gnu_hash[1];
+		end = gnu_hash_symbol_count(gnu_hash);
+	}
+	else if (dynsym) end = dynamic_symbol_count_from_dyn(d, l->l_addr);
+	struct name_index_obj *o = __private_malloc(offsetof(struct name_index_obj, nodes)
+		+ (end - first) * sizeof (struct name_index_node));
+	if (!o) abort();
+	*o = (struct name_index_obj) { .l = l, .dynamic = d, .load_addr = l->l_addr };
+	size_t run_begin = first;
+	for (size_t i = first; i < end; ++i)
+	{
+		ElfW(Sym) *sym = &dynsym[i];
+		const char *name = (const char *) &dynstr[sym->st_name];
+		if (gnu_hash)
+		{
+			/* A GNU hash chain finds the lowest-numbered of several
+			 * same-named symbols (e.g. different versions). Those share a
+			 * chain, and each chain is a run of the table, ending at an
+			 * entry whose hash word has the low bit set. */
+			uint32_t *chain = (uint32_t *) (gnu_hash + 4) + gnu_hash[2] * (sizeof (ElfW(Off)) / 4)
+				+ gnu_hash[0] - first;
+			_Bool dup = 0;
+			for (size_t j = run_begin; j < i && !dup; ++j)
+			{
+				dup = ((chain[j] ^ chain[i]) >> 1) == 0
+					&& 0 == strcmp((const char *) &dynstr[dynsym[j].st_name], name);
+			}
+			if (chain[i] & 1) run_begin = i + 1;
+			if (dup) continue;
+		}
+		/* Otherwise, ask the object which one it would find. */
+		else if (sym->st_name == 0 || symbol_lookup_in_dyn(d, l->l_addr, name) != sym) continue;
+		o->nodes[o->nnodes++] = (struct name_index_node) {
+			.hash = dl_new_hash(name),
+			.name = name,
+			.sym = sym,
+			.obj = o
+		};
+	}
+	return o;
+}
+static void name_index_link_obj(struct name_index *idx, struct name_index_obj *o)
+{
+	for (size_t i = 0; i < o->nnodes; ++i)
+	{
+		struct name_index_node *n = &o->nodes[i];
+		struct name_index_bucket *b = &idx->buckets[n->hash & (idx->nbuckets - 1)];
+		n->next = NULL;
+		n->p_prev = b->p_tail;
+		__atomic_store_n(b->p_tail, n, __ATOMIC_RELEASE);
+		b->p_tail = &n->next;
+	}
+}
+static void name_index_unlink_obj(struct name_index *idx, struct name_index_obj *o)
+{
+	for (size_t i = 0; i < o->nnodes; ++i)
+	{
+		/* Lookups already on n can still follow n->next, so we leave it. */
+		struct name_index_node *n = &o->nodes[i];
+		__atomic_store_n(n->p_prev, n->next, __ATOMIC_RELEASE);
+		if (n->next) n->next->p_prev = n->p_prev;
+		else idx->buckets[n->hash & (idx->nbuckets - 1)].p_tail = n->p_prev;
+	}
+}
+/* A fresh, unpublished table holding every object's nodes. We relink the
+ * nodes themselves, so nobody may be using the old table. */
+static struct name_index *name_index_make_table(size_t nbuckets)
+{
+	struct name_index *idx = __private_malloc(offsetof(struct name_index, buckets)
+		+ nbuckets * sizeof (struct name_index_bucket));
+	if (!idx) abort();
+	idx->nbuckets = nbuckets;
+	for (size_t b = 0; b < nbuckets; ++b)
+	{
+		idx->buckets[b] = (struct name_index_bucket) { NULL, &idx->buckets[b].head };
+	}
+	for (struct name_index_obj *o = name_index_objs; o; o = o->next) name_index_link_obj(idx, o);
+	return idx;
+}
+static void name_index_free_objs(struct name_index_obj *dead)
+{
+	while (dead)
+	{
+		struct name_index_obj *next = dead->next;
+		__private_free(dead);
+		dead = next;
+	}
+}
+/* Make the index match the link map. Objects keep their relative order in
+ * the link map, and new ones join at the end, so we can walk the two lists
+ * together. Anything we don't find in order, we (re-)add at the end. Only
+ * what changed is touched, except when the table must grow, which happens
+ * only as often as the number of names doubles. */
+static void name_index_resync(void)
+{
+	for (struct name_index_obj *o = name_index_objs; o; o = o->next) o->present = 0;
+	struct name_index_obj *added = NULL;
+	struct name_index_obj **p_added_tail = &added;
+	size_t nadded = 0;
+	struct name_index_obj *cursor = name_index_objs;
+	for (struct link_map *l = find_r_debug()->r_map; l; l = l->l_next)
+	{
+		struct name_index_obj *found = cursor;
+		while (found && !(found->l == l && found->dynamic == l->l_ld
+				&& found->load_addr == l->l_addr)) found = found->next;
+		if (found)
+		{
+			found->present = 1;
+			cursor = found->next;
+			continue;
+		}
+		found = name_index_make_obj(l);
+		found->order = ++name_index_last_order;
+		*p_added_tail = found;
+		p_added_tail = &found->next;
+		nadded += found->nnodes;
+	}
+	_Bool published = NULL != __atomic_load_n(&name_index, __ATOMIC_RELAXED);
+	/* Unlink what went. */
+	struct name_index_obj *dead = NULL;
+	struct name_index_obj **p_o = &name_index_objs;
+	while (*p_o)
+	{
+		struct name_index_obj *o = *p_o;
+		if (!o->present)
+		{
+			if (name_index_table) name_index_unlink_obj(name_index_table, o);
+			__atomic_store_n(p_o, o->next, __ATOMIC_RELEASE);
+			--name_index_nobjs;
+			name_index_nentries -= o->nnodes;
+			o->next = dead;
+			dead = o;
+		}
+		else p_o = &o->next;
+	}
+	/* Grow the table if the new names would overfill it. Relinking means
+	 * withdrawing it for the duration. */
+	size_t nbuckets = name_index_table ? name_index_table->nbuckets : 1024;
+	while (name_index_nentries + nadded > nbuckets) nbuckets *= 2;
+	if (!name_index_table || nbuckets != name_index_table->nbuckets)
+	{
+		if (published)
+		{
+			__atomic_store_n(&name_index, NULL, __ATOMIC_SEQ_CST);
+			name_index_synchronize();
+			published = 0;
+		}
+		__private_free(name_index_table);
+		name_index_table = name_index_make_table(nbuckets);
+	}
+	/* Append what came, each object complete before anyone can see it. */
+	while (added)
+	{
+		struct name_index_obj *o = added;
+		added = o->next;
+		o->next = NULL;
+		name_index_link_obj(name_index_table, o);
+		__atomic_store_n(p_o, o, __ATOMIC_RELEASE);
+		p_o = &o->next;
+		++name_index_nobjs;
+		name_index_nentries += o->nnodes;
+	}
+	__atomic_fetch_add(&name_index_generation, 1, __ATOMIC_SEQ_CST);
+	/* If the table was withdrawn, nobody can be on what we unlinked. */
+	if (dead && published) name_index_synchronize();
+	name_index_free_objs(dead);
+	__atomic_store_n(&name_index, name_index_table, __ATOMIC_SEQ_CST);
+}
+/* Called once librunt has seen the startup objects. Until then, loads
+ * come one at a time and each would be a separate update. */
+void __runt_symbols_build_name_index(void)
+{
+	if (in_name_index) return;
+	in_name_index = 1;
+	NAME_INDEX_LOCK
+	name_index_started = 1;
+	name_index_resync();
+	NAME_INDEX_UNLOCK
+	in_name_index = 0;
+}
+void __runt_symbols_notify_load(void)
+{
+	if (in_name_index) return;
+	in_name_index = 1;
+	NAME_INDEX_LOCK
+	if (name_index_started) name_index_resync();
+	NAME_INDEX_UNLOCK
+	in_name_index = 0;
+}
+void __runt_symbols_notify_unload(void) __attribute__((alias("__runt_symbols_notify_load")));
+void __runt_symbols_withdraw_name_index(void)
+{
+	if (in_name_index) return;
+	in_name_index = 1;
+	NAME_INDEX_LOCK
+	if (__atomic_exchange_n(&name_index, NULL, __ATOMIC_SEQ_CST)) name_index_synchronize();
+	NAME_INDEX_UNLOCK
+	in_name_index = 0;
+}
+
+_Bool __runt_symbols_lookup_global(void *handle, const char *symname,
+	const void *caller_dynamic, void **out)
+{
+	size_t len = namehash_strlen(symname);
+	return __runt_symbols_lookup_global_hashed(handle, symname, len,
+		namehash_gnu(symname, len), caller_dynamic, out);
+}
+_Bool __runt_symbols_lookup_global_hashed(void *handle, const char *symname,
+	size_t len, uint32_t hash, const void *caller_dynamic, void **out)
+{
+	static __thread struct { const void *dynamic; unsigned long generation; unsigned long order; }
+		caller_cache __attribute__((tls_model("initial-exec")));
+	if (handle != RTLD_DEFAULT && handle != RTLD_NEXT)
+	{
+		__atomic_fetch_add(&name_index_declined, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+	unsigned long *ctr = name_index_read_lock();
+	struct name_index *idx = __atomic_load_n(&name_index, __ATOMIC_SEQ_CST);
+	unsigned long after = 0;
+	if (idx && handle == RTLD_NEXT)
+	{
+		unsigned long generation = __atomic_load_n(&name_index_generation, __ATOMIC_SEQ_CST);
+		if (caller_cache.dynamic != caller_dynamic
+				|| caller_cache.generation != generation)
+		{
+			caller_cache.dynamic = caller_dynamic;
+			caller_cache.generation = generation;
+			caller_cache.order = 0;
+			for (struct name_index_obj *o = __atomic_load_n(&name_index_objs, __ATOMIC_ACQUIRE);
+					o; o = __atomic_load_n(&o->next, __ATOMIC_ACQUIRE))
+			{
+				if (o->dynamic == caller_dynamic) { caller_cache.order = o->order; break; }
+			}
+		}
+		after = caller_cache.order;
+	}
+	if (!idx || (handle == RTLD_NEXT && after == 0)) /* unbuilt, or caller unknown */
+	{
+		name_index_read_unlock(ctr);
+		__atomic_fetch_add(&name_index_declined, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+	const struct name_index_node *found = NULL;
+	for (const struct name_index_node *n = __atomic_load_n(
+				&idx->buckets[hash & (idx->nbuckets - 1)].head, __ATOMIC_ACQUIRE);
+			n; n = __atomic_load_n(&n->next, __ATOMIC_ACQUIRE))
+	{
+		if (n->hash == hash && n->obj->order > after
+				&& n->sym->st_shndx != SHN_UNDEF
+				&& namehash_streq_len(n->name, symname, len))
+		{ found = n; break; }
+	}
+	void *addr = found ? sym_to_addr_given_base(found->obj->load_addr, found->sym) : (void*) -1;
+	_Bool is_ifunc = found && ELFW_ST_TYPE(found->sym->st_info) == STT_GNU_IFUNC;
+	name_index_read_unlock(ctr);
+	__atomic_fetch_add(&name_index_answered, 1, __ATOMIC_RELAXED);
+	/* Call any ifunc resolver only once we've left the snapshot. */
+	if (is_ifunc) addr = ((void *(*)(void)) addr)();
+	*out = addr;
+	return 1;
+}
+void __runt_symbols_get_name_index_stats(struct __runt_symbols_name_index_stats *out)
+{
+	_Bool built = NULL != __atomic_load_n(&name_index, __ATOMIC_SEQ_CST);
+	*out = (struct __runt_symbols_name_index_stats) {
+		.objects = built ? __atomic_load_n(&name_index_nobjs, __ATOMIC_RELAXED) : 0,
+		.names = built ? __atomic_load_n(&name_index_nentries, __ATOMIC_RELAXED) : 0,
+		.answered = __atomic_load_n(&name_index_answered, __ATOMIC_RELAXED),
+		.declined = __atomic_load_n(&name_index_declined, __ATOMIC_RELAXED)
+	};
+}
+
+/* Looking up a symtab symbol by name would otherwise mean a linear scan.
+ * So, on first use for each file, we build an index in the style of a GNU
+ * hash section: a Bloom filter to reject most absent names, then buckets
+ * of entries grouped by hash, each group ending with an entry whose hash
+ * has its low bit set. Unlike DT_GNU_HASH we can't reorder the symbol
+ * table, so entries are symbol indices, kept in table order within each
+ * bucket so that the first match is the first in the table. */
+struct symtab_name_index
+{
+	ElfW(Sym) *symtab;
+	unsigned char *strtab;
+	uint32_t nbuckets;  /* a power of two */
+	uint32_t maskwords; /* a power of two */
+	uint32_t nentries;
+	uint64_t *bloom;
+	uint32_t *buckets;  /* first entry + 1, or 0 if none */
+	uint32_t *hashes;
+	uint32_t *symidxs;
+};
+#define SYMTAB_NAME_INDEX_SHIFT2 26
+static __thread _Bool building_symtab_index_here __attribute__((tls_model("initial-exec")));
+
+static _Bool symtab_name_index_wants(ElfW(Sym) *sym)
+{
+	return sym->st_name != 0 && sym->st_shndx != SHN_UNDEF;
+}
+static struct symtab_name_index *build_symtab_name_index(ElfW(Sym) *symtab,
+	unsigned char *strtab, size_t nsyms)
+{
+	uint32_t nentries = 0;
+	for (size_t i = 0; i < nsyms; ++i) nentries += symtab_name_index_wants(&symtab[i]);
+	uint32_t nbuckets = 1, maskwords = 1;
+	while (nbuckets < nentries / 2) nbuckets *= 2;
+	/* About eight filter bits per name. */
+	while (maskwords * 8 < nentries / 8) maskwords *= 2;
+	size_t size = sizeof (struct symtab_name_index) + maskwords * sizeof (uint64_t)
+		+ (nbuckets + 2 * (size_t) nentries) * sizeof (uint32_t);
+	struct symtab_name_index *idx = __private_malloc(size);
+	if (!idx) abort();
+	*idx = (struct symtab_name_index) {
+		.symtab = symtab,
+		.strtab = strtab,
+		.nbuckets = nbuckets,
+		.maskwords = maskwords,
+		.nentries = nentries,
+		.bloom = (uint64_t *) (idx + 1)
+	};
+	idx->buckets = (uint32_t *) (idx->bloom + maskwords);
+	idx->hashes = idx->buckets + nbuckets;
+	idx->symidxs = idx->hashes + nentries;
+	bzero(idx->bloom, maskwords * sizeof (uint64_t) + nbuckets * sizeof (uint32_t));
+	/* Count the entries in each bucket, remembering each one's hash and
+	 * its position within its bucket. */
+	uint32_t *tmp = __private_malloc(2 * (size_t) nentries * sizeof (uint32_t) + 1);
+	if (!tmp) abort();
+	uint32_t *name_hashes = tmp, *rank_in_bucket = tmp + nentries;
+	uint32_t n = 0;
+	for (size_t i = 0; i < nsyms; ++i)
+	{
+		if (!symtab_name_index_wants(&symtab[i])) continue;
+		uint32_t h = dl_new_hash((const char *) &strtab[symtab[i].st_name]);
+		name_hashes[n] = h;
+		rank_in_bucket[n] = idx->buckets[h & (nbuckets - 1)]++;
+		idx->bloom[(h / 64) & (maskwords - 1)] |= (1ull << (h & 63))
+			| (1ull << ((h >> SYMTAB_NAME_INDEX_SHIFT2) & 63));
+		++n;
+	}
+	/* Turn counts into starting positions, then place each entry. */
+	uint32_t pos = 0;
+	for (uint32_t b = 0; b < nbuckets; ++b)
+	{
+		uint32_t count = idx->buckets[b];
+		idx->buckets[b] = count ? pos + 1 : 0;
+		pos += count;
+	}
+	n = 0;
+	for (size_t i = 0; i < nsyms; ++i)
+	{
+		if (!symtab_name_index_wants(&symtab[i])) continue;
+		uint32_t slot = idx->buckets[name_hashes[n] & (nbuckets - 1)] - 1 + rank_in_bucket[n];
+		idx->hashes[slot] = name_hashes[n] & ~1u;
+		idx->symidxs[slot] = i;
+		++n;
+	}
+	/* Mark the last entry of each bucket, i.e. the one before the next
+	 * bucket's first. */
+	uint32_t next = nentries;
+	for (uint32_t b = nbuckets; b-- > 0; )
+	{
+		if (!idx->buckets[b]) continue;
+		idx->hashes[next - 1] |= 1;
+		next = idx->buckets[b] - 1;
+	}
+	__private_free(tmp);
+	return idx;
+}
+static void ensure_symtab_name_indexed(struct file_metadata *fm)
+{
+	if (__builtin_expect(__runt_once_done(&fm->symtab_name_index_state), 1)) return;
+	/* As in segments.c, a reentrant caller just falls back. */
+	if (building_symtab_index_here) return;
+	if (!__runt_once_claim(&fm->symtab_name_index_state)) return;
+	building_symtab_index_here = 1;
+	if (fm->symtab && fm->shdrs && fm->symtabndx)
+	{
+		fm->symtab_name_index = build_symtab_name_index(fm->symtab, fm->strtab,
+			fm->shdrs[fm->symtabndx].sh_size / fm->shdrs[fm->symtabndx].sh_entsize);
+	}
+	else if (fm->dynsym && fm->shdrs && fm->dynsymndx)
+	{
+		fm->symtab_name_index = build_symtab_name_index(fm->dynsym, fm->dynstr,
+			fm->shdrs[fm->dynsymndx].sh_size / fm->shdrs[fm->dynsymndx].sh_entsize);
+	}
+	building_symtab_index_here = 0;
+	__runt_once_finish(&fm->symtab_name_index_state, 1);
+}
+ElfW(Sym) *__runt_symbols_lookup_by_name(struct file_metadata *fm, const char *name,
+	_Bool include_locals)
+{
+	__runt_files_ensure_shdrs_mapped(fm);
+	ensure_symtab_name_indexed(fm);
+	struct symtab_name_index *idx = __runt_once_done(&fm->symtab_name_index_state)
+		? fm->symtab_name_index : NULL;
+	if (!idx)
+	{
+		/* We're being called back while building, or have no symbols. */
+		ElfW(Sym) *symtab = fm->symtab ? fm->symtab : fm->dynsym;
+		ElfW(Half) ndx = fm->symtab ? fm->symtabndx : fm->dynsymndx;
+		unsigned char *strtab = fm->symtab ? fm->strtab : fm->dynstr;
+		if (!symtab || !fm->shdrs || !ndx) return NULL;
+		ElfW(Sym) *end = symtab + fm->shdrs[ndx].sh_size / fm->shdrs[ndx].sh_entsize;
+		for (ElfW(Sym) *sym = symtab; sym < end; ++sym)
+		{
+			if (symtab_name_index_wants(sym)
+					&& (include_locals || ELFW_ST_BIND(sym->st_info) != STB_LOCAL)
+					&& 0 == strcmp((const char *) &strtab[sym->st_name], name))
+			{ return sym; }
+		}
+		return NULL;
+	}
+	size_t len = namehash_strlen(name);
+	uint32_t h = namehash_gnu(name, len);
+	uint64_t bloom_word = idx->bloom[(h / 64) & (idx->maskwords - 1)];
+	if (!((bloom_word >> (h & 63)) & (bloom_word >> ((h >> SYMTAB_NAME_INDEX_SHIFT2) & 63)) & 1))
+	{
+		return NULL;
+	}
+	uint32_t first = idx->buckets[h & (idx->nbuckets - 1)];
+	if (!first) return NULL;
+	for (uint32_t i = first - 1; ; ++i)
+	{
+		if (((idx->hashes[i] ^ h) >> 1) == 0)
+		{
+			ElfW(Sym) *sym = &idx->symtab[idx->symidxs[i]];
+			if ((include_locals || ELFW_ST_BIND(sym->st_info) != STB_LOCAL)
+					&& namehash_streq_len((const char *) &idx->strtab[sym->st_name], name, len))
+			{ return sym; }
+		}
+		if (idx->hashes[i] & 1) break;
+	}
+	return NULL;
+}
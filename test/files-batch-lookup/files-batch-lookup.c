@@ -0,0 +1,102 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <link.h>
+#include <time.h>
+#include "librunt.h"
+#include "dso-meta.h"
+
+/* Symbolize a buffer of synthetic stack samples, one address at a time
+ * and in one batch, check that both give the same answers, and time them.
+ * Like real stack samples, our traces share their outer frames (think
+ * main and __libc_start_main) and draw their inner frames from a skewed
+ * distribution over a few hundred "call sites" spread across the loaded
+ * files' text. A few frames are junk, i.e. in no file at all. */
+
+#define NSITES 512
+#define NSAMPLES 2000
+#define MAX_DEPTH 32
+static const void *sites[NSITES];
+static unsigned nsites;
+static const void *trace[NSAMPLES * MAX_DEPTH];
+static unsigned ntrace;
+
+static int collect_cb(struct dl_phdr_info *info, size_t size, void *unused)
+{
+	for (unsigned i = 0; i < info->dlpi_phnum; ++i)
+	{
+		const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+		if (ph->p_type != PT_LOAD || !(ph->p_flags & PF_X) || ph->p_memsz == 0) continue;
+		for (unsigned j = 0; j < 64 && nsites < NSITES; ++j)
+		{
+			sites[nsites++] = (void*) (info->dlpi_addr + ph->p_vaddr
+				+ (random() % ph->p_memsz));
+		}
+	}
+	return 0;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(void)
+{
+	srandom(42);
+	dl_iterate_phdr(collect_cb, NULL);
+	assert(nsites > 0);
+	const void *outer[] = { (void*) main, (void*) (uintptr_t) 0xdead0 };
+	for (unsigned s = 0; s < NSAMPLES; ++s)
+	{
+		unsigned depth = 4 + random() % (MAX_DEPTH - 4);
+		for (unsigned d = 0; d < depth - 2; ++d)
+		{
+			/* Squaring a uniform variate skews towards the low sites. */
+			double u = (double) random() / RAND_MAX;
+			trace[ntrace++] = sites[(unsigned) (u * u * (nsites - 1))];
+		}
+		trace[ntrace++] = outer[0];
+		trace[ntrace++] = outer[random() % 8 == 0];
+	}
+
+	static struct file_metadata *fms[NSAMPLES * MAX_DEPTH];
+	static Dl_info infos[NSAMPLES * MAX_DEPTH];
+	double start = now();
+	for (unsigned i = 0; i < ntrace; ++i) fms[i] = __runt_files_metadata_by_addr((void*) trace[i]);
+	double single_files = now() - start;
+	start = now();
+	__runt_files_metadata_by_addrs(trace, ntrace, fms);
+	double batch_files = now() - start;
+	for (unsigned i = 0; i < ntrace; ++i)
+	{
+		assert(fms[i] == __runt_files_metadata_by_addr((void*) trace[i]));
+	}
+
+	start = now();
+	for (unsigned i = 0; i < ntrace; ++i) infos[i] = fake_dladdr_with_cache(trace[i]);
+	double single_syms = now() - start;
+	start = now();
+	fake_dladdrs(trace, ntrace, infos);
+	double batch_syms = now() - start;
+	unsigned nnamed = 0;
+	for (unsigned i = 0; i < ntrace; ++i)
+	{
+		Dl_info expected = fake_dladdr_with_cache(trace[i]);
+		assert(infos[i].dli_fname == expected.dli_fname);
+		assert(infos[i].dli_fbase == expected.dli_fbase);
+		assert(infos[i].dli_sname == expected.dli_sname);
+		assert(infos[i].dli_saddr == expected.dli_saddr);
+		nnamed += !!infos[i].dli_sname;
+	}
+	printf("%u frames (%u with symbols) from %u call sites\n", ntrace, nnamed, nsites);
+	printf("files:   %10.1f ns/frame one at a time, %10.1f ns/frame batched\n",
+		1e9 * single_files / ntrace, 1e9 * batch_files / ntrace);
+	printf("symbols: %10.1f ns/frame one at a time, %10.1f ns/frame batched\n",
+		1e9 * single_syms / ntrace, 1e9 * batch_syms / ntrace);
+	return 0;
+}
@@ -0,0 +1,112 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <dlfcn.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "librunt.h"
+#include "dso-meta.h"
+
+/* Time dlopen of many DSOs with section headers mapped eagerly and (in a
+ * child) deferred. When deferred, loading must not reopen any file, and
+ * the first query that needs the symtab or sections must map them. */
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static unsigned long nreopened(void)
+{
+	struct __runt_files_reopen_stats stats;
+	__runt_files_get_reopen_stats(&stats);
+	return stats.by_map_files + stats.by_path + stats.cache_hits;
+}
+
+static void run(const char *mode, _Bool deferred)
+{
+	void *funcs[NDSOS];
+	unsigned long reopened_before = nreopened();
+	double start = now_ns();
+	for (unsigned i = 0; i < NDSOS; ++i)
+	{
+		char name[64];
+		snprintf(name, sizeof name, "./libdso_%u.so", i);
+		void *handle = dlopen(name, RTLD_NOW|RTLD_LOCAL);
+		assert(handle);
+		funcs[i] = dlsym(handle, "dso_func");
+		assert(funcs[i]);
+	}
+	double elapsed = now_ns() - start;
+	unsigned long reopened = nreopened() - reopened_before;
+	printf("%s: %.1f us per dlopen, %lu files reopened\n", mode, elapsed / NDSOS / 1000.0,
+		reopened);
+	for (unsigned i = 0; i < NDSOS; ++i)
+	{
+		struct file_metadata *fm = __runt_files_metadata_by_addr(funcs[i]);
+		assert(fm && fm->dynsym && fm->l);
+		assert(deferred == !fm->shdrs);
+	}
+	if (deferred) assert(reopened == 0);
+	else assert(reopened == NDSOS);
+	/* What deferring saved, the first query pays. */
+	start = now_ns();
+	for (unsigned i = 4; i < NDSOS; ++i)
+	{
+		assert(__runt_files_ensure_shdrs_mapped(__runt_files_metadata_by_addr(funcs[i])));
+	}
+	printf("%s: then %.1f us per file to ensure shdrs are mapped\n", mode,
+		(now_ns() - start) / (NDSOS - 4) / 1000.0);
+
+	/* Each kind of query gets us the section headers. */
+	struct file_metadata *fm = __runt_files_metadata_by_addr(funcs[0]);
+	ElfW(Sym) *sym = __runt_symbols_lookup_by_name(fm, "dso_helper", 1);
+	assert(sym && ELF64_ST_BIND(sym->st_info) == STB_LOCAL);
+	assert(fm->shdrs && fm->symtab && fm->shstrtab);
+	fm = NULL;
+	const struct section_metadata *s = __runt_sections_lookup_by_addr(funcs[1], &fm);
+	assert(s && fm && section_metadata_kind(s) == SECTION_KIND_TEXT);
+	assert(0 == strcmp((char *) fm->shstrtab + fm->shdrs[s->shndx].sh_name, ".text"));
+	fm = NULL;
+	assert(__runt_find_section_boundary(funcs[2], SHF_EXECINSTR, 1, &fm, NULL));
+	assert(fm && fm->shdrs);
+	/* Except fake_dladdr_with_cache, which mustn't malloc, so searches only
+	 * dynsym. Its batch version may, so maps them. */
+	Dl_info info = fake_dladdr_with_cache(funcs[3]);
+	assert(info.dli_sname && 0 == strcmp(info.dli_sname, "dso_func"));
+	fm = __runt_files_metadata_by_addr(funcs[3]);
+	assert(deferred == !fm->shdrs);
+	const void *addr = funcs[3];
+	fake_dladdrs(&addr, 1, &info);
+	assert(info.dli_sname && 0 == strcmp(info.dli_sname, "dso_func"));
+	assert(fm->shdrs);
+	if (deferred) assert(nreopened() - reopened_before == NDSOS);
+}
+
+int main(int argc, char **argv)
+{
+	if (getenv("LIBRUNT_DEFER_SHDRS"))
+	{
+		run("deferred", 1);
+		return 0;
+	}
+	fflush(stdout);
+	pid_t pid = fork();
+	assert(pid != -1);
+	if (pid == 0)
+	{
+		setenv("LIBRUNT_DEFER_SHDRS", "1", 1);
+		execv("/proc/self/exe", argv);
+		abort();
+	}
+	int status;
+	assert(waitpid(pid, &status, 0) == pid);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	run("eager", 0);
+	return 0;
+}
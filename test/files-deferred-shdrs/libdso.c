@@ -0,0 +1,3 @@
+int dso_data = 42;
+static int dso_helper(int x) { return x + dso_data; }
+int dso_func(void) { return dso_helper(1); }
@@ -0,0 +1,70 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "librunt.h"
+#include "dso-meta.h"
+
+/* The parts of each file that librunt maps itself should hold what the
+ * file does, however many of them there are, and adjacent parts should
+ * share mappings. */
+
+static void check_section(int fd, struct file_metadata *fm, unsigned shndx, const void *mapped)
+{
+	assert(mapped);
+	size_t sz = fm->shdrs[shndx].sh_size;
+	char *buf = malloc(sz);
+	assert(buf);
+	ssize_t ret = pread(fd, buf, sz, fm->shdrs[shndx].sh_offset);
+	assert(ret == (ssize_t) sz);
+	assert(0 == memcmp(buf, mapped, sz));
+	free(buf);
+}
+
+static void check_file(struct file_metadata *fm)
+{
+	int fd = open(fm->filename, O_RDONLY);
+	assert(fd >= 0);
+	assert(fm->ehdr && fm->shdrs);
+	if (fm->symtabndx)
+	{
+		check_section(fd, fm, fm->symtabndx, fm->symtab);
+		check_section(fd, fm, fm->strtabndx, fm->strtab);
+	}
+	check_section(fd, fm, fm->ehdr->e_shstrndx, fm->shstrtab);
+	close(fd);
+	struct __runt_files_mapping_stats stats;
+	__runt_files_get_mapping_stats(fm, &stats);
+	printf("%s: %lu extra mappings (%lu extended in place, %lu subsumed), %lu bytes\n",
+		fm->filename, stats.mappings, stats.extended, stats.subsumed, stats.bytes);
+	/* At most one each for the ehdr, shdrs, symtab, strtab and shstrtab. */
+	assert(stats.mappings <= 5);
+}
+
+int main(void)
+{
+	void *handle = dlopen("./libmanyrelocs.so", RTLD_NOW|RTLD_LOCAL);
+	assert(handle);
+	void *f0 = dlsym(handle, "f_0");
+	assert(f0);
+	struct file_metadata *fm = __runt_files_metadata_by_addr(f0);
+	assert(fm);
+	unsigned nrela = 0;
+	for (unsigned i = 0; i < fm->ehdr->e_shnum; ++i) nrela += (fm->shdrs[i].sh_type == SHT_RELA);
+	printf("libmanyrelocs.so has %u sections, %u of them SHT_RELA\n",
+		(unsigned) fm->ehdr->e_shnum, nrela);
+	check_file(fm);
+	/* The three string and symbol tables are contiguous at the end of the
+	 * file, so they should share a mapping. */
+	struct __runt_files_mapping_stats stats;
+	__runt_files_get_mapping_stats(fm, &stats);
+	assert(stats.extended + stats.subsumed > 0);
+
+	check_file(__runt_files_metadata_by_addr((void*) main));
+	check_file(__runt_files_metadata_by_addr((void*) printf));
+	return 0;
+}
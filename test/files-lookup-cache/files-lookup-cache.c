@@ -0,0 +1,51 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <dlfcn.h>
+#include "librunt.h"
+
+/* Check that the per-thread last-hit cache is used for repeated lookups
+ * in the same file, and that it forgets files once they are unloaded. */
+
+int main(void)
+{
+	struct __runt_files_lookup_stats before, after;
+	struct file_metadata *fm = __runt_files_metadata_by_addr(main);
+	assert(fm);
+	__runt_files_get_lookup_stats(&before);
+	for (unsigned i = 0; i < 1000; ++i)
+	{
+		assert(__runt_files_metadata_by_addr((char*) main + (i % 16)) == fm);
+	}
+	__runt_files_get_lookup_stats(&after);
+	assert(after.cache_hits - before.cache_hits == 1000);
+	assert(after.cache_misses == before.cache_misses);
+	printf("%lu hits, %lu misses, generation %lu\n", after.cache_hits,
+		after.cache_misses, after.generation);
+
+	void *handle = dlopen("libm.so.6", RTLD_NOW|RTLD_LOCAL);
+	assert(handle);
+	void *cos_addr = dlsym(handle, "cos");
+	assert(cos_addr);
+	struct __runt_files_lookup_stats loaded;
+	__runt_files_get_lookup_stats(&loaded);
+	assert(__runt_files_metadata_by_addr(cos_addr));
+	assert(__runt_files_metadata_by_addr(cos_addr));
+	/* If libm was already loaded, we can't test unloading with it. */
+	struct __runt_files_lookup_stats looked_up;
+	__runt_files_get_lookup_stats(&looked_up);
+	assert(looked_up.cache_hits > loaded.cache_hits);
+	if (loaded.generation != after.generation)
+	{
+		/* libm was freshly loaded, so closing it will unload it. Its
+		 * range is in our cache, but we must not hit on it. */
+		dlclose(handle);
+		struct __runt_files_lookup_stats unloaded;
+		__runt_files_get_lookup_stats(&unloaded);
+		assert(unloaded.generation != looked_up.generation);
+		assert(!__runt_files_metadata_by_addr(cos_addr));
+	}
+	else dlclose(handle);
+	return 0;
+}
@@ -0,0 +1,92 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <dlfcn.h>
+#include <link.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "librunt.h"
+#include "dso-meta.h"
+
+/* Measure __runt_files_metadata_by_addr() throughput as we add reader
+ * threads, while another thread keeps loading and unloading a library.
+ * Readers should scale (more or less) linearly and never see a bogus
+ * answer for an address in a file that stays loaded. */
+
+#define MAX_READERS 64
+static volatile int stop;
+static void *addrs[4];
+
+static void *reader(void *arg)
+{
+	unsigned long *p_count = arg;
+	unsigned long n = 0;
+	while (!stop)
+	{
+		for (unsigned i = 0; i < sizeof addrs / sizeof addrs[0]; ++i)
+		{
+			struct file_metadata *fm = __runt_files_metadata_by_addr(addrs[i]);
+			assert(fm);
+			assert((uintptr_t) addrs[i] >= fm->l->l_addr + fm->vaddr_begin);
+			assert((uintptr_t) addrs[i] < fm->l->l_addr + fm->vaddr_end);
+		}
+		n += sizeof addrs / sizeof addrs[0];
+	}
+	*p_count = n;
+	return NULL;
+}
+
+static unsigned long nloads;
+static void *churner(void *ignored)
+{
+	while (!stop)
+	{
+		void *h = dlopen("libm.so.6", RTLD_NOW | RTLD_LOCAL);
+		if (!h) { usleep(1000); continue; }
+		dlclose(h);
+		++nloads;
+	}
+	return NULL;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(void)
+{
+	addrs[0] = main;
+	addrs[1] = printf;
+	addrs[2] = (void*) &stop;
+	addrs[3] = pthread_create;
+	const char *ms_str = getenv("BENCH_MS");
+	unsigned ms = ms_str ? atoi(ms_str) : 100;
+	const char *max_str = getenv("BENCH_MAX_THREADS");
+	long ncpu = max_str ? atoi(max_str) : sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpu < 1) ncpu = 1;
+	if (ncpu > MAX_READERS) ncpu = MAX_READERS;
+	for (unsigned nthreads = 1; nthreads <= ncpu; nthreads *= 2)
+	{
+		pthread_t threads[MAX_READERS], churn;
+		unsigned long counts[MAX_READERS];
+		stop = 0;
+		nloads = 0;
+		pthread_create(&churn, NULL, churner, NULL);
+		double start = now();
+		for (unsigned i = 0; i < nthreads; ++i) pthread_create(&threads[i], NULL, reader, &counts[i]);
+		usleep(ms * 1000);
+		stop = 1;
+		unsigned long total = 0;
+		for (unsigned i = 0; i < nthreads; ++i) { pthread_join(threads[i], NULL); total += counts[i]; }
+		double elapsed = now() - start;
+		pthread_join(churn, NULL);
+		printf("%2u readers: %12.0f lookups/s (%lu load/unload cycles)\n",
+			nthreads, total / elapsed, nloads);
+	}
+	return 0;
+}
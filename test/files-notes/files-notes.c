@@ -0,0 +1,130 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include "librunt.h"
+#include "dso-meta.h"
+
+/* Check that we get build-ids of any length, the ABI tag and GNU
+ * properties from notes in memory, and that for a file whose PT_NOTEs we
+ * have hidden, we still get them from its note sections. */
+
+static struct file_metadata *load(const char *path)
+{
+	void *handle = dlopen(path, RTLD_NOW|RTLD_LOCAL);
+	assert(handle);
+	void *func = dlsym(handle, "notes_func");
+	assert(func);
+	struct file_metadata *fm = __runt_files_metadata_by_addr(func);
+	assert(fm);
+	return fm;
+}
+
+static void check_notes(struct file_metadata *fm)
+{
+	const char *hex = NOTES_BUILD_ID;
+	assert(fm->build_id && fm->build_id_len == strlen(hex) / 2);
+	for (unsigned i = 0; i < fm->build_id_len; ++i)
+	{
+		unsigned byte;
+		sscanf(hex + 2 * i, "%2x", &byte);
+		assert(fm->build_id[i] == byte);
+	}
+	ElfW(Word) datasz;
+	const ElfW(Word) *features = file_metadata_gnu_property(fm,
+		GNU_PROPERTY_X86_FEATURE_1_AND, &datasz);
+	assert(features && datasz == sizeof (ElfW(Word)));
+	assert(*features & GNU_PROPERTY_X86_FEATURE_1_IBT);
+	assert(*features & GNU_PROPERTY_X86_FEATURE_1_SHSTK);
+	assert(!file_metadata_gnu_property(fm, 0xdeadbeef, NULL));
+}
+
+/* Copy a file, making its PT_NOTE and PT_GNU_PROPERTY phdrs PT_NULL. */
+static void copy_hiding_notes(const char *from, const char *to)
+{
+	int in = open(from, O_RDONLY);
+	int out = open(to, O_RDWR|O_CREAT|O_TRUNC, 0755);
+	assert(in != -1 && out != -1);
+	char buf[65536];
+	ssize_t n;
+	while ((n = read(in, buf, sizeof buf)) > 0) assert(write(out, buf, n) == n);
+	ElfW(Ehdr) ehdr;
+	assert(pread(out, &ehdr, sizeof ehdr, 0) == sizeof ehdr);
+	for (unsigned i = 0; i < ehdr.e_phnum; ++i)
+	{
+		ElfW(Phdr) phdr;
+		off_t off = ehdr.e_phoff + i * sizeof phdr;
+		assert(pread(out, &phdr, sizeof phdr, off) == sizeof phdr);
+		if (phdr.p_type != PT_NOTE && phdr.p_type != PT_GNU_PROPERTY) continue;
+		phdr.p_type = PT_NULL;
+		assert(pwrite(out, &phdr, sizeof phdr, off) == sizeof phdr);
+	}
+	close(in);
+	close(out);
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+#define NITERS 100000
+
+int main(void)
+{
+	struct file_metadata *exe_meta = __runt_files_metadata_by_addr(check_notes);
+	assert(exe_meta);
+	if (exe_meta->abi_tag)
+	{
+		assert(exe_meta->abi_tag[0] == ELF_NOTE_OS_LINUX);
+		printf("executable's ABI tag: Linux %u.%u.%u\n", (unsigned) exe_meta->abi_tag[1],
+			(unsigned) exe_meta->abi_tag[2], (unsigned) exe_meta->abi_tag[3]);
+	}
+	else printf("executable has no ABI tag\n");
+
+	struct file_metadata *fm = load("./libnotes.so");
+	check_notes(fm);
+	unsigned nnotes = 0;
+	struct file_note_cursor cursor = { 0 };
+	struct elf_note n;
+	while (__runt_files_next_note(fm, &cursor, &n)) ++nnotes;
+	assert(nnotes == 2); /* GNU property and build-id */
+
+	copy_hiding_notes("libnotes.so", "libnotes-nophdr.so");
+	struct file_metadata *fm_nophdr = load("./libnotes-nophdr.so");
+	assert(fm_nophdr != fm);
+	cursor = (struct file_note_cursor) { 0 };
+	assert(!__runt_files_next_note(fm_nophdr, &cursor, &n));
+	check_notes(fm_nophdr);
+	unlink("libnotes-nophdr.so");
+
+	/* Finding the build-id in memory, versus what reading it costs. */
+	double start = now_ns();
+	const void *found = NULL;
+	for (unsigned i = 0; i < NITERS; ++i)
+	{
+		cursor = (struct file_note_cursor) { 0 };
+		while (__runt_files_next_note(fm, &cursor, &n))
+		{
+			if (elf_note_is(&n, "GNU", NT_GNU_BUILD_ID)) { found = n.desc; break; }
+		}
+	}
+	printf("build-id from memory: %.1f ns\n", (now_ns() - start) / NITERS);
+	assert(found == fm->build_id);
+	start = now_ns();
+	for (unsigned i = 0; i < NITERS / 10; ++i)
+	{
+		char id[32];
+		int fd = open("libnotes.so", O_RDONLY);
+		assert(pread(fd, id, sizeof id, (char*) fm->build_id - (char*) fm->l->l_addr) == sizeof id);
+		close(fd);
+	}
+	printf("build-id by open and pread: %.1f ns\n", (now_ns() - start) / (NITERS / 10));
+	return 0;
+}
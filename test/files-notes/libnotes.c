@@ -0,0 +1 @@
+int notes_func(void) { return 42; }
@@ -0,0 +1,105 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <link.h>
+#include <unistd.h>
+#include <time.h>
+#include "librunt.h"
+#include "dso-meta.h"
+
+/* Compare address lookups with and without the page index. We time the
+ * table search first, then re-exec ourselves with LIBRUNT_PAGE_INDEX=1
+ * and time the same lookups through the index. To give the table search
+ * some depth, we pad the table with synthetic files. */
+
+void __insert_file_metadata(struct link_map *lm, struct file_metadata *fm);
+
+#define NFAKE 1000
+#define FAKE_BASE ((uintptr_t) 0x500000000000ul)
+#define FAKE_STRIDE ((uintptr_t) 0x200000ul)
+#define FAKE_SIZE ((uintptr_t) 0x10000ul)
+static struct link_map fake_lms[NFAKE];
+
+#define NADDRS 4096
+static void *addrs[NADDRS];
+static unsigned naddrs_real;
+
+static int collect_cb(struct dl_phdr_info *info, size_t size, void *unused)
+{
+	for (unsigned i = 0; i < info->dlpi_phnum && naddrs_real < NADDRS / 2; ++i)
+	{
+		const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+		if (ph->p_type != PT_LOAD || ph->p_memsz == 0) continue;
+		for (unsigned j = 0; j < 16 && naddrs_real < NADDRS / 2; ++j)
+		{
+			addrs[naddrs_real++] = (void*) (info->dlpi_addr + ph->p_vaddr
+				+ (ph->p_memsz * j) / 16);
+		}
+	}
+	return 0;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	const char *bench_ms_str = getenv("BENCH_MS");
+	double bench_secs = (bench_ms_str ? atoi(bench_ms_str) : 100) / 1000.0;
+	for (unsigned i = 0; i < NFAKE; ++i)
+	{
+		struct file_metadata *fm = calloc(1, sizeof (struct file_metadata));
+		fm->filename = "fake";
+		fm->l = &fake_lms[i];
+		fm->vaddr_end = FAKE_SIZE;
+		fake_lms[i] = (struct link_map) { .l_addr = FAKE_BASE + i * FAKE_STRIDE, .l_name = "" };
+		__insert_file_metadata(&fake_lms[i], fm);
+	}
+	dl_iterate_phdr(collect_cb, NULL);
+	for (unsigned i = naddrs_real; i < NADDRS; ++i)
+	{
+		addrs[i] = (void*) (FAKE_BASE + (i % NFAKE) * FAKE_STRIDE + (i * 64) % FAKE_SIZE);
+	}
+	for (unsigned i = 0; i < NADDRS; ++i)
+	{
+		struct file_metadata *fm = __runt_files_metadata_by_addr(addrs[i]);
+		assert(fm);
+		assert((char*) addrs[i] >= (char*) fm->l->l_addr + fm->vaddr_begin);
+		assert((char*) addrs[i] < (char*) fm->l->l_addr + fm->vaddr_end);
+		assert(__runt_files_lookup_by_addr(addrs[i]) == fm->l);
+	}
+	/* Heap addresses belong to no file. */
+	void *heap = malloc(1);
+	assert(!__runt_files_metadata_by_addr(heap));
+
+	const char *index_str = getenv("LIBRUNT_PAGE_INDEX");
+	_Bool indexed = index_str && atoi(index_str);
+	unsigned long nlookups = 0;
+	double start = now(), elapsed;
+	do
+	{
+		for (unsigned i = 0; i < NADDRS; ++i)
+		{
+			if (!__runt_files_metadata_by_addr(addrs[i])) abort();
+		}
+		nlookups += NADDRS;
+	} while ((elapsed = now() - start) < bench_secs);
+	printf("%s: %.2f ns per lookup\n", indexed ? "page index" : "table search",
+		1e9 * elapsed / nlookups);
+	free(heap);
+	if (!indexed)
+	{
+		fflush(stdout);
+		setenv("LIBRUNT_PAGE_INDEX", "1", 1);
+		execv("/proc/self/exe", argv);
+		perror("execv");
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,129 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "librunt.h"
+#include "dso-meta.h"
+
+/* Load a library, then replace the file at its path with a different one.
+ * Reopening the loaded file must still give us the original, whether via
+ * /proc/self/map_files or the fd cache, and after an unload and reload
+ * we must see the new file. Also time the ways of reopening. */
+
+static void copy_file(const char *from, const char *to)
+{
+	char tmp[64];
+	snprintf(tmp, sizeof tmp, "%s.tmp", to);
+	int in = open(from, O_RDONLY);
+	int out = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0755);
+	assert(in != -1 && out != -1);
+	char buf[65536];
+	ssize_t n;
+	while ((n = read(in, buf, sizeof buf)) > 0) assert(write(out, buf, n) == n);
+	close(in);
+	close(out);
+	/* Replace atomically, as a package manager would. */
+	assert(0 == rename(tmp, to));
+}
+
+static struct file_metadata *load(void **out_handle)
+{
+	void *handle = dlopen("./libswap.so", RTLD_NOW|RTLD_LOCAL);
+	assert(handle);
+	void *func = dlsym(handle, "which_lib");
+	assert(func);
+	struct file_metadata *fm = __runt_files_metadata_by_addr(func);
+	assert(fm && fm->ehdr && fm->shdrs && fm->symtab);
+	*out_handle = handle;
+	return fm;
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+#define NITERS 20000
+#define TIME_OPENS(what, expr) do { \
+		double start = now_ns(); \
+		for (unsigned i = 0; i < NITERS; ++i) { int fd_ = (expr); assert(fd_ != -1); close(fd_); } \
+		printf("reopen %-10s %6.0f ns\n", what, (now_ns() - start) / NITERS); \
+	} while (0)
+
+int main(int argc, char **argv)
+{
+	if (!getenv("LIBRUNT_FD_CACHE"))
+	{
+		setenv("LIBRUNT_FD_CACHE", "8", 1);
+		execv("/proc/self/exe", argv);
+		abort();
+	}
+	struct __runt_files_reopen_stats stats;
+	__runt_files_get_reopen_stats(&stats);
+	printf("at startup: %lu by map_files, %lu by path, %lu failed\n",
+		stats.by_map_files, stats.by_path, stats.failed);
+	assert(stats.by_map_files + stats.by_path > 0);
+
+	copy_file("libswap_a.so", "libswap.so");
+	struct stat st_a;
+	assert(0 == stat("libswap.so", &st_a));
+	void *handle;
+	struct file_metadata *fm = load(&handle);
+	assert(__runt_symbols_lookup_by_name(fm, "only_in_a", 0));
+	assert(fm->file_dev == st_a.st_dev && fm->file_ino == st_a.st_ino);
+
+	/* Now the path names a different file... */
+	copy_file("libswap_b.so", "libswap.so");
+	struct stat st_b;
+	assert(0 == stat("libswap.so", &st_b));
+	assert(st_b.st_ino != st_a.st_ino);
+	/* ... but reopening still gets the one we loaded. */
+	int fd = __runt_files_reopen(fm);
+	assert(fd != -1);
+	struct stat st;
+	assert(0 == fstat(fd, &st));
+	assert(st.st_dev == st_a.st_dev && st.st_ino == st_a.st_ino);
+	ElfW(Ehdr) ehdr;
+	assert(pread(fd, &ehdr, sizeof ehdr, 0) == sizeof ehdr);
+	assert(0 == memcmp(&ehdr, fm->ehdr, sizeof ehdr));
+	close(fd);
+	struct __runt_files_reopen_stats after;
+	__runt_files_get_reopen_stats(&after);
+	assert(after.cache_hits == stats.cache_hits + 1);
+
+	/* The path and map_files entries, as the fallback and the cache would
+	 * otherwise see them. */
+	char map_files_path[64];
+	ElfW(Phdr) *first_load = fm->phdrs;
+	while (first_load->p_type != PT_LOAD) ++first_load;
+	uintptr_t begin = fm->l->l_addr + first_load->p_vaddr;
+	uintptr_t end = begin + first_load->p_filesz;
+	snprintf(map_files_path, sizeof map_files_path, "/proc/self/map_files/%lx-%lx",
+		(unsigned long) (begin & ~4095ul), (unsigned long) ((end + 4095) & ~4095ul));
+	int map_files_fd = open(map_files_path, O_RDONLY);
+	TIME_OPENS("by path", open("./libswap_a.so", O_RDONLY));
+	if (map_files_fd != -1)
+	{
+		close(map_files_fd);
+		TIME_OPENS("map_files", open(map_files_path, O_RDONLY));
+	}
+	else printf("reopen map_files: not permitted\n");
+	TIME_OPENS("cached", __runt_files_reopen(fm));
+
+	/* Unload and reload: now we see the new file. */
+	dlclose(handle);
+	fm = load(&handle);
+	assert(__runt_symbols_lookup_by_name(fm, "only_in_b", 0));
+	assert(!__runt_symbols_lookup_by_name(fm, "only_in_a", 0));
+	assert(fm->file_dev == st_b.st_dev && fm->file_ino == st_b.st_ino);
+	dlclose(handle);
+	unlink("libswap.so");
+	return 0;
+}
@@ -0,0 +1,4 @@
+#define PASTE(a, b) a ## b
+#define ONLY_IN(w) PASTE(only_in_, w)
+int ONLY_IN(WHICH) = 1;
+int which_lib(void) { return ONLY_IN(WHICH); }
@@ -0,0 +1,125 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <link.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "librunt.h"
+#include "dso-meta.h"
+
+/* Time startup with many preloaded DSOs, building the file metadata
+ * serially and then with LIBRUNT_STARTUP_THREADS. Each run is a child
+ * process (ourselves, re-exec'd) that checks all the DSOs were found,
+ * and named as they would be when loaded one at a time. */
+
+static const unsigned counts[] = { 50, 300, 1000 };
+#define MAX_COUNT 1000
+#define PARALLEL_THREADS "4"
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int child(unsigned expected)
+{
+	unsigned ntiny = 0;
+	for (struct link_map *l = _r_debug.r_map; l; l = l->l_next)
+	{
+		if (!l->l_ld) continue;
+		struct file_metadata *fm = __runt_files_metadata_by_addr((void*) l->l_ld);
+		assert(fm);
+		/* Files get the same names however they were loaded. */
+		assert(0 == strcmp(fm->filename,
+			dynobj_name_from_dlpi_name(l->l_name, (void*) l->l_addr)));
+		if (strstr(l->l_name, "/libtiny-")) ++ntiny;
+	}
+	assert(ntiny == expected);
+	return 0;
+}
+
+/* The loader won't load the same file twice, so we need real copies. */
+static void copy_file(const char *from, const char *to)
+{
+	int in = open(from, O_RDONLY);
+	int out = open(to, O_WRONLY|O_CREAT|O_TRUNC, 0755);
+	assert(in != -1 && out != -1);
+	char buf[65536];
+	ssize_t n;
+	while ((n = read(in, buf, sizeof buf)) > 0) assert(write(out, buf, n) == n);
+	close(in);
+	close(out);
+}
+
+static double run_child(char *const argv[], const char *preload, unsigned count,
+	const char *nthreads)
+{
+	char count_str[16];
+	snprintf(count_str, sizeof count_str, "%u", count);
+	double start = now();
+	pid_t pid = fork();
+	assert(pid != -1);
+	if (pid == 0)
+	{
+		setenv("LD_PRELOAD", preload, 1);
+		setenv("STARTUP_PARALLEL_CHILD", count_str, 1);
+		setenv("LIBRUNT_STARTUP_THREADS", nthreads, 1);
+		execv("/proc/self/exe", argv);
+		_exit(127);
+	}
+	int status;
+	assert(waitpid(pid, &status, 0) == pid);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	return now() - start;
+}
+
+int main(int argc, char **argv)
+{
+	const char *child_str = getenv("STARTUP_PARALLEL_CHILD");
+	if (child_str) return child(atoi(child_str));
+
+	char exe[4096];
+	ssize_t len = readlink("/proc/self/exe", exe, sizeof exe - 1);
+	assert(len > 0);
+	exe[len] = '\0';
+	char lib[4096 + 16];
+	snprintf(lib, sizeof lib, "%s/libtiny.so", dirname(exe));
+
+	char tmpl[] = "/tmp/files-startup-parallel.XXXXXX";
+	char *dir = mkdtemp(tmpl);
+	assert(dir);
+	static char paths[MAX_COUNT][sizeof tmpl + 32];
+	for (unsigned i = 0; i < MAX_COUNT; ++i)
+	{
+		snprintf(paths[i], sizeof paths[i], "%s/libtiny-%04u.so", dir, i);
+		copy_file(lib, paths[i]);
+	}
+
+	const char *orig_preload = getenv("LD_PRELOAD");
+	if (!orig_preload) orig_preload = "";
+	size_t preload_sz = strlen(orig_preload) + MAX_COUNT * (sizeof paths[0] + 1) + 1;
+	char *preload = malloc(preload_sz);
+	assert(preload);
+	for (unsigned c = 0; c < sizeof counts / sizeof counts[0]; ++c)
+	{
+		char *pos = preload + sprintf(preload, "%s", orig_preload);
+		for (unsigned i = 0; i < counts[c]; ++i) pos += sprintf(pos, ":%s", paths[i]);
+		double serial = run_child(argv, preload, counts[c], "1");
+		double parallel = run_child(argv, preload, counts[c], PARALLEL_THREADS);
+		printf("%u DSOs: startup %.1f ms serial, %.1f ms with %s threads\n",
+			counts[c], serial * 1e3, parallel * 1e3, PARALLEL_THREADS);
+	}
+
+	free(preload);
+	for (unsigned i = 0; i < MAX_COUNT; ++i) unlink(paths[i]);
+	rmdir(dir);
+	return 0;
+}
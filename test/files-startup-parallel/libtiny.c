@@ -0,0 +1,3 @@
+/* Copied many times over by files-startup-parallel. */
+int tiny_value = 42;
+int tiny_function(int x) { return x + tiny_value; }
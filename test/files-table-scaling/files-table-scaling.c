@@ -0,0 +1,70 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <link.h>
+#include <time.h>
+#include "librunt.h"
+#include "dso-meta.h"
+
+/* Grow the file table to 10k synthetic "DSOs", checking that every one
+ * can be found, then tear them all down again. We never map anything at
+ * these addresses; the file table doesn't care. */
+
+void __insert_file_metadata(struct link_map *lm, struct file_metadata *fm);
+void __delete_file_metadata(struct file_metadata **p);
+
+#define MAX_FAKE 10000
+#define FAKE_BASE ((uintptr_t) 0x500000000000ul)
+#define FAKE_STRIDE ((uintptr_t) 0x200000ul)
+#define FAKE_SIZE ((uintptr_t) 0x10000ul)
+static struct link_map lms[MAX_FAKE];
+static struct file_metadata *fms[MAX_FAKE];
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(void)
+{
+	/* Make sure the real files are in there first. */
+	assert(__runt_files_metadata_by_addr(main));
+	unsigned n = 0;
+	for (unsigned target = 10; target <= MAX_FAKE; target *= 10)
+	{
+		double start = now();
+		unsigned before = n;
+		for (; n < target; ++n)
+		{
+			/* Insert in a scrambled order, so that we don't just append. */
+			unsigned slot = (n * 7919u) % MAX_FAKE;
+			lms[n] = (struct link_map) { .l_addr = FAKE_BASE + slot * FAKE_STRIDE, .l_name = "" };
+			fms[n] = calloc(1, sizeof (struct file_metadata));
+			fms[n]->filename = strdup("fake");
+			fms[n]->l = &lms[n];
+			fms[n]->vaddr_end = FAKE_SIZE;
+			__insert_file_metadata(&lms[n], fms[n]);
+		}
+		double elapsed = now() - start;
+		for (unsigned i = 0; i < n; ++i)
+		{
+			assert(__runt_files_metadata_by_addr((void*) lms[i].l_addr) == fms[i]);
+			assert(__runt_files_metadata_by_addr((void*) (lms[i].l_addr + FAKE_SIZE - 1)) == fms[i]);
+			assert(!__runt_files_metadata_by_addr((void*) (lms[i].l_addr + FAKE_SIZE)));
+		}
+		assert(__runt_files_metadata_by_addr(main));
+		printf("%6u files: %.3f us per insert\n", n, 1e6 * elapsed / (n - before));
+	}
+	for (unsigned i = 0; i < n; ++i)
+	{
+		struct file_metadata *fm = fms[i];
+		__delete_file_metadata(&fm);
+	}
+	assert(!__runt_files_metadata_by_addr((void*) FAKE_BASE));
+	assert(__runt_files_metadata_by_addr(main));
+	return 0;
+}
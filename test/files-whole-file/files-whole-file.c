@@ -0,0 +1,84 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <dlfcn.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "librunt.h"
+#include "dso-meta.h"
+
+/* Load many DSOs, once mapping just the parts of each file we need and
+ * once (in a child) mapping each file whole, and compare how many mmap
+ * calls and VMAs that takes. Either way, we must see the same metadata. */
+
+static unsigned count_vmas(const char *substr, unsigned *out_total)
+{
+	FILE *f = fopen("/proc/self/maps", "r");
+	assert(f);
+	char line[4096];
+	unsigned n = 0, total = 0;
+	while (fgets(line, sizeof line, f))
+	{
+		++total;
+		if (strstr(line, substr)) ++n;
+	}
+	fclose(f);
+	*out_total = total;
+	return n;
+}
+
+static void run(const char *mode)
+{
+	unsigned long mmaps = 0, mappings = 0, bytes = 0;
+	unsigned vmas_before;
+	count_vmas("libdso_", &vmas_before);
+	for (unsigned i = 0; i < NDSOS; ++i)
+	{
+		char name[64];
+		snprintf(name, sizeof name, "./libdso_%u.so", i);
+		void *handle = dlopen(name, RTLD_NOW|RTLD_LOCAL);
+		assert(handle);
+		void *func = dlsym(handle, "dso_func");
+		assert(func);
+		struct file_metadata *fm = __runt_files_metadata_by_addr(func);
+		assert(fm && fm->ehdr && fm->shdrs && fm->shstrtab && fm->symtab && fm->strtab);
+		assert(0 == strcmp((char *) fm->shstrtab + fm->shdrs[fm->symtabndx].sh_name, ".symtab"));
+		ElfW(Sym) *sym = __runt_symbols_lookup_by_name(fm, "dso_func", 0);
+		assert(sym && (char*) fm->l->l_addr + sym->st_value == (char*) func);
+		struct __runt_files_mapping_stats stats;
+		__runt_files_get_mapping_stats(fm, &stats);
+		mmaps += stats.mmaps;
+		mappings += stats.mappings + stats.subsumed;
+		bytes += stats.bytes;
+	}
+	unsigned total_vmas;
+	unsigned dso_vmas = count_vmas("libdso_", &total_vmas);
+	printf("%s, %u DSOs: %lu mmap calls, %lu extra mappings (%lu kB), "
+		"%u VMAs for the DSOs, %u VMAs in all\n",
+		mode, NDSOS, mmaps, mappings, bytes / 1024, dso_vmas, total_vmas);
+}
+
+int main(int argc, char **argv)
+{
+	if (getenv("LIBRUNT_MAP_WHOLE_FILE"))
+	{
+		run("whole-file mappings");
+		return 0;
+	}
+	fflush(stdout);
+	pid_t pid = fork();
+	assert(pid != -1);
+	if (pid == 0)
+	{
+		setenv("LIBRUNT_MAP_WHOLE_FILE", "random", 1);
+		execv("/proc/self/exe", argv);
+		abort();
+	}
+	int status;
+	assert(waitpid(pid, &status, 0) == pid);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	run("partial mappings");
+	return 0;
+}
@@ -0,0 +1,2 @@
+int dso_data = 42;
+int dso_func(void) { return dso_data; }
@@ -0,0 +1,102 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <assert.h>
+#include "dso-meta.h"
+#include "eytzinger.h"
+
+/* Microbenchmark: bsearch_leq_generic over an array of records (laid out
+ * like the file table's) versus eytzinger_search_leq over packed keys.
+ * We're built with -DNDEBUG, like an optimised librunt, so we check the
+ * answers with explicit tests, not assert(). */
+
+struct rec
+{
+	uintptr_t key;
+	void *payload[2];
+};
+#define proj_rec_key(p) (p)->key
+
+#define NQUERIES 4096
+static uintptr_t queries[NQUERIES];
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench(unsigned n, double bench_secs)
+{
+	struct rec *recs = malloc(n * sizeof (struct rec));
+	uintptr_t *keys = malloc((n + 1) * sizeof (uintptr_t));
+	unsigned *ranks = malloc((n + 1) * sizeof (unsigned));
+	if (!recs || !keys || !ranks) abort();
+	/* Keys are increasing with random gaps, some repeated. */
+	uintptr_t key = 0x1000;
+	for (unsigned i = 0; i < n; ++i)
+	{
+		key += (random() % 8 == 0) ? 0 : 1 + random() % 0x10000;
+		recs[i] = (struct rec) { .key = key };
+	}
+	for (unsigned i = 0; i < NQUERIES; ++i)
+	{
+		queries[i] = random() % (key + 0x2000);
+	}
+	eytzinger_layout(ranks, n);
+	eytzinger_fill_keys(keys, ranks, n, recs, proj_rec_key);
+	for (unsigned i = 0; i < NQUERIES; ++i)
+	{
+		struct rec *found = bsearch_leq_generic(struct rec, queries[i], recs, n, proj_rec_key);
+		long idx = eytzinger_search_leq(keys, ranks, n, queries[i]);
+		if ((found ? found - recs : -1) != idx) abort();
+	}
+	if (bench_secs == 0) goto out;
+
+	unsigned long nsearches = 0, sum = 0;
+	double start = now(), bsearch_elapsed, eytz_elapsed;
+	do
+	{
+		for (unsigned i = 0; i < NQUERIES; ++i)
+		{
+			struct rec *found = bsearch_leq_generic(struct rec, queries[i], recs, n, proj_rec_key);
+			sum += (uintptr_t) found;
+		}
+		nsearches += NQUERIES;
+	} while ((bsearch_elapsed = now() - start) < bench_secs);
+	double bsearch_ns = 1e9 * bsearch_elapsed / nsearches;
+
+	nsearches = 0;
+	start = now();
+	do
+	{
+		for (unsigned i = 0; i < NQUERIES; ++i)
+		{
+			sum += eytzinger_search_leq(keys, ranks, n, queries[i]);
+		}
+		nsearches += NQUERIES;
+	} while ((eytz_elapsed = now() - start) < bench_secs);
+	double eytz_ns = 1e9 * eytz_elapsed / nsearches;
+
+	printf("%8u elements: bsearch_leq_generic %6.1f ns, eytzinger %6.1f ns (%lx)\n",
+		n, bsearch_ns, eytz_ns, sum & 0xf);
+out:
+	free(recs);
+	free(keys);
+	free(ranks);
+}
+
+int main(void)
+{
+	const char *bench_ms_str = getenv("BENCH_MS");
+	double bench_secs = (bench_ms_str ? atoi(bench_ms_str) : 100) / 1000.0;
+	srandom(42);
+	/* Just check the answers for small sizes, which exercise the edges of the layout. */
+	for (unsigned n = 1; n < 70; ++n) bench(n, 0);
+	unsigned sizes[] = { 16, 256, 4096, 1u<<20 };
+	for (unsigned i = 0; i < sizeof sizes / sizeof sizes[0]; ++i) bench(sizes[i], bench_secs);
+	return 0;
+}
@@ -0,0 +1,103 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <dlfcn.h>
+#include <time.h>
+#include "librunt.h"
+#include "dso-meta.h"
+#include "relf.h"
+
+/* __runt_find_section_boundary should give the same answers as relf.h's
+ * linear find_section_boundary, forwards and backwards, for various flag
+ * masks, and be much faster on a file with thousands of sections. */
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const ElfW(Word) masks[] = {
+	SHF_ALLOC, SHF_EXECINSTR, SHF_WRITE, SHF_WRITE|SHF_EXECINSTR, SHF_TLS
+};
+#define NMASKS (sizeof masks / sizeof masks[0])
+
+static void check(struct file_metadata *fm, uintptr_t vaddr)
+{
+	/* Outside the file, we'd be asking about some other file. */
+	if (vaddr < fm->vaddr_begin || vaddr >= fm->vaddr_end) return;
+	for (unsigned m = 0; m < NMASKS; ++m)
+	{
+		for (int backwards = 0; backwards < 2; ++backwards)
+		{
+			unsigned expected_shndx = (unsigned) -1, shndx = (unsigned) -1;
+			uintptr_t expected = find_section_boundary(vaddr, masks[m], backwards,
+				fm->shdrs, fm->ehdr->e_shnum, &expected_shndx);
+			struct file_metadata *found_fm = NULL;
+			const void *ret = __runt_find_section_boundary(
+				(unsigned char *) fm->l->l_addr + vaddr, masks[m], backwards,
+				&found_fm, &shndx);
+			if (expected == 0 || expected == (uintptr_t) -1)
+			{
+				assert((uintptr_t) ret == expected);
+				continue;
+			}
+			assert(found_fm == fm);
+			assert((uintptr_t) ret == fm->l->l_addr + expected);
+			assert(shndx == expected_shndx);
+		}
+	}
+}
+
+int main(void)
+{
+	void *handle = dlopen("./libmanysections.so", RTLD_NOW|RTLD_LOCAL);
+	assert(handle);
+	void *fn0 = dlsym(handle, "fn_0");
+	assert(fn0);
+	struct file_metadata *fm = __runt_files_metadata_by_addr(fn0);
+	assert(fm && fm->shdrs);
+	printf("libmanysections.so has %u sections\n", (unsigned) fm->ehdr->e_shnum);
+
+	/* Every section boundary, either side of it, and random addresses. */
+	for (unsigned i = 0; i < fm->ehdr->e_shnum; ++i)
+	{
+		if (!(fm->shdrs[i].sh_flags & SHF_ALLOC)) continue;
+		uintptr_t begin = fm->shdrs[i].sh_addr, end = begin + fm->shdrs[i].sh_size;
+		check(fm, begin - 1); check(fm, begin); check(fm, begin + 1);
+		check(fm, end - 1); check(fm, end); check(fm, end + 1);
+	}
+	srand(42);
+	for (unsigned i = 0; i < 10000; ++i)
+	{
+		check(fm, fm->vaddr_begin + rand() % (fm->vaddr_end - fm->vaddr_begin));
+	}
+
+	/* Time executable-section boundary queries, both ways. */
+	enum { NQUERIES = 2000 };
+	static uintptr_t queries[NQUERIES];
+	for (unsigned i = 0; i < NQUERIES; ++i)
+	{
+		queries[i] = fm->vaddr_begin + rand() % (fm->vaddr_end - fm->vaddr_begin);
+	}
+	volatile uintptr_t sink = 0;
+	double t0 = now();
+	for (unsigned i = 0; i < NQUERIES; ++i)
+	{
+		sink += find_section_boundary(queries[i], SHF_EXECINSTR, i & 1,
+			fm->shdrs, fm->ehdr->e_shnum, NULL);
+	}
+	double t1 = now();
+	for (unsigned i = 0; i < NQUERIES; ++i)
+	{
+		sink += (uintptr_t) __runt_find_section_boundary(
+			(unsigned char *) fm->l->l_addr + queries[i], SHF_EXECINSTR, i & 1, NULL, NULL);
+	}
+	double t2 = now();
+	printf("section boundary query: %.1f ns linear, %.1f ns indexed\n",
+		(t1 - t0) * 1e9 / NQUERIES, (t2 - t1) * 1e9 / NQUERIES);
+	return 0;
+}
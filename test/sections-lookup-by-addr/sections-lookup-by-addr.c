@@ -0,0 +1,98 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <dlfcn.h>
+#include <time.h>
+#include "librunt.h"
+#include "dso-meta.h"
+
+/* __runt_sections_lookup_by_addr should classify pointers into the
+ * executable's text, rodata, data and bss, and agree with a linear scan
+ * of the section headers everywhere in libc. */
+
+static const char rodata_thing[] = "hello";
+int data_thing = 42;
+int bss_thing;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const ElfW(Shdr) *linear_lookup(struct file_metadata *fm, uintptr_t vaddr)
+{
+	for (unsigned i = 0; i < fm->ehdr->e_shnum; ++i)
+	{
+		const ElfW(Shdr) *shdr = &fm->shdrs[i];
+		if (!(shdr->sh_flags & SHF_ALLOC)) continue;
+		if ((shdr->sh_flags & SHF_TLS) && shdr->sh_type == SHT_NOBITS) continue;
+		if (vaddr >= shdr->sh_addr && vaddr < shdr->sh_addr + shdr->sh_size) return shdr;
+	}
+	return NULL;
+}
+
+int main(void)
+{
+	struct file_metadata *fm = NULL;
+	const struct section_metadata *s = __runt_sections_lookup_by_addr((void*) main, &fm);
+	assert(s && fm && section_metadata_kind(s) == SECTION_KIND_TEXT);
+	assert(0 == strcmp((char *) fm->shstrtab + fm->shdrs[s->shndx].sh_name, ".text"));
+	s = __runt_sections_lookup_by_addr(rodata_thing, NULL);
+	assert(s && section_metadata_kind(s) == SECTION_KIND_RODATA);
+	s = __runt_sections_lookup_by_addr(&data_thing, NULL);
+	assert(s && section_metadata_kind(s) == SECTION_KIND_DATA);
+	s = __runt_sections_lookup_by_addr(&bss_thing, NULL);
+	assert(s && section_metadata_kind(s) == SECTION_KIND_BSS);
+	int on_stack;
+	assert(!__runt_sections_lookup_by_addr(&on_stack, NULL));
+	void *on_heap = malloc(1);
+	assert(!__runt_sections_lookup_by_addr(on_heap, NULL));
+	free(on_heap);
+
+	/* Every byte-granular address in libc's image, sampled. */
+	struct file_metadata *libc = __runt_files_metadata_by_addr((void*) printf);
+	assert(libc && libc->shdrs);
+	printf("libc has %u allocated sections\n", libc->nsections);
+	for (unsigned i = 1; i < libc->nsections; ++i)
+	{
+		assert(libc->sections[i - 1].end <= libc->sections[i].start);
+	}
+	srand(42);
+	enum { NQUERIES = 100000 };
+	static void *queries[NQUERIES];
+	for (unsigned i = 0; i < NQUERIES; ++i)
+	{
+		uintptr_t vaddr = libc->vaddr_begin + rand() % (libc->vaddr_end - libc->vaddr_begin);
+		queries[i] = (char *) libc->l->l_addr + vaddr;
+		const ElfW(Shdr) *expected = linear_lookup(libc, vaddr);
+		struct file_metadata *found_fm = NULL;
+		s = __runt_sections_lookup_by_addr(queries[i], &found_fm);
+		if (!expected) { assert(!s); continue; }
+		assert(s && found_fm == libc);
+		assert(&libc->shdrs[s->shndx] == expected);
+		assert(s->start == expected->sh_addr && s->end == expected->sh_addr + expected->sh_size);
+		assert(s->flags == expected->sh_flags && s->type == expected->sh_type);
+	}
+
+	volatile unsigned kinds = 0;
+	double t0 = now();
+	for (unsigned i = 0; i < NQUERIES; ++i)
+	{
+		const ElfW(Shdr) *shdr = linear_lookup(libc, (uintptr_t) queries[i] - libc->l->l_addr);
+		kinds += shdr ? shdr->sh_flags : 0;
+	}
+	double t1 = now();
+	for (unsigned i = 0; i < NQUERIES; ++i)
+	{
+		s = __runt_sections_lookup_by_addr(queries[i], NULL);
+		kinds += s ? section_metadata_kind(s) : 0;
+	}
+	double t2 = now();
+	printf("section lookup in libc: %.1f ns scanning shdrs, %.1f ns via the table\n",
+		(t1 - t0) * 1e9 / NQUERIES, (t2 - t1) * 1e9 / NQUERIES);
+	return 0;
+}
@@ -0,0 +1,85 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <dlfcn.h>
+#include <time.h>
+#include "librunt.h"
+/* Walk the link map, as we would without librunt's name index. */
+#define RELF_HAVE_NAME_INDEX 0
+#include "relf.h"
+
+/* fake_dlsyms should agree with fake_dlsym on each name, while walking
+ * the link map only once. We look up all of libc's dynamic symbols, plus
+ * some that don't exist. */
+
+#define MAX_NAMES 4096
+static struct fake_dlsym_query qs[MAX_NAMES];
+static const char *names[MAX_NAMES];
+static void *addrs[MAX_NAMES];
+void *__runt_fake_dlsym(void *handle, const char *symbol);
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(void)
+{
+	Dl_info info;
+	int ret = dladdr((void*) printf, &info);
+	assert(ret);
+	struct link_map *libc = NULL;
+	for (struct link_map *l = find_r_debug()->r_map; l; l = l->l_next)
+	{
+		if ((void*) l->l_addr == info.dli_fbase) libc = l;
+	}
+	assert(libc);
+	ElfW(Sym) *dynsym = get_dynsym(libc);
+	ElfW(Word) *gnu_hash = get_gnu_hash(libc);
+	unsigned char *dynstr = get_dynstr(libc);
+	assert(dynsym && gnu_hash);
+	size_t n = 0;
+	for (unsigned long i = gnu_hash[1]; i < gnu_hash_symbol_count(gnu_hash) && n < MAX_NAMES - 2; ++i)
+	{
+		names[n++] = (const char *) &dynstr[dynsym[i].st_name];
+	}
+	names[n++] = "no_such_symbol_anywhere";
+	names[n++] = "main";
+	printf("looking up %zu names\n", n);
+
+	void *handles[] = { RTLD_DEFAULT, RTLD_NEXT, libc };
+	for (unsigned h = 0; h < sizeof handles / sizeof handles[0]; ++h)
+	{
+		for (size_t i = 0; i < n; ++i) qs[i].name = names[i];
+		fake_dlsyms(handles[h], qs, n);
+		for (size_t i = 0; i < n; ++i) assert(qs[i].addr == fake_dlsym(handles[h], names[i]));
+	}
+	/* librunt's version (where RTLD_NEXT means after librunt, and which
+	 * may use the name index) agrees with its one-at-a-time version. */
+	__runt_fake_dlsyms(RTLD_NEXT, names, n, addrs);
+	for (size_t i = 0; i < n; ++i) assert(addrs[i] == __runt_fake_dlsym(RTLD_NEXT, names[i]));
+
+	/* Time resolving a few hundred RTLD_NEXT names, as an interposition
+	 * library might at startup. */
+	const size_t nbench = n < 400 ? n : 400;
+	const unsigned rounds = 20;
+	double t0 = now();
+	for (unsigned r = 0; r < rounds; ++r)
+	{
+		for (size_t i = 0; i < nbench; ++i) addrs[i] = fake_dlsym(RTLD_NEXT, names[i]);
+	}
+	double t1 = now();
+	for (unsigned r = 0; r < rounds; ++r)
+	{
+		for (size_t i = 0; i < nbench; ++i) qs[i].name = names[i];
+		fake_dlsyms(RTLD_NEXT, qs, nbench);
+	}
+	double t2 = now();
+	printf("%zu RTLD_NEXT names: %.1f us one by one, %.1f us batched\n", nbench,
+		(t1 - t0) * 1e6 / rounds, (t2 - t1) * 1e6 / rounds);
+	return 0;
+}
@@ -0,0 +1,108 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <dlfcn.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "librunt.h"
+
+/* The dladdr cache should answer repeated queries, including negative
+ * ones, should be per-thread, and should be invalidated when a file is
+ * loaded. Its size comes from LIBRUNT_DLADDR_CACHE_SIZE. */
+
+int main(void);
+static struct __runt_symbols_dladdr_cache_stats prev;
+static void expect(unsigned long hits, unsigned long misses)
+{
+	struct __runt_symbols_dladdr_cache_stats s;
+	__runt_symbols_get_dladdr_cache_stats(&s);
+	assert(s.hits - prev.hits == hits);
+	assert(s.misses - prev.misses == misses);
+	prev = s;
+}
+
+static void *other_thread(void *arg)
+{
+	Dl_info info = fake_dladdr_with_cache((char*) main + 1);
+	assert(info.dli_sname && 0 == strcmp(info.dli_sname, "main"));
+	return NULL;
+}
+
+int main(void)
+{
+	_Bool tiny = NULL != getenv("LIBRUNT_DLADDR_CACHE_SIZE");
+	__runt_symbols_get_dladdr_cache_stats(&prev);
+	Dl_info info = fake_dladdr_with_cache((char*) main + 1);
+	assert(info.dli_sname && 0 == strcmp(info.dli_sname, "main"));
+	expect(0, 1);
+	info = fake_dladdr_with_cache((char*) main + 1);
+	assert(info.dli_sname && 0 == strcmp(info.dli_sname, "main"));
+	expect(1, 0);
+	/* The real dladdr's answers are kept separately. */
+	info = dladdr_with_cache((char*) main + 1);
+	expect(0, 1);
+	info = dladdr_with_cache((char*) main + 1);
+	expect(1, 0);
+
+	/* Negative results are cached too. */
+	void *heap = malloc(1);
+	info = fake_dladdr_with_cache(heap);
+	assert(!info.dli_sname);
+	info = fake_dladdr_with_cache(heap);
+	assert(!info.dli_sname);
+	info = dladdr_with_cache(heap);
+	assert(!info.dli_fname);
+	info = dladdr_with_cache(heap);
+	assert(!info.dli_fname);
+	expect(2, 2);
+
+	/* Each thread has its own cache. */
+	pthread_t t;
+	pthread_create(&t, NULL, other_thread, NULL);
+	pthread_join(t, NULL);
+	expect(0, 1);
+
+	/* Loading a file invalidates everything. */
+	void *handle = dlopen("libm.so.6", RTLD_NOW|RTLD_LOCAL);
+	assert(handle);
+	info = fake_dladdr_with_cache((char*) main + 1);
+	assert(info.dli_sname && 0 == strcmp(info.dli_sname, "main"));
+	expect(0, 1);
+	info = fake_dladdr_with_cache((char*) main + 1);
+	expect(1, 0);
+
+	/* Many distinct addresses: each set holds only a few, but every
+	 * lookup must still give the right answer. By default there are
+	 * enough sets for a few distinct addresses all to stay cached. */
+	for (unsigned round = 0; round < 2; ++round)
+	{
+		__runt_symbols_get_dladdr_cache_stats(&prev);
+		for (unsigned i = 0; i < 16; ++i)
+		{
+			info = fake_dladdr_with_cache((char*) main + i);
+			assert(info.dli_sname && 0 == strcmp(info.dli_sname, "main"));
+		}
+		if (round == 1 && !tiny) expect(16, 0);
+	}
+	if (tiny)
+	{
+		/* A one-set cache can't hold all 16. */
+		struct __runt_symbols_dladdr_cache_stats s;
+		__runt_symbols_get_dladdr_cache_stats(&s);
+		assert(s.misses - prev.misses > 0);
+	}
+	else
+	{
+		/* Run again with a cache of a single set. */
+		setenv("LIBRUNT_DLADDR_CACHE_SIZE", "4", 1);
+		char *argv[] = { "symbols-dladdr-cache", NULL };
+		execv("/proc/self/exe", argv);
+		abort();
+	}
+	__runt_symbols_get_dladdr_cache_stats(&prev);
+	printf("after %lu hits and %lu misses, all correct\n", prev.hits, prev.misses);
+	free(heap);
+	return 0;
+}
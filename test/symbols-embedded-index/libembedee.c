@@ -0,0 +1,4 @@
+/* Gets an index embedded by symbols-embedded-index. */
+int embedee_value = 42;
+int embedee_add(int x) { return x + embedee_value; }
+int embedee_mul(int x) { return x * embedee_value; }
@@ -0,0 +1,155 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <dlfcn.h>
+#include <sys/wait.h>
+#include "librunt.h"
+#include "dso-meta.h"
+
+/* Run tools/embed-meta on a library and on ourselves, then check that
+ * librunt uses the embedded indexes and gets the right answers from
+ * them. An index of a stripped library covers only dynsym, so with
+ * LIBRUNT_DEFER_SHDRS=1 it should be used without reopening the file.
+ * An unstripped library's index covers its symtab too, so it should be
+ * used once the section headers are mapped. */
+
+int main(int argc, char **argv);
+
+static void run(char *const cmd[])
+{
+	pid_t pid = fork();
+	assert(pid != -1);
+	if (pid == 0)
+	{
+		execv(cmd[0], cmd);
+		_exit(127);
+	}
+	int status;
+	assert(waitpid(pid, &status, 0) == pid);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+static void check_sym(void *handle, const char *name)
+{
+	void *addr = dlsym(handle, name);
+	assert(addr);
+	Dl_info info = fake_dladdr_with_cache((char*) addr + 1);
+	assert(info.dli_sname && 0 == strcmp(info.dli_sname, name));
+	assert(info.dli_saddr == addr);
+}
+
+/* Run as our own embedded copy. */
+static int child(void)
+{
+	struct __runt_segments_index_stats s;
+	__runt_segments_get_index_stats(&s);
+	assert(s.files_index_embedded == 1);
+	Dl_info info = fake_dladdr_with_cache((char*) main + 1);
+	assert(info.dli_sname && 0 == strcmp(info.dli_sname, "main"));
+	return 0;
+}
+
+static unsigned long nreopens(void)
+{
+	struct __runt_files_reopen_stats stats;
+	__runt_files_get_reopen_stats(&stats);
+	return stats.by_map_files + stats.by_path + stats.cache_hits + stats.failed;
+}
+
+/* Run with deferred section headers, on the embedded libraries. */
+static int deferred_child(const char *stripped_lib, const char *lib)
+{
+	struct __runt_segments_index_stats before, after;
+	__runt_segments_get_index_stats(&before);
+	unsigned long reopens_before = nreopens();
+	void *handle = dlopen(stripped_lib, RTLD_NOW|RTLD_LOCAL);
+	assert(handle);
+	__runt_segments_get_index_stats(&after);
+	assert(after.files_index_embedded == before.files_index_embedded + 1);
+	check_sym(handle, "embedee_add");
+	check_sym(handle, "embedee_mul");
+	check_sym(handle, "embedee_value");
+	struct file_metadata *fm = __runt_files_metadata_by_addr(dlsym(handle, "embedee_add"));
+	assert(fm && !fm->shdrs);
+	assert(nreopens() == reopens_before);
+
+	before = after;
+	handle = dlopen(lib, RTLD_NOW|RTLD_LOCAL);
+	assert(handle);
+	__runt_segments_get_index_stats(&after);
+	assert(after.files_index_embedded == before.files_index_embedded);
+	fm = __runt_files_metadata_by_addr(dlsym(handle, "embedee_add"));
+	assert(fm && !fm->shdrs);
+	assert(nreopens() == reopens_before);
+	/* A query that may map the section headers gets us the index. */
+	const void *addr = (char*) dlsym(handle, "embedee_mul") + 1;
+	Dl_info info;
+	fake_dladdrs(&addr, 1, &info);
+	assert(info.dli_sname && 0 == strcmp(info.dli_sname, "embedee_mul"));
+	assert(fm->shdrs);
+	__runt_segments_get_index_stats(&after);
+	assert(after.files_index_embedded == before.files_index_embedded + 1);
+	check_sym(handle, "embedee_add");
+	check_sym(handle, "embedee_value");
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	if (getenv("EMBEDDED_INDEX_CHILD")) return child();
+	const char *deferred_lib = getenv("EMBEDDED_INDEX_DEFERRED");
+	if (deferred_lib) return deferred_child(deferred_lib, getenv("EMBEDDED_INDEX_DEFERRED_UNSTRIPPED"));
+
+	char exe[4096];
+	ssize_t len = readlink("/proc/self/exe", exe, sizeof exe - 1);
+	assert(len > 0);
+	exe[len] = '\0';
+	char lib[4096 + 32];
+	snprintf(lib, sizeof lib, "%s/libembedee.so", dirname(strdup(exe)));
+	char stripped_lib[4096 + 32];
+	snprintf(stripped_lib, sizeof stripped_lib, "%s/libembedee-stripped.so", dirname(strdup(exe)));
+
+	char tmpl[] = "/tmp/symbols-embedded-index.XXXXXX";
+	char *dir = mkdtemp(tmpl);
+	assert(dir);
+	char out_lib[sizeof tmpl + 32];
+	snprintf(out_lib, sizeof out_lib, "%s/libembedee.so", dir);
+	char out_exe[sizeof tmpl + 32];
+	snprintf(out_exe, sizeof out_exe, "%s/symbols-embedded-index", dir);
+	run((char *const[]) { EMBED_META_TOOL, lib, out_lib, NULL });
+	run((char *const[]) { EMBED_META_TOOL, exe, out_exe, NULL });
+	char out_stripped_lib[sizeof tmpl + 32];
+	snprintf(out_stripped_lib, sizeof out_stripped_lib, "%s/libembedee-stripped.so", dir);
+	run((char *const[]) { EMBED_META_TOOL, stripped_lib, out_stripped_lib, NULL });
+
+	struct __runt_segments_index_stats before, after;
+	__runt_segments_get_index_stats(&before);
+	void *handle = dlopen(out_lib, RTLD_NOW|RTLD_LOCAL);
+	assert(handle);
+	__runt_segments_get_index_stats(&after);
+	printf("embedded indexes: %lu before dlopen, %lu after\n",
+		before.files_index_embedded, after.files_index_embedded);
+	assert(after.files_index_embedded == before.files_index_embedded + 1);
+	check_sym(handle, "embedee_add");
+	check_sym(handle, "embedee_mul");
+	check_sym(handle, "embedee_value");
+	dlclose(handle);
+
+	setenv("EMBEDDED_INDEX_CHILD", "1", 1);
+	run((char *const[]) { out_exe, NULL });
+	unsetenv("EMBEDDED_INDEX_CHILD");
+	setenv("EMBEDDED_INDEX_DEFERRED", out_stripped_lib, 1);
+	setenv("EMBEDDED_INDEX_DEFERRED_UNSTRIPPED", out_lib, 1);
+	setenv("LIBRUNT_DEFER_SHDRS", "1", 1);
+	run((char *const[]) { exe, NULL });
+
+	unlink(out_lib);
+	unlink(out_stripped_lib);
+	unlink(out_exe);
+	rmdir(dir);
+	return 0;
+}
@@ -0,0 +1,109 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <ftw.h>
+#include <dlfcn.h>
+#include <sys/wait.h>
+#include "librunt.h"
+#include "dso-meta.h"
+
+/* With LIBRUNT_INDEX_CACHE=1, the first run should save symbol indexes
+ * under META_BASE and the second should map them, getting the same
+ * answers. Then we corrupt the larger indexes, and the third run should
+ * reject those but still get the same answers. We run ourselves as
+ * children, with a fresh META_BASE. */
+
+int main(int argc, char **argv);
+
+static void check_lookups(void)
+{
+	Dl_info info = fake_dladdr_with_cache((char*) main + 1);
+	assert(info.dli_sname && 0 == strcmp(info.dli_sname, "main"));
+	void *handle = dlopen("libm.so.6", RTLD_NOW|RTLD_LOCAL);
+	assert(handle);
+	void *hypot_addr = dlsym(handle, "hypot");
+	assert(hypot_addr);
+	info = fake_dladdr_with_cache((char*) hypot_addr + 1);
+	assert(info.dli_sname && info.dli_saddr == hypot_addr);
+}
+
+static int child(int run)
+{
+	check_lookups();
+	struct __runt_segments_index_stats s;
+	__runt_segments_get_index_stats(&s);
+	printf("run %d: %lu files indexed, %lu of them mapped\n", run,
+		s.files_indexed, s.files_index_mapped);
+	if (run == 1) assert(s.files_index_mapped == 0);
+	/* Our own executable surely has a build-id and was saved last time. */
+	else if (run == 2) assert(s.files_index_mapped > 0);
+	else assert(s.files_index_mapped == strtoul(getenv("INDEX_CACHE_INTACT"), NULL, 0));
+	return 0;
+}
+
+static void run_child(char **argv, const char *run)
+{
+	pid_t pid = fork();
+	assert(pid != -1);
+	if (pid == 0)
+	{
+		setenv("INDEX_CACHE_CHILD", run, 1);
+		execv("/proc/self/exe", argv);
+		_exit(127);
+	}
+	int status;
+	assert(waitpid(pid, &status, 0) == pid);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+static int remove_one(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+	return remove(path);
+}
+
+/* Past its header, overwrite each index big enough to have records there
+ * with all-ones, i.e. invalid record kinds, keys, ranks and so on. */
+#define CORRUPT_FROM 512
+static unsigned long nintact;
+static int corrupt_one(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+	if (flag != FTW_F || !strstr(path, ".symidx")) return 0;
+	if (st->st_size < 2 * CORRUPT_FROM) { ++nintact; return 0; }
+	FILE *f = fopen(path, "r+");
+	assert(f);
+	assert(0 == fseek(f, CORRUPT_FROM, SEEK_SET));
+	for (off_t i = CORRUPT_FROM; i < st->st_size; ++i) fputc(0xff, f);
+	assert(0 == fclose(f));
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	const char *child_str = getenv("INDEX_CACHE_CHILD");
+	if (child_str) return child(atoi(child_str));
+
+	struct file_metadata *exe_meta = __runt_files_metadata_by_addr(main);
+	assert(exe_meta);
+	if (!exe_meta->build_id)
+	{
+		printf("no build-id, so nothing to test\n");
+		return 0;
+	}
+	char tmpl[] = "/tmp/symbols-index-cache.XXXXXX";
+	char *dir = mkdtemp(tmpl);
+	assert(dir);
+	setenv("META_BASE", dir, 1);
+	setenv("LIBRUNT_INDEX_CACHE", "1", 1);
+	run_child(argv, "1");
+	run_child(argv, "2");
+	nftw(dir, corrupt_one, 16, FTW_PHYS);
+	char intact_str[32];
+	snprintf(intact_str, sizeof intact_str, "%lu", nintact);
+	setenv("INDEX_CACHE_INTACT", intact_str, 1);
+	run_child(argv, "3");
+	nftw(dir, remove_one, 16, FTW_DEPTH|FTW_PHYS);
+	return 0;
+}
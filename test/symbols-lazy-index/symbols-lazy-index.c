@@ -0,0 +1,70 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include "librunt.h"
+
+/* With LIBRUNT_INDEX=lazy (we re-exec ourselves to get it), files should
+ * only be indexed when first queried by fake_dladdrs, never by the
+ * non-allocating fake_dladdr_with_cache, and concurrent first queries
+ * should build the index once. */
+
+#define NTHREADS 4
+static void *hypot_addr;
+static pthread_barrier_t barrier;
+
+static void *query_thread(void *arg)
+{
+	const void *addr = (char*) hypot_addr + 1;
+	Dl_info info;
+	pthread_barrier_wait(&barrier);
+	fake_dladdrs(&addr, 1, &info);
+	/* The name may be any of hypot's aliases. (Many libm functions are
+	 * ifuncs, whose resolved address is not the named symbol; hypot is not.) */
+	assert(info.dli_sname && info.dli_saddr == hypot_addr);
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	const char *index_str = getenv("LIBRUNT_INDEX");
+	if (!index_str || 0 != strcmp(index_str, "lazy"))
+	{
+		setenv("LIBRUNT_INDEX", "lazy", 1);
+		execv("/proc/self/exe", argv);
+		perror("execv");
+		return 1;
+	}
+	struct __runt_segments_index_stats start, s;
+	__runt_segments_get_index_stats(&start);
+	printf("at start: %lu files loaded, %lu indexed\n", start.files_loaded, start.files_indexed);
+	assert(start.files_loaded > 0);
+	assert(start.files_indexed < start.files_loaded);
+
+	Dl_info info = fake_dladdr_with_cache((char*) main + 1);
+	assert(info.dli_sname && 0 == strcmp(info.dli_sname, "main"));
+	__runt_segments_get_index_stats(&s);
+	assert(s.files_indexed == start.files_indexed);
+	unsigned long indexed_before_libm = s.files_indexed;
+
+	void *handle = dlopen("libm.so.6", RTLD_NOW|RTLD_LOCAL);
+	assert(handle);
+	hypot_addr = dlsym(handle, "hypot");
+	assert(hypot_addr);
+	__runt_segments_get_index_stats(&s);
+	_Bool fresh_libm = (s.files_loaded == start.files_loaded + 1);
+	assert(s.files_indexed == indexed_before_libm);
+
+	pthread_barrier_init(&barrier, NULL, NTHREADS);
+	pthread_t threads[NTHREADS];
+	for (unsigned i = 0; i < NTHREADS; ++i) pthread_create(&threads[i], NULL, query_thread, NULL);
+	for (unsigned i = 0; i < NTHREADS; ++i) pthread_join(threads[i], NULL);
+	__runt_segments_get_index_stats(&s);
+	printf("at end: %lu files loaded, %lu indexed\n", s.files_loaded, s.files_indexed);
+	if (fresh_libm) assert(s.files_indexed == indexed_before_libm + 1);
+	else assert(s.files_indexed <= indexed_before_libm + 1);
+	return 0;
+}
@@ -0,0 +1,81 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <link.h>
+#include "librunt.h"
+#include "dso-meta.h"
+
+/* For every loaded file, check that each segment's metavector is sorted
+ * and non-overlapping, and that fake_dladdr_with_cache (which uses the
+ * starts bitmap where there is one) finds each indexed symbol from the
+ * first, middle and last bytes of its span, and nothing in the gaps
+ * between spans. A span may start after its symbol, if clipped. */
+
+static unsigned long nchecked;
+
+static int check_cb(struct dl_phdr_info *info, size_t size, void *unused)
+{
+	const ElfW(Phdr) *first_load = NULL;
+	for (unsigned i = 0; i < info->dlpi_phnum && !first_load; ++i)
+	{
+		if (info->dlpi_phdr[i].p_type == PT_LOAD) first_load = &info->dlpi_phdr[i];
+	}
+	if (!first_load) return 0;
+	struct file_metadata *fm = __runt_files_metadata_by_addr(
+		(void*) (info->dlpi_addr + first_load->p_vaddr));
+	if (!fm || !fm->shdrs) return 0;
+	__runt_segments_ensure_symbols_indexed(fm);
+	for (unsigned i = 0; i < fm->nload; ++i)
+	{
+		struct segment_metadata *seg = &fm->segments[i];
+		ElfW(Phdr) *phdr = &fm->phdrs[seg->phdr_idx];
+		assert(seg->metavector || phdr->p_memsz > (unsigned) -1);
+		if (seg->metavector_size > 0 && phdr->p_memsz < (1ul<<20)) assert(seg->starts_bitmap);
+		uintptr_t prev_end = 0;
+		for (size_t j = 0; j < seg->metavector_size; ++j)
+		{
+			union sym_or_reloc_rec *rec = &seg->metavector[j];
+			unsigned char *strtab;
+			ElfW(Sym) *sym = __runt_segments_metavector_rec_sym(fm, rec, &strtab);
+			assert(sym);
+			assert(sym->st_size > 0);
+			assert(sym->st_value <= phdr->p_vaddr + rec->sym.vaddr_off);
+			assert(phdr->p_vaddr + rec->sym.vaddr_off < sym->st_value + sym->st_size);
+			assert(j == 0 || rec->sym.vaddr_off >= prev_end);
+			prev_end = sym->st_value + sym->st_size - phdr->p_vaddr;
+			char *start = (char*) fm->l->l_addr + sym->st_value;
+			char *span_start = (char*) fm->l->l_addr + phdr->p_vaddr + rec->sym.vaddr_off;
+			char *end = start + sym->st_size;
+			void *probes[] = { span_start, span_start + (end - span_start) / 2, end - 1 };
+			for (unsigned k = 0; k < sizeof probes / sizeof probes[0]; ++k)
+			{
+				Dl_info info = fake_dladdr_with_cache(probes[k]);
+				assert(info.dli_fname == fm->filename);
+				assert(info.dli_saddr == start);
+				assert(0 == strcmp(info.dli_sname, (char*) &strtab[sym->st_name]));
+			}
+			/* If there's a gap before the next span, it has no symbol. */
+			if (j + 1 < seg->metavector_size
+					&& seg->metavector[j + 1].sym.vaddr_off > prev_end)
+			{
+				Dl_info info = fake_dladdr_with_cache(end);
+				assert(!info.dli_sname);
+			}
+			++nchecked;
+		}
+	}
+	return 0;
+}
+
+int main(void)
+{
+	dl_iterate_phdr(check_cb, NULL);
+	printf("checked %lu symbols\n", nchecked);
+	assert(nchecked > 0);
+	/* We should find ourselves too. */
+	Dl_info info = fake_dladdr_with_cache((char*) main + 1);
+	assert(info.dli_sname && 0 == strcmp(info.dli_sname, "main"));
+	return 0;
+}
@@ -0,0 +1,132 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <dlfcn.h>
+#include <time.h>
+#include <pthread.h>
+#include "librunt.h"
+#include "relf.h"
+
+/* fake_dlsym answers RTLD_DEFAULT and RTLD_NEXT lookups from librunt's
+ * name index. It should agree with a walk of the link map, for every
+ * dynamic symbol we can see, including across dlopen() and dlclose(). */
+
+/* fake_dlsym as it was, without the index. */
+static void *walk_dlsym(void *handle, const char *symname)
+{
+	_Bool seen_ourselves = 0;
+	for (struct link_map *l = find_r_debug()->r_map; l; l = l->l_next)
+	{
+		_Bool eligible = (handle == RTLD_DEFAULT || seen_ourselves);
+		if (l->l_ld == _DYNAMIC) seen_ourselves = 1;
+		if (!eligible) continue;
+		ElfW(Sym) *found = symbol_lookup_in_object(l, symname);
+		if (found && found->st_shndx != SHN_UNDEF) return sym_to_addr(found);
+	}
+	return (void*) -1;
+}
+
+static unsigned long check_all_names(void)
+{
+	unsigned long n = 0;
+	for (struct link_map *l = find_r_debug()->r_map; l; l = l->l_next)
+	{
+		ElfW(Sym) *dynsym = get_dynsym(l);
+		ElfW(Word) *gnu_hash = get_gnu_hash(l);
+		if (!dynsym || !gnu_hash) continue;
+		unsigned char *dynstr = get_dynstr(l);
+		for (unsigned long i = gnu_hash[1]; i < gnu_hash_symbol_count(gnu_hash); ++i)
+		{
+			const char *name = (const char *) &dynstr[dynsym[i].st_name];
+			assert(fake_dlsym(RTLD_DEFAULT, name) == walk_dlsym(RTLD_DEFAULT, name));
+			assert(fake_dlsym(RTLD_NEXT, name) == walk_dlsym(RTLD_NEXT, name));
+			++n;
+		}
+	}
+	return n;
+}
+
+/* Index lookups take no lock, so they can race with dlopen() and
+ * dlclose(). (Walking the link map can't, so we ask the index directly.) */
+static volatile _Bool stop;
+static void *look_up_while_loading(void *arg)
+{
+	void *found;
+	while (!stop)
+	{
+		if (__runt_symbols_lookup_global(RTLD_DEFAULT, "malloc", _DYNAMIC, &found))
+		{
+			assert(found == (void*) malloc);
+		}
+		__runt_symbols_lookup_global(RTLD_DEFAULT, "cbrt", _DYNAMIC, &found);
+	}
+	return NULL;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(void)
+{
+	assert(fake_dlsym(RTLD_DEFAULT, "malloc") == (void*) malloc);
+	assert(fake_dlsym(RTLD_NEXT, "main") == (void*) -1);
+	assert(fake_dlsym(RTLD_DEFAULT, "no_such_symbol_anywhere") == (void*) -1);
+	unsigned long n = check_all_names();
+	printf("checked %lu names\n", n);
+
+	struct __runt_symbols_name_index_stats s;
+	__runt_symbols_get_name_index_stats(&s);
+	unsigned long objects_before = s.objects;
+	unsigned long names_before = s.names;
+	void *handle = dlopen("libm.so.6", RTLD_NOW|RTLD_LOCAL);
+	assert(handle);
+	assert(fake_dlsym(RTLD_DEFAULT, "cbrt") == dlsym(handle, "cbrt"));
+	check_all_names();
+	/* Loading adds just the new object's names... */
+	__runt_symbols_get_name_index_stats(&s);
+	assert(s.objects == objects_before + 1 && s.names > names_before);
+	dlclose(handle);
+	assert(fake_dlsym(RTLD_DEFAULT, "cbrt") == walk_dlsym(RTLD_DEFAULT, "cbrt"));
+	check_all_names();
+	/* ... and unloading takes them away again. */
+	__runt_symbols_get_name_index_stats(&s);
+	assert(s.objects == objects_before && s.names == names_before);
+
+	pthread_t t;
+	assert(0 == pthread_create(&t, NULL, look_up_while_loading, NULL));
+	for (unsigned i = 0; i < 100; ++i)
+	{
+		handle = dlopen("libm.so.6", RTLD_NOW|RTLD_LOCAL);
+		assert(handle);
+		dlclose(handle);
+	}
+	stop = 1;
+	pthread_join(t, NULL);
+	/* dlclose() withdraws the index, but rebuilds it afterwards. */
+	__runt_symbols_get_name_index_stats(&s);
+	assert(s.objects == objects_before);
+
+	printf("index has %lu names from %lu objects; %lu lookups answered, %lu declined\n",
+		s.names, s.objects, s.answered, s.declined);
+	assert(s.objects > 0 && s.answered > 2 * n);
+
+	/* Time some typical lookups. */
+	static const char *names[] = { "malloc", "printf", "dlopen", "pthread_create",
+		"no_such_symbol_anywhere" };
+	const unsigned nnames = sizeof names / sizeof names[0];
+	const unsigned iters = 100000;
+	double t0 = now();
+	for (unsigned i = 0; i < iters; ++i) fake_dlsym(RTLD_DEFAULT, names[i % nnames]);
+	double t1 = now();
+	for (unsigned i = 0; i < iters; ++i) walk_dlsym(RTLD_DEFAULT, names[i % nnames]);
+	double t2 = now();
+	printf("per lookup: %.1f ns indexed, %.1f ns walking the link map\n",
+		(t1 - t0) * 1e9 / iters, (t2 - t1) * 1e9 / iters);
+	return 0;
+}
@@ -0,0 +1,77 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <link.h>
+#include "relf.h"
+#include "librunt.h"
+#include "dso-meta.h"
+
+/* Symbols laid over one blob of code so that they overlap: B starts
+ * inside A and runs past it, N is nested in A, C runs past B and D is
+ * nested in C with the same start, E and F start together and F is the
+ * longer. The globals also land in dynsym, because of -rdynamic. For
+ * every byte, the metavector must find a containing symbol exactly when
+ * a linear search of dynsym and then symtab does. */
+__asm__(
+	".text\n"
+	".p2align 4\n"
+	".globl ov_blob\n"
+	"ov_blob:\n"
+	".fill 256,1,0xc3\n"
+	".globl ov_a\n.type ov_a,@function\n.set ov_a, ov_blob+0\n.size ov_a, 100\n"
+	".type ov_b,@function\n.set ov_b, ov_blob+50\n.size ov_b, 100\n"
+	".type ov_n,@function\n.set ov_n, ov_blob+10\n.size ov_n, 10\n"
+	".globl ov_c\n.type ov_c,@function\n.set ov_c, ov_blob+140\n.size ov_c, 20\n"
+	".type ov_d,@function\n.set ov_d, ov_blob+140\n.size ov_d, 5\n"
+	".globl ov_e\n.type ov_e,@function\n.set ov_e, ov_blob+200\n.size ov_e, 10\n"
+	".type ov_f,@function\n.set ov_f, ov_blob+200\n.size ov_f, 30\n"
+);
+extern char ov_blob[];
+
+static ElfW(Sym) *linear_lookup(struct file_metadata *fm, uintptr_t vaddr)
+{
+	ElfW(Sym) *found = NULL;
+	if (fm->dynsym && fm->dynsymndx) found = symbol_lookup_linear_by_vaddr_contained(fm->dynsym,
+		fm->dynsym + fm->shdrs[fm->dynsymndx].sh_size / fm->shdrs[fm->dynsymndx].sh_entsize,
+		vaddr);
+	if (!found && fm->symtab && fm->symtabndx) found = symbol_lookup_linear_by_vaddr_contained(fm->symtab,
+		fm->symtab + fm->shdrs[fm->symtabndx].sh_size / fm->shdrs[fm->symtabndx].sh_entsize,
+		vaddr);
+	return found;
+}
+
+static const char *sym_name_at(void *addr)
+{
+	Dl_info info = fake_dladdr_with_cache(addr);
+	return info.dli_sname;
+}
+
+int main(void)
+{
+	struct file_metadata *fm = __runt_files_metadata_by_addr(ov_blob);
+	assert(fm && fm->shdrs && fm->symtab);
+	unsigned nfound = 0;
+	for (unsigned i = 0; i < 256; ++i)
+	{
+		uintptr_t vaddr = (uintptr_t) &ov_blob[i] - fm->l->l_addr;
+		union sym_or_reloc_rec *rec;
+		_Bool indexed = __runt_segments_metavector_lookup(fm, vaddr, &rec);
+		assert(indexed);
+		ElfW(Sym) *linear = linear_lookup(fm, vaddr);
+		assert(!!rec == !!linear);
+		if (!rec) continue;
+		ElfW(Sym) *sym = __runt_segments_metavector_rec_sym(fm, rec, NULL);
+		assert(sym->st_value <= vaddr && vaddr < sym->st_value + sym->st_size);
+		++nfound;
+	}
+	printf("found symbols for %u of 256 bytes\n", nfound);
+	assert(nfound == 160 + 30);
+	/* The parts that only one symbol covers find that symbol. */
+	assert(0 == strcmp(sym_name_at(&ov_blob[120]), "ov_b"));
+	assert(0 == strcmp(sym_name_at(&ov_blob[155]), "ov_c"));
+	assert(0 == strcmp(sym_name_at(&ov_blob[220]), "ov_f"));
+	assert(!sym_name_at(&ov_blob[180]));
+	return 0;
+}
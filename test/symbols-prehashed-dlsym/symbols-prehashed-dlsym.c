@@ -0,0 +1,102 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <dlfcn.h>
+#include <time.h>
+#include "librunt.h"
+/* Walk the link map, as preload.c's bootstrap lookups may have to. */
+#define RELF_HAVE_NAME_INDEX 0
+#include "relf.h"
+
+/* FAKE_DLSYM hashes string literals at compile time. Check that it finds
+ * what fake_dlsym does, then time the RTLD_NEXT lookups that preload.c
+ * makes while bootstrapping, both by walking the link map and through
+ * librunt's name index. */
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#define BOOTSTRAP_NAMES(v) v("dlopen") v("dlerror") v("dlsym") v("dl_iterate_phdr")
+#define NBOOTSTRAP 4
+static const char *names[] = {
+#define STR(s) s,
+	BOOTSTRAP_NAMES(STR)
+};
+/* Keep the compiler from hoisting the lookups out of the loop. */
+static void *volatile sink;
+
+int main(void)
+{
+	/* The literal and run-time hashes agree, including on long names. */
+#define CHECK_HASHES(s) \
+	assert(NAMEHASH_LEN_STR(s) == strlen(s)); \
+	assert(NAMEHASH_GNU_STR(s) == namehash_gnu_scalar((s), strlen(s))); \
+	assert(NAMEHASH_SYSV_STR(s) == namehash_sysv_scalar(s));
+	BOOTSTRAP_NAMES(CHECK_HASHES)
+	CHECK_HASHES("")
+	CHECK_HASHES("_ZNSt7__cxx1112basic_stringIcSt11char_traitsIcESaIcEE")
+	CHECK_HASHES("_ZNKSt7__cxx1112basic_stringIcSt11char_traitsIcESaIcEE7compareERKS4_")
+
+	/* Same answers as fake_dlsym. (Not the real dlsym: we may be running
+	 * under librunt's preload library, whose dlsym wrapper changes what
+	 * RTLD_NEXT is next after.) */
+	for (unsigned i = 0; i < NBOOTSTRAP; ++i) assert(fake_dlsym(RTLD_NEXT, names[i]) != (void*) -1);
+#define CHECK_LOOKUP(s) assert(FAKE_DLSYM(RTLD_NEXT, s) == fake_dlsym(RTLD_NEXT, s));
+	BOOTSTRAP_NAMES(CHECK_LOOKUP)
+	assert(FAKE_DLSYM(RTLD_NEXT, "no_such_symbol_anywhere") == (void*) -1);
+	assert(FAKE_DLSYM(RTLD_DEFAULT, "printf") == fake_dlsym(RTLD_DEFAULT, "printf"));
+
+	const unsigned rounds = 20000;
+	double t0 = now();
+	for (unsigned r = 0; r < rounds; ++r)
+	{
+		/* Through a volatile pointer, so the names aren't constants. */
+		for (unsigned i = 0; i < NBOOTSTRAP; ++i)
+		{
+			const char *volatile name = names[i];
+			sink = fake_dlsym(RTLD_NEXT, name);
+		}
+	}
+	double t1 = now();
+#define LOOKUP_WALK(s) sink = FAKE_DLSYM(RTLD_NEXT, s);
+	for (unsigned r = 0; r < rounds; ++r) { BOOTSTRAP_NAMES(LOOKUP_WALK) }
+	double t2 = now();
+	printf("bootstrap RTLD_NEXT lookups, walking: %.1f ns hashed at run time, "
+		"%.1f ns prehashed\n",
+		(t1 - t0) * 1e9 / (rounds * NBOOTSTRAP), (t2 - t1) * 1e9 / (rounds * NBOOTSTRAP));
+
+	/* The name index is where hashing is a larger share of the cost. */
+	void *found;
+	for (unsigned i = 0; i < NBOOTSTRAP; ++i)
+	{
+		assert(__runt_symbols_lookup_global(RTLD_NEXT, names[i], _DYNAMIC, &found));
+		assert(found == fake_dlsym(RTLD_NEXT, names[i]));
+	}
+	t0 = now();
+	for (unsigned r = 0; r < rounds; ++r)
+	{
+		for (unsigned i = 0; i < NBOOTSTRAP; ++i)
+		{
+			const char *volatile name = names[i];
+			__runt_symbols_lookup_global(RTLD_NEXT, name, _DYNAMIC, &found);
+			sink = found;
+		}
+	}
+	t1 = now();
+#define LOOKUP_INDEX(s) \
+	__runt_symbols_lookup_global_hashed(RTLD_NEXT, s, NAMEHASH_LEN_STR(s), \
+		NAMEHASH_GNU_STR(s), _DYNAMIC, &found); \
+	sink = found;
+	for (unsigned r = 0; r < rounds; ++r) { BOOTSTRAP_NAMES(LOOKUP_INDEX) }
+	t2 = now();
+	printf("bootstrap RTLD_NEXT lookups, indexed: %.1f ns hashed at run time, "
+		"%.1f ns prehashed\n",
+		(t1 - t0) * 1e9 / (rounds * NBOOTSTRAP), (t2 - t1) * 1e9 / (rounds * NBOOTSTRAP));
+	return 0;
+}
@@ -0,0 +1,159 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "namehash.h"
+
+/* The vector kernels in namehash.h must agree with the scalar ones for
+ * every length and alignment, and must not read into an unmapped page
+ * however close to one the string ends. Then time the scalar and the
+ * dispatched versions on long (C++-sized) names. We're built with
+ * -DNDEBUG, so we check with explicit tests, not assert(). */
+
+#define CHECK(cond) do { if (!(cond)) { \
+	fprintf(stderr, "check failed at line %d: %s\n", __LINE__, #cond); abort(); } } while (0)
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fill_name(char *s, size_t len)
+{
+	static const char chars[] =
+		"abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_$.@";
+	for (size_t i = 0; i < len; ++i) s[i] = chars[rand() % (sizeof chars - 1)];
+	/* Some high-bit bytes too, since the hashes see them as unsigned. */
+	if (len > 3) s[len / 2] = (char) (0x80 | rand());
+	s[len] = '\0';
+}
+
+static void check_one(const char *s, size_t len, char *copy)
+{
+	CHECK(namehash_strlen_scalar(s) == len);
+	CHECK(namehash_strlen(s) == len);
+	uint32_t gnu = namehash_gnu_scalar(s, len);
+	CHECK(namehash_gnu(s, len) == gnu);
+	memcpy(copy, s, len + 1);
+	CHECK(namehash_streq_len_scalar(copy, s, len));
+	CHECK(namehash_streq_len(copy, s, len));
+#ifdef NAMEHASH_HAVE_SIMD
+	CHECK(namehash_strlen_sse2(s) == len);
+	CHECK(namehash_streq_len_sse2(copy, s, len));
+	if (NAMEHASH_USE_AVX2)
+	{
+		CHECK(namehash_strlen_avx2(s) == len);
+		CHECK(namehash_gnu_avx2(s, len) == gnu);
+		CHECK(namehash_streq_len_avx2(copy, s, len));
+	}
+#endif
+	/* A differing byte, or a longer entry, is a mismatch. */
+	if (len > 0)
+	{
+		copy[rand() % len] ^= 0x20;
+		CHECK(!namehash_streq_len(copy, s, len));
+		memcpy(copy, s, len + 1);
+	}
+	copy[len] = 'x'; copy[len + 1] = '\0';
+	CHECK(!namehash_streq_len(copy, s, len));
+}
+
+int main(void)
+{
+	srand(42);
+	/* Every length up to 300, at every alignment within a vector. */
+	static char buf[512 + 64], copy[512 + 64];
+	for (size_t len = 0; len <= 300; ++len)
+	{
+		for (unsigned align = 0; align < 32; ++align)
+		{
+			fill_name(buf + align, len);
+			check_one(buf + align, len, copy + (len + align) % 32);
+		}
+	}
+	/* Names ending right at an unmapped page. */
+	long pagesz = sysconf(_SC_PAGESIZE);
+	char *pages = mmap(NULL, 2 * pagesz, PROT_READ|PROT_WRITE,
+		MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	CHECK(pages != MAP_FAILED);
+	CHECK(0 == mprotect(pages + pagesz, pagesz, PROT_NONE));
+	for (size_t len = 0; len <= 300; ++len)
+	{
+		char *s = pages + pagesz - len - 1;
+		fill_name(s, len);
+		check_one(s, len, copy);
+		/* Also as the entry we compare against. */
+		memcpy(copy, s, len + 1);
+		CHECK(namehash_streq_len(s, copy, len));
+	}
+	/* The multi-lane hasher, on a mix of lengths. */
+	enum { NMANY = 1000 };
+	static char names_buf[NMANY][128];
+	static const char *names[NMANY];
+	static uint32_t gnu[NMANY], sysv[NMANY];
+	static size_t lens[NMANY];
+	for (unsigned i = 0; i < NMANY; ++i)
+	{
+		fill_name(names_buf[i], rand() % 127);
+		names[i] = names_buf[i];
+	}
+	for (unsigned n = 0; n <= NMANY; n += (n < 40) ? 1 : 137)
+	{
+		memset(gnu, 0, sizeof gnu);
+		namehash_many(names, n, gnu, sysv, lens);
+		for (unsigned i = 0; i < n; ++i)
+		{
+			CHECK(lens[i] == strlen(names[i]));
+			CHECK(gnu[i] == namehash_gnu_scalar(names[i], lens[i]));
+			CHECK(sysv[i] == namehash_sysv_scalar(names[i]));
+		}
+	}
+
+	/* Benchmark: hash and compare 200-byte names, as from C++ mangling. */
+	enum { NBENCH = 256, BENCHLEN = 200, ROUNDS = 2000 };
+	static char bench_names[NBENCH][BENCHLEN + 1], bench_copies[NBENCH][BENCHLEN + 1];
+	for (unsigned i = 0; i < NBENCH; ++i)
+	{
+		fill_name(bench_names[i], BENCHLEN);
+		memcpy(bench_copies[i], bench_names[i], BENCHLEN + 1);
+	}
+	volatile uint32_t sink = 0;
+	double t0 = now();
+	for (unsigned r = 0; r < ROUNDS; ++r)
+	{
+		for (unsigned i = 0; i < NBENCH; ++i)
+		{
+			const char *s = bench_names[i];
+			size_t len = namehash_strlen_scalar(s);
+			sink += namehash_gnu_scalar(s, len);
+			sink += namehash_streq_len_scalar(bench_copies[i], s, len);
+		}
+	}
+	double t1 = now();
+	for (unsigned r = 0; r < ROUNDS; ++r)
+	{
+		for (unsigned i = 0; i < NBENCH; ++i)
+		{
+			const char *s = bench_names[i];
+			size_t len = namehash_strlen(s);
+			sink += namehash_gnu(s, len);
+			sink += namehash_streq_len(bench_copies[i], s, len);
+		}
+	}
+	double t2 = now();
+	printf("%d-byte names: %.1f ns scalar, %.1f ns dispatched (%s)\n", BENCHLEN,
+		(t1 - t0) * 1e9 / (ROUNDS * NBENCH), (t2 - t1) * 1e9 / (ROUNDS * NBENCH),
+#ifdef NAMEHASH_HAVE_SIMD
+		NAMEHASH_USE_AVX2 ? "avx2" : "sse2"
+#else
+		"no simd"
+#endif
+		);
+	return 0;
+}
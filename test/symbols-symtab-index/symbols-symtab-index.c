@@ -0,0 +1,97 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <dlfcn.h>
+#include <time.h>
+#include "librunt.h"
+#include "dso-meta.h"
+
+/* __runt_symbols_lookup_by_name should find the same symtab entries as
+ * a linear scan, locals included or not, and much faster on a file with
+ * a large symtab. */
+
+static ElfW(Sym) *linear_lookup(struct file_metadata *fm, const char *name, _Bool include_locals)
+{
+	ElfW(Sym) *end = fm->symtab + fm->shdrs[fm->symtabndx].sh_size / sizeof (ElfW(Sym));
+	for (ElfW(Sym) *sym = fm->symtab; sym < end; ++sym)
+	{
+		if (sym->st_name && sym->st_shndx != SHN_UNDEF
+				&& (include_locals || ELF64_ST_BIND(sym->st_info) != STB_LOCAL)
+				&& 0 == strcmp((const char *) &fm->strtab[sym->st_name], name))
+		{ return sym; }
+	}
+	return NULL;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(void)
+{
+	struct file_metadata *exe = __runt_files_metadata_by_addr((void*) main);
+	assert(exe);
+	ElfW(Sym) *sym = __runt_symbols_lookup_by_name(exe, "main", 0);
+	assert(sym && (char*) exe->l->l_addr + sym->st_value == (char*) main);
+	assert(!__runt_symbols_lookup_by_name(exe, "no_such_symbol", 1));
+
+	void *handle = dlopen("./libmanysyms.so", RTLD_NOW|RTLD_LOCAL);
+	assert(handle);
+	void *global0 = dlsym(handle, "global_fn_0");
+	assert(global0);
+	struct file_metadata *fm = __runt_files_metadata_by_addr(global0);
+	assert(fm && fm->symtab);
+	size_t nsyms = fm->shdrs[fm->symtabndx].sh_size / sizeof (ElfW(Sym));
+	printf("libmanysyms.so has %zu symtab entries\n", nsyms);
+	assert(nsyms >= 100000);
+
+	/* Every named symbol is found, as itself or an earlier namesake; only
+	 * globals are found without include_locals. */
+	for (size_t i = 0; i < nsyms; ++i)
+	{
+		ElfW(Sym) *s = &fm->symtab[i];
+		if (!s->st_name || s->st_shndx == SHN_UNDEF) continue;
+		const char *name = (const char *) &fm->strtab[s->st_name];
+		ElfW(Sym) *found = __runt_symbols_lookup_by_name(fm, name, 1);
+		assert(found && found <= s && 0 == strcmp((const char *) &fm->strtab[found->st_name], name));
+		found = __runt_symbols_lookup_by_name(fm, name, 0);
+		if (0 == strncmp(name, "local_fn_", 9)) assert(!found);
+		if (0 == strncmp(name, "global_fn_", 10)) assert(found == s);
+	}
+	/* A sample agrees exactly with the linear scan, including misses. */
+	char name[64];
+	for (unsigned i = 0; i < 200; ++i)
+	{
+		snprintf(name, sizeof name, "%s_fn_%u", (i % 2) ? "local" : "global", i * 997 % 120000);
+		for (int locals = 0; locals < 2; ++locals)
+		{
+			assert(__runt_symbols_lookup_by_name(fm, name, locals) == linear_lookup(fm, name, locals));
+		}
+	}
+
+	/* Benchmark. */
+	const unsigned iters = 200000, linear_iters = 200;
+	unsigned long nfound = 0;
+	double t0 = now();
+	for (unsigned i = 0; i < iters; ++i)
+	{
+		snprintf(name, sizeof name, "local_fn_%u", i * 7919 % 110000);
+		nfound += !!__runt_symbols_lookup_by_name(fm, name, 1);
+	}
+	double t1 = now();
+	for (unsigned i = 0; i < linear_iters; ++i)
+	{
+		snprintf(name, sizeof name, "local_fn_%u", i * 7919 % 110000);
+		nfound += !!linear_lookup(fm, name, 1);
+	}
+	double t2 = now();
+	printf("per lookup: %.1f ns indexed, %.1f ns linear (%lu found)\n",
+		(t1 - t0) * 1e9 / iters, (t2 - t1) * 1e9 / linear_iters, nfound);
+	dlclose(handle);
+	return 0;
+}
@@ -0,0 +1,267 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+#include <sys/stat.h>
+#include <link.h>
+#include "vas.h"
+#include "dso-meta.h"
+
+/* embed-meta: copy an ELF file, adding librunt's symbol index to it, so
+ * that at run time librunt can use the index in place instead of building
+ * it. Usage: embed-meta <in> <out>
+ *
+ * The index goes at the end of the file in a new read-only PT_LOAD, after
+ * the virtual address range of everything else. Since that needs a new
+ * phdr, we put a new copy of the phdrs in that segment too (and point
+ * PT_PHDR, if any, at it). A new PT_NOTE holds a librunt_meta_note saying
+ * where the index is. We also add section headers, .note.librunt and
+ * .librunt.meta, for the benefit of readelf et al.; that means a new
+ * shstrtab and section header table, which go after the new segment. */
+
+static const char note_scn_name[] = ".note.librunt";
+static const char meta_scn_name[] = ".librunt.meta";
+
+struct layout
+{
+	size_t in_size;
+	unsigned phnum;          /* new phnum, including our two */
+	unsigned last_load_idx;  /* our PT_LOAD goes after this one */
+	uintptr_t align;
+	size_t seg_off;          /* file offset of our PT_LOAD... */
+	uintptr_t seg_vaddr;     /* ... and its vaddr */
+	size_t note_rel;         /* offsets within it */
+	size_t meta_rel;
+	size_t meta_size;
+	size_t shstrtab_off;
+	size_t shstrtab_size;
+	size_t shdrs_off;
+	size_t total_size;
+};
+
+#define NOTE_SIZE (sizeof (ElfW(Nhdr)) + ROUND_UP(sizeof LIBRUNT_NOTE_NAME, 4) \
+	+ sizeof (struct librunt_meta_note))
+
+static void compute_layout(const char *in, size_t in_size, size_t meta_size, struct layout *lo)
+{
+	const ElfW(Ehdr) *ehdr = (const ElfW(Ehdr) *) in;
+	const ElfW(Phdr) *phdrs = (const ElfW(Phdr) *) (in + ehdr->e_phoff);
+	const ElfW(Shdr) *shdrs = (const ElfW(Shdr) *) (in + ehdr->e_shoff);
+	uintptr_t align = sysconf(_SC_PAGESIZE);
+	uintptr_t vaddr_end = 0;
+	_Bool seen_load = 0;
+	for (unsigned i = 0; i < ehdr->e_phnum; ++i)
+	{
+		if (phdrs[i].p_type != PT_LOAD) continue;
+		seen_load = 1;
+		lo->last_load_idx = i;
+		if (phdrs[i].p_align > align) align = phdrs[i].p_align;
+		if (phdrs[i].p_vaddr + phdrs[i].p_memsz > vaddr_end) vaddr_end = phdrs[i].p_vaddr + phdrs[i].p_memsz;
+	}
+	if (!seen_load) errx(1, "no PT_LOAD");
+	lo->in_size = in_size;
+	lo->align = align;
+	lo->phnum = ehdr->e_phnum + 2;
+	lo->seg_off = ROUND_UP(in_size, align);
+	lo->seg_vaddr = ROUND_UP(vaddr_end, align);
+	lo->note_rel = ROUND_UP(lo->phnum * sizeof (ElfW(Phdr)), 4);
+	lo->meta_rel = ROUND_UP(lo->note_rel + NOTE_SIZE, 8);
+	lo->meta_size = meta_size;
+	lo->shstrtab_off = lo->seg_off + lo->meta_rel + meta_size;
+	lo->shstrtab_size = shdrs[ehdr->e_shstrndx].sh_size + sizeof note_scn_name + sizeof meta_scn_name;
+	lo->shdrs_off = ROUND_UP(lo->shstrtab_off + lo->shstrtab_size, sizeof (void*));
+	lo->total_size = lo->shdrs_off + (ehdr->e_shnum + 2) * sizeof (ElfW(Shdr));
+}
+
+/* Make the output image, with the index (if we have it yet) copied in. */
+static char *make_image(const char *in, const struct layout *lo, const void *meta)
+{
+	char *out = calloc(1, lo->total_size);
+	if (!out) err(1, "allocating output");
+	memcpy(out, in, lo->in_size);
+	ElfW(Ehdr) *ehdr = (ElfW(Ehdr) *) out;
+	const ElfW(Phdr) *old_phdrs = (const ElfW(Phdr) *) (in + ehdr->e_phoff);
+	const ElfW(Shdr) *old_shdrs = (const ElfW(Shdr) *) (in + ehdr->e_shoff);
+	unsigned old_phnum = ehdr->e_phnum;
+	unsigned old_shnum = ehdr->e_shnum;
+
+	/* Phdrs: the old ones with our PT_LOAD after the last PT_LOAD (they must
+	 * stay in vaddr order), then our PT_NOTE. */
+	ElfW(Phdr) *phdrs = (ElfW(Phdr) *) (out + lo->seg_off);
+	size_t seg_size = lo->meta_rel + lo->meta_size;
+	unsigned n = 0;
+	for (unsigned i = 0; i < old_phnum; ++i)
+	{
+		phdrs[n] = old_phdrs[i];
+		if (phdrs[n].p_type == PT_PHDR)
+		{
+			phdrs[n].p_offset = lo->seg_off;
+			phdrs[n].p_vaddr = phdrs[n].p_paddr = lo->seg_vaddr;
+			phdrs[n].p_filesz = phdrs[n].p_memsz = lo->phnum * sizeof (ElfW(Phdr));
+		}
+		++n;
+		if (i == lo->last_load_idx) phdrs[n++] = (ElfW(Phdr)) {
+			.p_type = PT_LOAD,
+			.p_flags = PF_R,
+			.p_offset = lo->seg_off,
+			.p_vaddr = lo->seg_vaddr,
+			.p_paddr = lo->seg_vaddr,
+			.p_filesz = seg_size,
+			.p_memsz = seg_size,
+			.p_align = lo->align
+		};
+	}
+	phdrs[n++] = (ElfW(Phdr)) {
+		.p_type = PT_NOTE,
+		.p_flags = PF_R,
+		.p_offset = lo->seg_off + lo->note_rel,
+		.p_vaddr = lo->seg_vaddr + lo->note_rel,
+		.p_paddr = lo->seg_vaddr + lo->note_rel,
+		.p_filesz = NOTE_SIZE,
+		.p_memsz = NOTE_SIZE,
+		.p_align = 4
+	};
+	ehdr->e_phoff = lo->seg_off;
+	ehdr->e_phnum = n;
+
+	/* The note. */
+	char *note = out + lo->seg_off + lo->note_rel;
+	*(ElfW(Nhdr) *) note = (ElfW(Nhdr)) {
+		.n_namesz = sizeof LIBRUNT_NOTE_NAME,
+		.n_descsz = sizeof (struct librunt_meta_note),
+		.n_type = NT_LIBRUNT_META
+	};
+	memcpy(note + sizeof (ElfW(Nhdr)), LIBRUNT_NOTE_NAME, sizeof LIBRUNT_NOTE_NAME);
+	struct librunt_meta_note desc = {
+		.symidx_vaddr = lo->seg_vaddr + lo->meta_rel,
+		.symidx_size = lo->meta_size
+	};
+	memcpy(note + sizeof (ElfW(Nhdr)) + ROUND_UP(sizeof LIBRUNT_NOTE_NAME, 4), &desc, sizeof desc);
+	if (meta) memcpy(out + lo->seg_off + lo->meta_rel, meta, lo->meta_size);
+
+	/* Sections: a new shstrtab with our names on the end, and new shdrs. */
+	const ElfW(Shdr) *old_shstrtab = &old_shdrs[ehdr->e_shstrndx];
+	char *shstrtab = out + lo->shstrtab_off;
+	memcpy(shstrtab, in + old_shstrtab->sh_offset, old_shstrtab->sh_size);
+	size_t note_name_off = old_shstrtab->sh_size;
+	size_t meta_name_off = note_name_off + sizeof note_scn_name;
+	memcpy(shstrtab + note_name_off, note_scn_name, sizeof note_scn_name);
+	memcpy(shstrtab + meta_name_off, meta_scn_name, sizeof meta_scn_name);
+	ElfW(Shdr) *shdrs = (ElfW(Shdr) *) (out + lo->shdrs_off);
+	memcpy(shdrs, old_shdrs, old_shnum * sizeof (ElfW(Shdr)));
+	shdrs[ehdr->e_shstrndx].sh_offset = lo->shstrtab_off;
+	shdrs[ehdr->e_shstrndx].sh_size = lo->shstrtab_size;
+	shdrs[old_shnum] = (ElfW(Shdr)) {
+		.sh_name = note_name_off,
+		.sh_type = SHT_NOTE,
+		.sh_flags = SHF_ALLOC,
+		.sh_addr = lo->seg_vaddr + lo->note_rel,
+		.sh_offset = lo->seg_off + lo->note_rel,
+		.sh_size = NOTE_SIZE,
+		.sh_addralign = 4
+	};
+	shdrs[old_shnum + 1] = (ElfW(Shdr)) {
+		.sh_name = meta_name_off,
+		.sh_type = SHT_PROGBITS,
+		.sh_flags = SHF_ALLOC,
+		.sh_addr = lo->seg_vaddr + lo->meta_rel,
+		.sh_offset = lo->seg_off + lo->meta_rel,
+		.sh_size = lo->meta_size,
+		.sh_addralign = 8
+	};
+	ehdr->e_shoff = lo->shdrs_off;
+	ehdr->e_shnum = old_shnum + 2;
+	return out;
+}
+
+static _Bool has_librunt_note(const char *in, size_t in_size)
+{
+	const ElfW(Ehdr) *ehdr = (const ElfW(Ehdr) *) in;
+	const ElfW(Phdr) *phdrs = (const ElfW(Phdr) *) (in + ehdr->e_phoff);
+	for (unsigned i = 0; i < ehdr->e_phnum; ++i)
+	{
+		if (phdrs[i].p_type != PT_NOTE || phdrs[i].p_offset > in_size
+				|| phdrs[i].p_filesz > in_size - phdrs[i].p_offset) continue;
+		uintptr_t align = (phdrs[i].p_align == 8) ? 8 : 4;
+		const char *pos = in + phdrs[i].p_offset;
+		const char *end = pos + phdrs[i].p_filesz;
+		while (pos + sizeof (ElfW(Nhdr)) <= end)
+		{
+			const ElfW(Nhdr) *nhdr = (const ElfW(Nhdr) *) pos;
+			if (nhdr->n_type == NT_LIBRUNT_META && nhdr->n_namesz == sizeof LIBRUNT_NOTE_NAME
+					&& 0 == memcmp(pos + sizeof *nhdr, LIBRUNT_NOTE_NAME, sizeof LIBRUNT_NOTE_NAME))
+				return 1;
+			pos += ROUND_UP(sizeof *nhdr + nhdr->n_namesz, align) + ROUND_UP(nhdr->n_descsz, align);
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc != 3)
+	{
+		fprintf(stderr, "usage: %s <input ELF file> <output ELF file>\n", argv[0]);
+		return 2;
+	}
+	int fd = open(argv[1], O_RDONLY);
+	if (fd == -1) err(1, "opening %s", argv[1]);
+	struct stat st;
+	if (fstat(fd, &st) == -1) err(1, "stat'ing %s", argv[1]);
+	size_t in_size = st.st_size;
+	char *in = malloc(in_size);
+	if (!in) err(1, "allocating input");
+	for (size_t got = 0; got < in_size; )
+	{
+		ssize_t ret = read(fd, in + got, in_size - got);
+		if (ret <= 0) err(1, "reading %s", argv[1]);
+		got += ret;
+	}
+	close(fd);
+
+	const ElfW(Ehdr) *ehdr = (const ElfW(Ehdr) *) in;
+	if (in_size < sizeof *ehdr || 0 != memcmp(ehdr->e_ident, ELFMAG, SELFMAG)
+			|| ehdr->e_ident[EI_CLASS] != (sizeof (void*) == 8 ? ELFCLASS64 : ELFCLASS32)
+			|| (ehdr->e_type != ET_EXEC && ehdr->e_type != ET_DYN)
+			|| ehdr->e_phoff > in_size || ehdr->e_phnum * sizeof (ElfW(Phdr)) > in_size - ehdr->e_phoff
+			|| ehdr->e_shoff > in_size || ehdr->e_shnum * sizeof (ElfW(Shdr)) > in_size - ehdr->e_shoff
+			|| ehdr->e_shstrndx == SHN_UNDEF || ehdr->e_shstrndx >= ehdr->e_shnum)
+		errx(1, "%s: not a native ELF executable or shared object with section headers", argv[1]);
+	if (has_librunt_note(in, in_size)) errx(1, "%s: already has an embedded index", argv[1]);
+
+	/* The index describes every PT_LOAD, including its own, so build it
+	 * from the output image. Its size doesn't depend on its own segment's
+	 * size (which holds no symbols), so once we know its size from a
+	 * first build, a second build will fit. */
+	struct layout lo;
+	compute_layout(in, in_size, 0, &lo);
+	char *out = make_image(in, &lo, NULL);
+	size_t meta_size;
+	void *meta = __runt_segments_build_embeddable_index(out, lo.total_size, &meta_size);
+	if (!meta) errx(1, "%s: could not build symbols index", argv[1]);
+	free(meta);
+	free(out);
+	compute_layout(in, in_size, meta_size, &lo);
+	out = make_image(in, &lo, NULL);
+	size_t final_size;
+	meta = __runt_segments_build_embeddable_index(out, lo.total_size, &final_size);
+	if (!meta || final_size != meta_size) errx(1, "%s: symbols index changed size", argv[1]);
+	memcpy(out + lo.seg_off + lo.meta_rel, meta, meta_size);
+
+	int out_fd = open(argv[2], O_WRONLY|O_CREAT|O_TRUNC, st.st_mode & 07777);
+	if (out_fd == -1) err(1, "opening %s", argv[2]);
+	for (size_t written = 0; written < lo.total_size; )
+	{
+		ssize_t ret = write(out_fd, out + written, lo.total_size - written);
+		if (ret <= 0) err(1, "writing %s", argv[2]);
+		written += ret;
+	}
+	close(out_fd);
+	free(meta);
+	free(out);
+	free(in);
+	return 0;
+}